@@ -0,0 +1,112 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Admission control for chat: every message must fit its sender's rate and
+// its room's rate before it is queued for dispatch, and nothing is queued
+// while the dispatch queues already hold too many bytes.
+
+// Rates for one sender or one room; 0 leaves that dimension unlimited
+struct RateLimit {
+    double messagesPerSecond = 0;
+    double bytesPerSecond = 0;
+};
+
+enum class FloodPolicy {
+    Reject, // over a limit, the message is dropped and the sender told once
+    Delay   // every message is kept, and the sender's socket is not read until it is back within its limits
+};
+
+struct AdmissionLimits {
+    RateLimit client{20, 64 * 1024};
+    RateLimit room{2000, 4 * 1024 * 1024};
+    double burstSeconds = 2;                      // how far ahead of its rates a sender or room may get
+    size_t queuedBytesLimit = 64 * 1024 * 1024;   // chat waiting for the dispatch workers, across the server
+    FloodPolicy policy = FloodPolicy::Reject;
+};
+
+// How long a sender is held off under Delay while the dispatch queues are over their limit
+constexpr uint64_t kOverloadPauseNs = 10'000'000;
+
+// A token bucket kept as the generic cell rate algorithm: instead of a token
+// count it holds the time at which the bucket would be full again, so taking
+// tokens is one compare-and-swap and nothing needs refilling. Senders on
+// different loops share a room's bucket without a lock.
+class TokenBucket {
+public:
+    // Charges `cost` when it fits in `burst` ns of backlog and returns 0;
+    // otherwise charges nothing and returns how long until it would fit.
+    // A cost larger than the whole burst still passes on an idle bucket.
+    uint64_t tryTake(double cost, double perSecond, uint64_t burst, uint64_t now) {
+        uint64_t price = priceOf(cost, perSecond);
+        uint64_t full = fullAt.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t start = std::max(full, now);
+            uint64_t backlog = start - now + price;
+            if (backlog > burst && start > now) {
+                return backlog - burst;
+            }
+            if (fullAt.compare_exchange_weak(full, start + price, std::memory_order_relaxed)) {
+                return 0;
+            }
+        }
+    }
+
+    // Always charges; returns how far past `burst` the backlog now is
+    uint64_t take(double cost, double perSecond, uint64_t burst, uint64_t now) {
+        uint64_t price = priceOf(cost, perSecond);
+        uint64_t full = fullAt.load(std::memory_order_relaxed);
+        uint64_t next;
+        do {
+            next = std::max(full, now) + price;
+        } while (!fullAt.compare_exchange_weak(full, next, std::memory_order_relaxed));
+        return next - now > burst ? next - now - burst : 0;
+    }
+
+    void refund(double cost, double perSecond) {
+        fullAt.fetch_sub(priceOf(cost, perSecond), std::memory_order_relaxed);
+    }
+
+private:
+    std::atomic<uint64_t> fullAt{0}; // monotonic ns
+
+    static uint64_t priceOf(double cost, double perSecond) {
+        return perSecond > 0 ? static_cast<uint64_t>(cost * 1e9 / perSecond) : 0;
+    }
+};
+
+// A message rate and a byte rate, charged together
+class RateLimiter {
+public:
+    // Charges both or neither. Returns 0 when the message fits, otherwise how long until it would.
+    uint64_t tryAdmit(const RateLimit& limit, uint64_t burst, size_t bytes, uint64_t now) {
+        uint64_t wait = messages.tryTake(1, limit.messagesPerSecond, burst, now);
+        if (wait > 0) {
+            return wait;
+        }
+        wait = volume.tryTake(static_cast<double>(bytes), limit.bytesPerSecond, burst, now);
+        if (wait > 0) {
+            messages.refund(1, limit.messagesPerSecond);
+        }
+        return wait;
+    }
+
+    // Always charges; returns how long the sender should now hold off
+    uint64_t admit(const RateLimit& limit, uint64_t burst, size_t bytes, uint64_t now) {
+        return std::max(messages.take(1, limit.messagesPerSecond, burst, now),
+                        volume.take(static_cast<double>(bytes), limit.bytesPerSecond, burst, now));
+    }
+
+    // Gives back a message charged by tryAdmit that was turned away elsewhere
+    void refund(const RateLimit& limit, size_t bytes) {
+        messages.refund(1, limit.messagesPerSecond);
+        volume.refund(static_cast<double>(bytes), limit.bytesPerSecond);
+    }
+
+private:
+    TokenBucket messages;
+    TokenBucket volume;
+};
@@ -0,0 +1,1095 @@
+// File relay throughput benchmark: the original 1 KB ifstream/ofstream path
+// against the sendfile() download path and the UploadWriter upload path,
+// plus the CRC-32C and SHA-256 kernels that checksum and address every upload.
+//
+//   bench [--suite files|chat|micro|transport|compression|rooms|all] [--size MB] [--chunk bytes]
+//         [--dir path] [--rounds n] [--messages n] [--clients n] [--threads n]
+//
+// Downloads go over a loopback TCP connection to a thread that reads and
+// discards, so both sides of the copy are real socket work.
+//
+// It then runs chat messages through the server's per-message path and
+// counts heap allocations on that thread. Once the buffer pool and queues
+// have grown to cover the frames in flight, a message should not allocate;
+// the exit status is 1 if more than one message in a thousand still does.
+//
+// The micro suite times the pieces of the chat path on their own: frame
+// parsing out of a RingBuffer, room lookups in the RoomRegistry, and one
+// message fanned out to a room's OutboundQueues and flushed.
+//
+// The transport suite runs the same Connections on an epoll and an io_uring
+// EventLoop: broadcasts from another thread to every client, and frames
+// from every client parsed on the loop.
+//
+// The compression suite runs the LZ4 codec over chat lines (alone and
+// against a room dictionary trained on earlier lines), a log file and
+// random bytes, each the way the server would send them, and reports the
+// ratio, throughput and CPU time spent per byte kept off the wire.
+//
+// The rooms suite scales the broadcast path to rooms of 10, 1k and 50k
+// members: chat fanned out by the room's worker alone and split across a
+// FanoutPool, and a wave of joins announced one notice per join against the
+// same wave coalesced into a PresenceBatch.
+#include <iostream>
+#include <fstream>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <functional>
+#include <filesystem>
+#include <random>
+#include <cstring>
+#include <csignal>
+#include <new>
+#include <array>
+#include <cstdlib>
+#include <future>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "net.h"
+#include "protocol.h"
+#include "file_relay.h"
+#include "crc32c.h"
+#include "sha256.h"
+#include "compression.h"
+#include "outbound_queue.h"
+#include "connection.h"
+#include "session_table.h"
+#include "history_log.h"
+#include "fanout.h"
+#include "presence.h"
+
+// Every heap allocation made by the thread, for the chat path check
+thread_local uint64_t threadAllocations = 0;
+
+// Every form of new and delete is replaced, so memory from any of them is
+// counted and handed back to free(), aligned_alloc() included
+void* countedAlloc(size_t size, size_t alignment = 0) {
+    threadAllocations++;
+    size = size == 0 ? 1 : size;
+    if (alignment == 0) {
+        return std::malloc(size);
+    }
+    return std::aligned_alloc(alignment, (size + alignment - 1) / alignment * alignment);
+}
+
+void* countedAllocOrThrow(size_t size, size_t alignment = 0) {
+    if (void* memory = countedAlloc(size, alignment)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size) {
+    return countedAllocOrThrow(size);
+}
+
+void* operator new[](size_t size) {
+    return countedAllocOrThrow(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment) {
+    return countedAllocOrThrow(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment) {
+    return countedAllocOrThrow(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept {
+    return countedAlloc(size);
+}
+
+void* operator new(size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return countedAlloc(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    return countedAlloc(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::align_val_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory, std::align_val_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, size_t, std::align_val_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory, size_t, std::align_val_t) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::align_val_t, const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+
+void operator delete[](void* memory, std::align_val_t, const std::nothrow_t&) noexcept {
+    std::free(memory);
+}
+
+struct BenchConfig {
+    std::string suite = "all";
+    size_t sizeMB = 64;
+    size_t chunkSize = kDefaultFileChunkSize;
+    std::filesystem::path dir = std::filesystem::temp_directory_path();
+    int rounds = 3;
+    size_t messages = 200000;
+    size_t clients = 1000; // connections per backend in the transport suite
+    size_t threads = std::max(1u, std::thread::hardware_concurrency() / 2); // fan-out pool threads in the rooms suite
+};
+
+// A connected loopback pair; the receiving end is drained on its own thread
+class LoopbackSink {
+public:
+    LoopbackSink() {
+        SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (listener == INVALID_SOCKET || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+            listen(listener, 1) == SOCKET_ERROR || getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) == SOCKET_ERROR) {
+            std::cerr << "Failed to set up loopback listener" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        sender = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(sender, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR) {
+            std::cerr << "Failed to connect to loopback listener" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        receiver = accept(listener, nullptr, nullptr);
+        closesocket(listener);
+
+        drainer = std::thread([this]() {
+            std::vector<char> buffer(256 * 1024);
+            while (recv(receiver, buffer.data(), buffer.size(), 0) > 0) {
+            }
+        });
+    }
+
+    ~LoopbackSink() {
+        shutdown(sender, SHUT_WR);
+        drainer.join();
+        closesocket(sender);
+        closesocket(receiver);
+    }
+
+    SOCKET sendSocket() const {
+        return sender;
+    }
+
+private:
+    SOCKET sender;
+    SOCKET receiver;
+    std::thread drainer;
+};
+
+bool sendAll(SOCKET socket, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(socket, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        length -= static_cast<size_t>(sent);
+    }
+    return true;
+}
+
+// The original download loop: 1 KB reads, one send() each
+void legacyDownload(const std::filesystem::path& path, SOCKET socket) {
+    std::ifstream file(path, std::ios::binary);
+    char buffer[1024];
+    while (!file.eof()) {
+        file.read(buffer, sizeof(buffer));
+        sendAll(socket, buffer, static_cast<size_t>(file.gcount()));
+    }
+}
+
+// The relay's download path: a FileData header, then the range via sendfile()
+void relayDownload(const std::filesystem::path& path, SOCKET socket, size_t chunkSize) {
+    std::shared_ptr<FileHandle> file = FileHandle::open(path.string());
+    uint64_t size = file->size();
+    for (uint64_t offset = 0; offset < size;) {
+        size_t length = static_cast<size_t>(std::min<uint64_t>(chunkSize, size - offset));
+        std::string header;
+        header.push_back(static_cast<char>(FrameType::FileData));
+        header.append(3, 0);
+        putU32(header, static_cast<uint32_t>(length));
+        sendAll(socket, header.data(), header.size());
+
+        size_t done = 0;
+        while (done < length) {
+            ssize_t sent = sendFileRange(socket, *file, offset + done, length - done);
+            if (sent <= 0) {
+                return;
+            }
+            done += static_cast<size_t>(sent);
+        }
+        offset += length;
+    }
+}
+
+// The original upload loop: every 1 KB recv() written through an ofstream
+void legacyUpload(const std::filesystem::path& path, const std::string& data) {
+    std::ofstream file(path, std::ios::binary);
+    for (size_t offset = 0; offset < data.size(); offset += 1024) {
+        file.write(data.data() + offset, static_cast<std::streamsize>(std::min<size_t>(1024, data.size() - offset)));
+    }
+}
+
+// The relay's upload path: FileData payloads as they come off the wire
+void relayUpload(const std::filesystem::path& path, const std::string& data, size_t chunkSize) {
+    UploadWriter writer(chunkSize);
+    writer.open(path.string());
+    std::string_view remaining = data;
+    while (!remaining.empty()) {
+        size_t length = std::min(kFileChunkSize, remaining.size());
+        writer.write(remaining.substr(0, length));
+        remaining.remove_prefix(length);
+    }
+    writer.close();
+}
+
+// One sender's chat frames, read off a socket into a RingBuffer and parsed,
+// framed once as "name: text", logged to history and queued to every
+// recipient, whose sockets are flushed and drained as the server would. Half
+// of the recipients read compressed chat, so each message is also
+// compressed against the room's dictionary, which keeps training.
+// Returns allocations per message over the second half, after warm-up.
+double chatPathAllocations(size_t messages, const std::filesystem::path& dir) {
+    constexpr int kRecipients = 8;
+    constexpr size_t kBurst = 64;
+    int inbound[2];
+    std::vector<std::array<int, 2>> outbound(kRecipients);
+    socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, inbound);
+    for (auto& pair : outbound) {
+        socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair.data());
+    }
+
+    HistoryOptions historyOptions;
+    historyOptions.directory = dir / "relay_bench_history";
+    HistoryLog history(historyOptions);
+    OutboundLimits limits;
+    std::vector<std::unique_ptr<OutboundQueue>> queues;
+    for (int i = 0; i < kRecipients; i++) {
+        queues.push_back(std::make_unique<OutboundQueue>(limits));
+    }
+    auto room = std::make_shared<RoomRegistry::Room>("bench");
+    Session session(1, INVALID_SOCKET, "a-sender-with-a-long-name", {});
+    RingBuffer ring;
+    FrameParser parser;
+
+    std::string burst;
+    for (size_t i = 0; i < kBurst; i++) {
+        appendFrame(burst, FrameType::Chat, "the quick brown fox jumps over the lazy dog");
+    }
+    std::vector<char> drain(64 * 1024);
+
+    size_t warmUp = (messages / 2 + kBurst - 1) / kBurst * kBurst;
+    size_t total = std::max(warmUp + kBurst, (messages + kBurst - 1) / kBurst * kBurst);
+    uint64_t counted = 0;
+    for (size_t sent = 0; sent < total; sent += kBurst) {
+        if (sent == warmUp) {
+            counted = threadAllocations;
+        }
+        sendAll(inbound[0], burst.data(), burst.size());
+        ssize_t got;
+        while ((got = recv(inbound[1], ring.writePointer(), ring.writableContiguous(), 0)) > 0) {
+            ring.commit(static_cast<size_t>(got));
+            parser.parse(ring, [&](const Frame& frame) {
+                FrameRef message = BufferPool::global().frame(FrameType::Chat, {session.getName(), ": ", frame.payload});
+                std::string_view payload = std::string_view(message->bytes()).substr(kFrameHeaderSize);
+                FrameRef packed = compressFrame(FrameType::Chat, payload, room->dictionary.current().get());
+                for (size_t i = 0; i < queues.size(); i++) {
+                    queues[i]->push(i % 2 == 0 && packed ? packed : message, true);
+                }
+                room->dictionary.add(payload);
+                history.append(room, payload);
+                return true;
+            });
+        }
+        for (int i = 0; i < kRecipients; i++) {
+            queues[i]->flush(outbound[i][0]);
+            while (recv(outbound[i][1], drain.data(), drain.size(), 0) > 0) {
+            }
+        }
+    }
+    counted = threadAllocations - counted;
+
+    close(inbound[0]);
+    close(inbound[1]);
+    for (auto& pair : outbound) {
+        close(pair[0]);
+        close(pair[1]);
+    }
+    return static_cast<double>(counted) / static_cast<double>(total - warmUp);
+}
+
+// Frames of a typical chat size, fed to the parser 64 KB at a time so some
+// straddle a read boundary and some the ring's wrap point
+void parseFrames(const std::string& stream, RingBuffer& ring, FrameParser& parser, size_t& frames) {
+    std::string_view remaining = stream;
+    while (!remaining.empty()) {
+        size_t length = std::min({remaining.size(), ring.writableContiguous(), size_t(64 * 1024)});
+        std::memcpy(ring.writePointer(), remaining.data(), length);
+        ring.commit(length);
+        remaining.remove_prefix(length);
+        parser.parse(ring, [&](const Frame& frame) {
+            frames += frame.payload.size() > 0;
+            return true;
+        });
+    }
+}
+
+// A room's members, each with its own OutboundQueue over a socketpair that
+// is drained after every burst
+class BroadcastRoom {
+public:
+    BroadcastRoom(RoomRegistry& rooms, size_t members) : queues(members), pairs(members) {
+        for (size_t i = 0; i < members; i++) {
+            socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pairs[i].data());
+            queues[i] = std::make_unique<OutboundQueue>(limits);
+            room = rooms.join("broadcast", {pairs[i][0], i, "member" + std::to_string(i), nullptr});
+        }
+    }
+
+    ~BroadcastRoom() {
+        for (auto& pair : pairs) {
+            close(pair[0]);
+            close(pair[1]);
+        }
+    }
+
+    // Returns the number of frames queued
+    size_t send(RoomRegistry& rooms, const FrameRef& message) {
+        size_t delivered = 0;
+        rooms.forEachMember(room, [&](const ClientInfo& member) {
+            queues[member.sessionId]->push(message, true);
+            delivered++;
+        });
+        return delivered;
+    }
+
+    void flush() {
+        for (size_t i = 0; i < queues.size(); i++) {
+            queues[i]->flush(pairs[i][0]);
+            while (recv(pairs[i][1], drain.data(), drain.size(), 0) > 0) {
+            }
+        }
+    }
+
+private:
+    OutboundLimits limits;
+    std::vector<std::unique_ptr<OutboundQueue>> queues;
+    std::vector<std::array<int, 2>> pairs;
+    RoomRegistry::RoomHandle room;
+    std::array<char, 64 * 1024> drain;
+};
+
+// Best rate over the rounds, in operations per second
+void reportRate(const std::string& name, size_t operations, int rounds, const std::function<void()>& run) {
+    double best = 0;
+    for (int i = 0; i < rounds; i++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::max(best, operations / elapsed.count());
+    }
+    std::cout << "  " << name << ": " << static_cast<uint64_t>(best) << " /s" << std::endl;
+}
+
+void microBenchmarks(const BenchConfig& config) {
+    constexpr size_t kFrames = 1000000;
+    std::cout << "Frame parsing, " << kFrames << " chat frames" << std::endl;
+    std::string stream;
+    std::mt19937_64 random(7);
+    for (size_t i = 0; i < kFrames; i++) {
+        appendFrame(stream, FrameType::Chat, std::string(16 + random() % 112, 'x'));
+    }
+    RingBuffer ring;
+    FrameParser parser;
+    size_t frames = 0;
+    reportRate("frames", kFrames, config.rounds, [&]() {
+        parseFrames(stream, ring, parser, frames);
+    });
+
+    constexpr size_t kRooms = 10000;
+    constexpr size_t kLookups = 1000000;
+    std::cout << "Room lookup, " << kRooms << " rooms" << std::endl;
+    RoomRegistry rooms;
+    std::vector<std::string> roomIDs;
+    for (size_t i = 0; i < kRooms; i++) {
+        roomIDs.push_back("room-" + std::to_string(i));
+        rooms.join(roomIDs.back(), {INVALID_SOCKET, i, "member", nullptr});
+    }
+    std::vector<uint32_t> order(kLookups);
+    for (auto& index : order) {
+        index = static_cast<uint32_t>(random() % kRooms);
+    }
+    size_t found = 0;
+    reportRate("memberCount", kLookups, config.rounds, [&]() {
+        for (uint32_t index : order) {
+            found += rooms.memberCount(roomIDs[index]);
+        }
+    });
+    reportRate("forEachMember", kLookups, config.rounds, [&]() {
+        for (uint32_t index : order) {
+            rooms.forEachMember(roomIDs[index], [&](const ClientInfo&) {
+                found++;
+            });
+        }
+    });
+
+    constexpr size_t kMembers = 64;
+    constexpr size_t kMessages = 20000;
+    constexpr size_t kBurst = 64;
+    std::cout << "Broadcast, " << kMessages << " messages to " << kMembers << " members" << std::endl;
+    BroadcastRoom room(rooms, kMembers);
+    reportRate("deliveries", kMessages * kMembers, config.rounds, [&]() {
+        for (size_t sent = 0; sent < kMessages; sent += kBurst) {
+            for (size_t i = 0; i < kBurst; i++) {
+                FrameRef message = BufferPool::global().frame(FrameType::Chat, {"sender: ", "the quick brown fox jumps over the lazy dog"});
+                found += room.send(rooms, message);
+            }
+            room.flush();
+        }
+    });
+    if (frames == 0 || found == 0) {
+        std::cout << "  (nothing parsed or found)" << std::endl;
+    }
+}
+
+class CountingHandler : public ConnectionHandler {
+public:
+    std::atomic<uint64_t> frames{0};
+
+    void onFrame(const std::shared_ptr<Connection>&, const Frame&) override {
+        frames.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void onClose(const std::shared_ptr<Connection>&) override {}
+};
+
+// Runs fn on the loop thread and waits for it
+template <typename Callback>
+auto inLoop(EventLoop& loop, Callback&& fn) -> decltype(fn()) {
+    std::packaged_task<decltype(fn())()> task(std::forward<Callback>(fn));
+    auto result = task.get_future();
+    loop.post([&task]() {
+        task();
+    });
+    return result.get();
+}
+
+// Server ends of socketpairs as Connections on one loop; the client ends
+// are read on the calling thread
+class TransportBench {
+public:
+    TransportBench(IoBackend backend, size_t clients) : loop(0, backend) {
+        runner = std::thread([this]() {
+            loop.run();
+        });
+        for (size_t i = 0; i < clients; i++) {
+            int pair[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, pair) != 0) {
+                std::cerr << "Out of descriptors at " << i << " clients" << std::endl;
+                break;
+            }
+            connections.push_back(std::make_shared<Connection>(i + 1, pair[0], loop, handler, limits));
+            peers.push_back(pair[1]);
+        }
+        inLoop(loop, [this]() {
+            for (auto& connection : connections) {
+                loop.add(connection->getSocket(), EPOLLIN | EPOLLRDHUP, connection);
+            }
+        });
+    }
+
+    ~TransportBench() {
+        for (auto& connection : connections) {
+            connection->close();
+        }
+        // io_uring loops close a socket once its cancelled operations are back
+        for (int tries = 0; tries < 1000 && inLoop(loop, [this]() { return loop.handlerCount(); }) > 0; tries++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        loop.stop();
+        runner.join();
+        for (int peer : peers) {
+            close(peer);
+        }
+    }
+
+    IoBackend backend() const {
+        return loop.getBackend();
+    }
+
+    size_t clients() const {
+        return connections.size();
+    }
+
+    // Every message to every client, queued from this thread as a dispatcher
+    // worker would; returns once the clients have read all of it
+    void broadcast(size_t messages) {
+        constexpr size_t kBurst = 64;
+        FrameRef sample = BufferPool::global().frame(FrameType::Chat, {"sender: ", "the quick brown fox jumps over the lazy dog"});
+        uint64_t expected = static_cast<uint64_t>(messages) * sample->size() * connections.size();
+        uint64_t received = 0;
+        for (size_t sent = 0; sent < messages;) {
+            for (size_t end = std::min(messages, sent + kBurst); sent < end; sent++) {
+                FrameRef message = BufferPool::global().frame(FrameType::Chat, {"sender: ", "the quick brown fox jumps over the lazy dog"});
+                for (auto& connection : connections) {
+                    connection->send(message, true);
+                }
+            }
+            // Keep no more than a burst in flight so nothing is shed
+            uint64_t target = static_cast<uint64_t>(sent) * sample->size() * connections.size();
+            received += drainPeers(target - received);
+        }
+        if (received != expected) {
+            std::cerr << "  broadcast lost " << expected - received << " bytes" << std::endl;
+        }
+    }
+
+    // Every client sends frames to the loop; returns once all are parsed
+    void inbound(size_t framesPerClient) {
+        std::string burst;
+        for (int i = 0; i < 64; i++) {
+            appendFrame(burst, FrameType::Chat, "the quick brown fox jumps over the lazy dog");
+        }
+        uint64_t target = handler.frames.load() + static_cast<uint64_t>(framesPerClient / 64 * 64) * peers.size();
+        for (size_t sent = 0; sent + 64 <= framesPerClient; sent += 64) {
+            for (int peer : peers) {
+                for (size_t offset = 0; offset < burst.size();) {
+                    ssize_t written = ::send(peer, burst.data() + offset, burst.size() - offset, MSG_NOSIGNAL);
+                    if (written > 0) {
+                        offset += static_cast<size_t>(written);
+                    } else {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+        }
+        while (handler.frames.load() < target) {
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    EventLoop loop;
+    std::thread runner;
+    CountingHandler handler;
+    OutboundLimits limits;
+    std::vector<std::shared_ptr<Connection>> connections;
+    std::vector<int> peers;
+    std::vector<char> drain = std::vector<char>(64 * 1024);
+
+    uint64_t drainPeers(uint64_t bytes) {
+        uint64_t received = 0;
+        while (received < bytes) {
+            bool progress = false;
+            for (int peer : peers) {
+                ssize_t got;
+                while ((got = recv(peer, drain.data(), drain.size(), 0)) > 0) {
+                    received += static_cast<uint64_t>(got);
+                    progress = true;
+                }
+            }
+            if (!progress) {
+                std::this_thread::yield();
+            }
+        }
+        return received;
+    }
+};
+
+void transportBenchmarks(const BenchConfig& config) {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (!IoUring::supported()) {
+        std::cout << "Transport: io_uring is not supported by this kernel, epoll only" << std::endl;
+    }
+
+    constexpr size_t kMessages = 256;
+    constexpr size_t kFramesPerClient = 512;
+    for (IoBackend backend : {IoBackend::Epoll, IoBackend::Uring}) {
+        if (backend == IoBackend::Uring && !IoUring::supported()) {
+            continue;
+        }
+        TransportBench bench(backend, config.clients);
+        std::cout << "Transport (" << (bench.backend() == IoBackend::Uring ? "io_uring" : "epoll") << "), " << bench.clients()
+                  << " clients on one loop" << std::endl;
+        reportRate("broadcast deliveries", kMessages * bench.clients(), config.rounds, [&]() {
+            bench.broadcast(kMessages);
+        });
+        reportRate("inbound frames", kFramesPerClient * bench.clients(), config.rounds, [&]() {
+            bench.inbound(kFramesPerClient);
+        });
+    }
+}
+
+void report(const std::string& name, size_t bytes, int rounds, const std::function<void()>& run) {
+    double best = 0;
+    for (int i = 0; i < rounds; i++) {
+        auto start = std::chrono::steady_clock::now();
+        run();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::max(best, bytes / (1024.0 * 1024.0) / elapsed.count());
+    }
+    std::cout << "  " << name << ": " << static_cast<int>(best) << " MB/s" << std::endl;
+}
+
+BenchConfig parseArgs(int argc, char* argv[]) {
+    BenchConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
+        if (option == "--suite") {
+            config.suite = value;
+        } else if (option == "--size") {
+            config.sizeMB = std::stoul(value);
+        } else if (option == "--chunk") {
+            config.chunkSize = std::max<size_t>(1, std::stoul(value));
+        } else if (option == "--dir") {
+            config.dir = value;
+        } else if (option == "--rounds") {
+            config.rounds = std::max(1, std::stoi(value));
+        } else if (option == "--clients") {
+            config.clients = std::max<size_t>(1, std::stoul(value));
+        } else if (option == "--threads") {
+            config.threads = std::stoul(value);
+        } else if (option == "--messages") {
+            config.messages = std::max<size_t>(2, std::stoul(value));
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+        }
+    }
+    return config;
+}
+
+void fileBenchmarks(const BenchConfig& config) {
+    size_t bytes = config.sizeMB * 1024 * 1024;
+
+    std::string data(bytes, '\0');
+    std::mt19937_64 random(42);
+    for (size_t i = 0; i + 8 <= data.size(); i += 8) {
+        uint64_t value = random();
+        std::memcpy(&data[i], &value, 8);
+    }
+
+    std::filesystem::path source = config.dir / "relay_bench_source.bin";
+    std::filesystem::path target = config.dir / "relay_bench_upload.bin";
+    std::ofstream(source, std::ios::binary).write(data.data(), static_cast<std::streamsize>(data.size()));
+
+    std::cout << "File relay, " << config.sizeMB << " MB, chunk " << config.chunkSize << " bytes, best of " << config.rounds << std::endl;
+    std::cout << "Download (file -> loopback socket)" << std::endl;
+    report("ifstream 1 KB + send", bytes, config.rounds, [&]() {
+        LoopbackSink sink;
+        legacyDownload(source, sink.sendSocket());
+    });
+    report("sendfile", bytes, config.rounds, [&]() {
+        LoopbackSink sink;
+        relayDownload(source, sink.sendSocket(), config.chunkSize);
+    });
+
+    std::cout << "Upload (frames -> file)" << std::endl;
+    report("ofstream 1 KB", bytes, config.rounds, [&]() {
+        legacyUpload(target, data);
+    });
+    report("UploadWriter", bytes, config.rounds, [&]() {
+        relayUpload(target, data, config.chunkSize);
+    });
+
+    std::cout << "CRC-32C over " << kFileChunkSize / 1024 << " KB chunks" << std::endl;
+    volatile uint32_t sink = 0;
+    report("table (slicing-by-8)", bytes, config.rounds, [&]() {
+        for (size_t offset = 0; offset < data.size(); offset += kFileChunkSize) {
+            sink = sink + crc32cSoftware(0, data.data() + offset, std::min(kFileChunkSize, data.size() - offset));
+        }
+    });
+    report(crc32cHardware() ? "hardware (SSE4.2 / ARMv8 CRC)" : "hardware (unavailable, table)", bytes, config.rounds, [&]() {
+        for (size_t offset = 0; offset < data.size(); offset += kFileChunkSize) {
+            sink = sink + crc32c(0, data.data() + offset, std::min(kFileChunkSize, data.size() - offset));
+        }
+    });
+
+    // Content address of every stored upload, fed chunk by chunk like the server does
+    std::cout << "SHA-256 over " << kFileChunkSize / 1024 << " KB chunks" << std::endl;
+    for (bool hardware : {false, true}) {
+        if (hardware && !sha256Hardware()) {
+            continue;
+        }
+        report(hardware ? "SHA extensions" : "portable", bytes, config.rounds, [&]() {
+            Sha256 hash(hardware);
+            for (size_t offset = 0; offset < data.size(); offset += kFileChunkSize) {
+                hash.update(data.data() + offset, std::min(kFileChunkSize, data.size() - offset));
+            }
+            sink = sink + hash.finish()[0];
+        });
+    }
+
+    std::filesystem::remove(source);
+    std::filesystem::remove(target);
+}
+
+uint64_t threadCpuNanos() {
+    timespec now{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ull + static_cast<uint64_t>(now.tv_nsec);
+}
+
+// Chat as "name: text", words drawn unevenly from a small vocabulary like a
+// real room's, with the odd link or ticket number
+std::vector<std::string> chatCorpus(size_t lines, std::mt19937_64& random) {
+    static const char* names[] = {"alice", "bob", "carol", "dmitro", "erin", "farhan", "grace", "heidi", "ivan", "judy"};
+    static const char* words[] = {
+        "the", "a", "to", "is", "it", "and", "we", "I", "you", "that", "on", "for", "this", "in", "be", "deploy", "build",
+        "staging", "review", "merged", "branch", "test", "failing", "green", "lunch", "meeting", "standup", "ticket",
+        "tomorrow", "today", "yes", "no", "thanks", "please", "can", "someone", "look", "at", "again", "after", "server",
+        "client", "logs", "latency", "rollback", "release", "hotfix", "config", "database", "migration", "cache", "done",
+        "ok", "sounds", "good", "will", "check", "it's", "not", "working", "now", "still", "here", "there", "why", "how",
+    };
+    std::vector<std::string> corpus;
+    for (size_t i = 0; i < lines; i++) {
+        std::string line = names[random() % std::size(names)];
+        line += ": ";
+        size_t count = 3 + random() % 18;
+        for (size_t w = 0; w < count; w++) {
+            // Squaring skews the pick towards the first words, as real word use is skewed
+            double pick = static_cast<double>(random() % 1000) / 1000.0;
+            line += words[static_cast<size_t>(pick * pick * std::size(words))];
+            line += ' ';
+        }
+        if (random() % 8 == 0) {
+            line += "https://ci.example.com/job/chat-server/" + std::to_string(random() % 10000) + "/console";
+        } else if (random() % 8 == 0) {
+            line += "see PROJ-" + std::to_string(1000 + random() % 9000);
+        }
+        corpus.push_back(std::move(line));
+    }
+    return corpus;
+}
+
+std::string logCorpus(size_t bytes, std::mt19937_64& random) {
+    static const char* levels[] = {"INFO ", "INFO ", "INFO ", "DEBUG", "WARN ", "ERROR"};
+    static const char* events[] = {
+        "Delivered message to room", "Client connected from 10.0.", "Upload finished for transfer", "Slow consumer, dropping chat for session",
+        "Dispatch queue depth", "Flushed history segment", "Peer link up to node", "Retrying write after EAGAIN on socket",
+    };
+    std::string log;
+    uint64_t millis = 1760000000000ull;
+    while (log.size() < bytes) {
+        millis += random() % 50;
+        log += std::to_string(millis / 1000) + "." + std::to_string(1000 + millis % 1000).substr(1) + " ";
+        log += levels[random() % std::size(levels)];
+        log += " [loop-" + std::to_string(random() % 8) + "] ";
+        log += events[random() % std::size(events)];
+        log += " " + std::to_string(random() % 100000) + " in " + std::to_string(random() % 1000) + " us\n";
+    }
+    log.resize(bytes);
+    return log;
+}
+
+// Compresses every piece as the server would (skipping those that would not
+// shrink enough) and decodes the ones that were compressed
+void reportCompression(const std::string& name, const std::vector<std::string_view>& pieces, const ChatDictionary* dictionary, int rounds) {
+    size_t input = 0;
+    size_t largest = 0;
+    for (std::string_view piece : pieces) {
+        input += piece.size();
+        largest = std::max(largest, piece.size());
+    }
+    std::vector<char> out(largest);
+    std::vector<std::string> packed(pieces.size());
+    std::string decoded(largest, '\0');
+    const Lz4Dictionary* codec = dictionary != nullptr ? &dictionary->codec : nullptr;
+    uint32_t id = dictionary != nullptr ? dictionary->id : 0;
+    std::string_view dictionaryText = codec != nullptr ? codec->bytes() : std::string_view();
+
+    uint64_t bestCompress = UINT64_MAX;
+    uint64_t bestDecode = UINT64_MAX;
+    size_t wire = 0;
+    size_t compressedPieces = 0;
+    size_t compressedBytes = 0;
+    for (int round = 0; round < rounds; round++) {
+        wire = 0;
+        compressedPieces = 0;
+        compressedBytes = 0;
+        uint64_t start = threadCpuNanos();
+        for (size_t i = 0; i < pieces.size(); i++) {
+            size_t size = compressPayload(pieces[i], out.data(), compressionBudget(pieces[i].size()), codec, id);
+            packed[i].assign(out.data(), size);
+            wire += size > 0 ? size : pieces[i].size();
+            compressedPieces += size > 0;
+            compressedBytes += size > 0 ? pieces[i].size() : 0;
+        }
+        bestCompress = std::min(bestCompress, threadCpuNanos() - start);
+
+        start = threadCpuNanos();
+        size_t header = codec != nullptr ? 8 : 4;
+        for (size_t i = 0; i < pieces.size(); i++) {
+            if (!packed[i].empty() &&
+                !lz4Decompress(packed[i].data() + header, packed[i].size() - header, &decoded[0], pieces[i].size(), dictionaryText)) {
+                std::cout << "  " << name << ": decode failed" << std::endl;
+                return;
+            }
+        }
+        bestDecode = std::min(bestDecode, threadCpuNanos() - start);
+    }
+
+    size_t saved = input - wire;
+    std::cout << "  " << name << ": " << 100 * wire / std::max<size_t>(1, input) << "% of " << input / 1024 << " KB on the wire, "
+              << 100 * compressedPieces / std::max<size_t>(1, pieces.size()) << "% of pieces compressed, compress "
+              << static_cast<int>(input * 1e3 / std::max<uint64_t>(1, bestCompress)) << " MB/s, ";
+    if (compressedBytes > 0) {
+        std::cout << "decode " << static_cast<int>(compressedBytes * 1e3 / std::max<uint64_t>(1, bestDecode)) << " MB/s, ";
+    }
+    if (saved > 0) {
+        std::cout << static_cast<double>(bestCompress) / static_cast<double>(saved) << " ns CPU per byte saved" << std::endl;
+    } else {
+        std::cout << "nothing saved, " << static_cast<double>(bestCompress) / static_cast<double>(input) << " ns CPU per byte tried" << std::endl;
+    }
+}
+
+void compressionBenchmarks(const BenchConfig& config) {
+    constexpr size_t kTrainingLines = 2048;
+    constexpr size_t kLines = 100000;
+    std::mt19937_64 random(11);
+    std::vector<std::string> chat = chatCorpus(kTrainingLines + kLines, random);
+
+    // Trained on earlier lines the way a room's dispatch worker would, measured on later ones
+    ChatDictionaryTrainer trainer;
+    for (size_t i = 0; i < kTrainingLines; i++) {
+        trainer.add(chat[i]);
+    }
+    std::shared_ptr<const ChatDictionary> dictionary = trainer.current();
+    std::vector<std::string_view> lines(chat.begin() + kTrainingLines, chat.end());
+
+    std::cout << "Compression (LZ4 blocks), CPU time, best of " << config.rounds << std::endl;
+    reportCompression("chat lines, alone", lines, nullptr, config.rounds);
+    reportCompression("chat lines, room dictionary (" + std::to_string(dictionary->codec.bytes().size() / 1024) + " KB)", lines,
+                      dictionary.get(), config.rounds);
+
+    size_t bytes = std::max<size_t>(1, config.sizeMB / 4) * 1024 * 1024;
+    std::string log = logCorpus(bytes, random);
+    std::string noise(bytes, '\0');
+    for (size_t i = 0; i + 8 <= noise.size(); i += 8) {
+        uint64_t value = random();
+        std::memcpy(&noise[i], &value, 8);
+    }
+    for (size_t chunk : {kFileChunkSize, config.chunkSize}) {
+        std::vector<std::string_view> logChunks;
+        std::vector<std::string_view> noiseChunks;
+        for (size_t offset = 0; offset < bytes; offset += chunk) {
+            logChunks.push_back(std::string_view(log).substr(offset, chunk));
+            noiseChunks.push_back(std::string_view(noise).substr(offset, chunk));
+        }
+        std::string size = std::to_string(chunk / 1024) + " KB chunks";
+        reportCompression("log file, " + size, logChunks, nullptr, config.rounds);
+        reportCompression("random bytes, " + size, noiseChunks, nullptr, config.rounds);
+    }
+}
+
+// Every member of a room of any size, each with its own OutboundQueue. There
+// are too many members for a socket each, so the queues are emptied as if
+// written out; a member's queue is only touched by the thread serving its chunk.
+class MemberSinks {
+public:
+    explicit MemberSinks(size_t count) {
+        for (size_t i = 0; i < count; i++) {
+            queues.push_back(std::make_unique<OutboundQueue>(limits));
+            members.push_back({INVALID_SOCKET, i + 1, "member" + std::to_string(i), nullptr}); // session 0 is a remote member
+        }
+    }
+
+    const MemberList& list() const {
+        return members;
+    }
+
+    void push(const ClientInfo& member, const FrameRef& frame) {
+        queues[member.sessionId - 1]->push(frame, true);
+    }
+
+    void drain(const ClientInfo& member) {
+        OutboundQueue& queue = *queues[member.sessionId - 1];
+        queue.completed(queue.bytes());
+    }
+
+private:
+    OutboundLimits limits;
+    std::vector<std::unique_ptr<OutboundQueue>> queues;
+    MemberList members;
+};
+
+// Chat to one room as a dispatch worker sends it, with the queues drained
+// after every burst like a loop's write pass would
+size_t fanOut(FanoutPool& pool, MemberSinks& sinks, size_t messages) {
+    constexpr size_t kBurst = 16;
+    std::atomic<size_t> delivered{0};
+    for (size_t sent = 0; sent < messages; sent++) {
+        FrameRef message = BufferPool::global().frame(FrameType::Chat, {"sender: ", "the quick brown fox jumps over the lazy dog"});
+        bool drain = (sent + 1) % kBurst == 0 || sent + 1 == messages;
+        pool.forEachChunk(sinks.list(), [&](FanoutPool::Members first, FanoutPool::Members last) {
+            size_t count = 0;
+            for (auto member = first; member != last; ++member, count++) {
+                sinks.push(*member, message);
+            }
+            if (drain) {
+                for (auto member = first; member != last; ++member) {
+                    sinks.drain(*member);
+                }
+            }
+            delivered.fetch_add(count, std::memory_order_relaxed);
+        });
+    }
+    return delivered.load();
+}
+
+// A wave of `joins` members arriving in a room of `members`. One notice per
+// join goes to everyone already there; batched, the wave is one notice to
+// everyone who was there before it, and to each joiner one without its own name.
+size_t presenceWave(FanoutPool& pool, MemberSinks& sinks, size_t joins, bool batched) {
+    const MemberList& members = sinks.list();
+    std::atomic<size_t> delivered{0};
+    auto announce = [&](const FrameRef& notice, size_t present) {
+        MemberList::const_iterator end = members.begin() + static_cast<std::ptrdiff_t>(present);
+        for (auto member = members.begin(); member != end; ++member) {
+            sinks.push(*member, notice);
+            sinks.drain(*member);
+        }
+        delivered.fetch_add(present, std::memory_order_relaxed);
+    };
+
+    size_t before = members.size() - joins;
+    if (!batched) {
+        for (size_t i = 0; i < joins; i++) {
+            announce(BufferPool::global().frame(FrameType::Notice, {members[before + i].name, " has joined the room."}), before + i);
+        }
+        return delivered.load();
+    }
+    PresenceBatch batch;
+    for (size_t i = 0; i < joins; i++) {
+        batch.joined(members[before + i].sessionId, members[before + i].name);
+    }
+    PresenceNotice taken = batch.take();
+    FrameRef notice = BufferPool::global().frame(FrameType::Notice, {taken.text});
+    pool.forEachChunk(members, [&](FanoutPool::Members first, FanoutPool::Members last) {
+        size_t count = 0;
+        for (auto member = first; member != last; ++member) {
+            if (!taken.about(member->sessionId)) {
+                sinks.push(*member, notice);
+            } else {
+                sinks.push(*member, BufferPool::global().frame(FrameType::Notice, {taken.textFor(member->sessionId)}));
+            }
+            sinks.drain(*member);
+            count++;
+        }
+        delivered.fetch_add(count, std::memory_order_relaxed);
+    });
+    return delivered.load();
+}
+
+void roomBenchmarks(const BenchConfig& config) {
+    constexpr size_t kDeliveries = 4000000; // per chat run, whatever the room's size
+    constexpr size_t kChunk = 1024;
+    constexpr size_t kWave = 1000;
+    FanoutPool alone(0, kChunk);
+    FanoutPool pool(config.threads, kChunk);
+    std::cout << "Rooms, chunks of " << kChunk << " members, " << config.threads << " fan-out threads, "
+              << std::thread::hardware_concurrency() << " cores" << std::endl;
+    for (size_t size : {size_t(10), size_t(1000), size_t(50000)}) {
+        MemberSinks sinks(size);
+        size_t messages = std::max<size_t>(1, kDeliveries / size);
+        size_t joins = std::min(size / 2, kWave); // into a room already half full, at least
+        size_t found = 0;
+        std::string room = std::to_string(size) + " members";
+        reportRate(room + ", chat deliveries, worker alone", messages * size, config.rounds, [&]() {
+            found += fanOut(alone, sinks, messages);
+        });
+        reportRate(room + ", chat deliveries, fan-out pool", messages * size, config.rounds, [&]() {
+            found += fanOut(pool, sinks, messages);
+        });
+        size_t oneEach = presenceWave(alone, sinks, joins, false);
+        size_t batched = presenceWave(pool, sinks, joins, true);
+        reportRate(room + ", wave of " + std::to_string(joins) + " joins, one notice each (" + std::to_string(oneEach) + " deliveries)",
+                   joins, config.rounds, [&]() {
+            found += presenceWave(alone, sinks, joins, false);
+        });
+        reportRate(room + ", wave of " + std::to_string(joins) + " joins, batched (" + std::to_string(batched) + " deliveries)",
+                   joins, config.rounds, [&]() {
+            found += presenceWave(pool, sinks, joins, true);
+        });
+        if (found == 0) {
+            std::cout << "  (nothing delivered)" << std::endl;
+        }
+    }
+}
+
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    BenchConfig config = parseArgs(argc, argv);
+    bool all = config.suite == "all";
+    if (all || config.suite == "files") {
+        fileBenchmarks(config);
+    }
+    if (all || config.suite == "micro") {
+        microBenchmarks(config);
+    }
+    if (all || config.suite == "transport") {
+        transportBenchmarks(config);
+    }
+    if (all || config.suite == "compression") {
+        compressionBenchmarks(config);
+    }
+    if (all || config.suite == "rooms") {
+        roomBenchmarks(config);
+    }
+    if (all || config.suite == "chat") {
+        std::cout << "Chat path, " << config.messages << " messages to 8 recipients" << std::endl;
+        double perMessage = chatPathAllocations(config.messages, config.dir);
+        std::filesystem::remove_all(config.dir / "relay_bench_history");
+        std::cout << "  heap allocations per message after warm-up: " << perMessage << std::endl;
+        return perMessage <= 0.001 ? 0 : 1;
+    }
+    return 0;
+}
@@ -0,0 +1,210 @@
+#pragma once
+
+#include "crc32c.h"
+#include "logger.h"
+#include "sha256.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct BlobInfo {
+    std::filesystem::path path;
+    uint64_t size;
+    uint32_t crc; // CRC-32C of the whole blob, for FileEnd
+};
+
+// Finished uploads filed by the SHA-256 of their content, one file per
+// distinct content under <storage>/blobs/<hex digest>. Every transfer
+// serving a blob holds a reference. A blob nobody references is kept for
+// the retention window, so the same attachment sent again a little later
+// is still found, and then deleted by a background collector.
+//
+// Uploads are added with a hard link to the transfer's own file, so
+// downloads already reading that file carry on undisturbed. Blobs left from
+// an earlier run are rehashed at startup; any that no longer match their
+// name are deleted.
+class BlobStore {
+public:
+    using Clock = std::chrono::steady_clock;
+    static constexpr auto kCollectInterval = std::chrono::seconds(10);
+
+    BlobStore(std::filesystem::path directory, std::chrono::seconds retention)
+        : directory(std::move(directory)), retention(retention) {
+        std::error_code error;
+        std::filesystem::create_directories(this->directory, error);
+        collector = std::thread([this]() {
+            run();
+        });
+    }
+
+    ~BlobStore() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        collector.join();
+    }
+
+    BlobStore(const BlobStore&) = delete;
+    BlobStore& operator=(const BlobStore&) = delete;
+
+    // Takes a reference to the blob with this content, if it is stored
+    std::optional<BlobInfo> acquire(const Sha256Digest& digest, uint64_t size) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = blobs.find(digest);
+        if (it == blobs.end() || it->second.size != size) {
+            return std::nullopt;
+        }
+        it->second.refs++;
+        return BlobInfo{pathOf(digest), it->second.size, it->second.crc};
+    }
+
+    // Files a finished upload under its digest and takes a reference to it.
+    // If the content is already stored, only the reference is taken.
+    bool add(const std::filesystem::path& file, const Sha256Digest& digest, uint64_t size, uint32_t crc) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = blobs.find(digest);
+        if (it != blobs.end()) {
+            it->second.refs++;
+            return true;
+        }
+
+        std::filesystem::path target = pathOf(digest);
+        std::error_code error;
+        std::filesystem::remove(target, error); // a leftover the startup scan has not reached
+        std::filesystem::create_hard_link(file, target, error);
+        if (error) {
+            error.clear();
+            std::filesystem::copy_file(file, target, error);
+            if (error) {
+                logWarning("Could not store ", file, " as a blob: ", error.message());
+                return false;
+            }
+        }
+        blobs.emplace(digest, Blob{size, crc, 1, {}});
+        storedBytes += size;
+        return true;
+    }
+
+    void release(const Sha256Digest& digest) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = blobs.find(digest);
+        if (it != blobs.end() && it->second.refs > 0 && --it->second.refs == 0) {
+            it->second.idleSince = Clock::now();
+        }
+    }
+
+    size_t count() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return blobs.size();
+    }
+
+    uint64_t bytes() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return storedBytes;
+    }
+
+private:
+    struct Blob {
+        uint64_t size;
+        uint32_t crc;
+        size_t refs;
+        Clock::time_point idleSince; // when refs last dropped to zero
+    };
+
+    // The digest is already uniformly distributed
+    struct DigestHash {
+        size_t operator()(const Sha256Digest& digest) const {
+            size_t value;
+            std::memcpy(&value, digest.data(), sizeof(value));
+            return value;
+        }
+    };
+
+    std::filesystem::path directory;
+    std::chrono::seconds retention;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool stopping = false;
+    std::unordered_map<Sha256Digest, Blob, DigestHash> blobs;
+    uint64_t storedBytes = 0;
+    std::thread collector;
+
+    std::filesystem::path pathOf(const Sha256Digest& digest) const {
+        return directory / toHex(digest);
+    }
+
+    void run() {
+        scan();
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!wake.wait_for(lock, kCollectInterval, [this]() { return stopping; })) {
+            collect();
+        }
+    }
+
+    // Picks up blobs from an earlier run, unreferenced, after checking their content
+    void scan() {
+        std::error_code error;
+        for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+            Sha256Digest digest;
+            if (!entry.is_regular_file() || !fromHex(entry.path().filename().string(), digest)) {
+                continue;
+            }
+            uint64_t size = 0;
+            uint32_t crc = 0;
+            bool intact = checksum(entry.path(), digest, size, crc);
+
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopping) {
+                return;
+            }
+            if (blobs.count(digest) != 0) {
+                continue; // added again by an upload while this scan was running
+            }
+            if (!intact) {
+                logWarning("Removing damaged blob ", entry.path());
+                std::filesystem::remove(entry.path(), error);
+                continue;
+            }
+            blobs.emplace(digest, Blob{size, crc, 0, Clock::now()});
+            storedBytes += size;
+        }
+    }
+
+    static bool checksum(const std::filesystem::path& path, const Sha256Digest& expected, uint64_t& size, uint32_t& crc) {
+        std::ifstream file(path, std::ios::binary);
+        std::vector<char> buffer(1024 * 1024);
+        Sha256 hash;
+        while (file.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || file.gcount() > 0) {
+            size_t got = static_cast<size_t>(file.gcount());
+            hash.update(buffer.data(), got);
+            crc = crc32c(crc, buffer.data(), got);
+            size += got;
+        }
+        return file.eof() && hash.finish() == expected;
+    }
+
+    // Called with the mutex held; deleting under it keeps add() from relinking a blob being removed
+    void collect() {
+        Clock::time_point cutoff = Clock::now() - retention;
+        for (auto it = blobs.begin(); it != blobs.end();) {
+            if (it->second.refs > 0 || it->second.idleSince > cutoff) {
+                ++it;
+                continue;
+            }
+            std::error_code error;
+            std::filesystem::remove(pathOf(it->first), error);
+            storedBytes -= it->second.size;
+            it = blobs.erase(it);
+        }
+    }
+};
@@ -0,0 +1,235 @@
+#pragma once
+
+#include "protocol.h"
+#include <atomic>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class BufferPool;
+
+// An encoded frame shared by every queue it is sent to. Reference counted in
+// place so handing it to another recipient is one atomic increment, and
+// returned to the pool (capacity intact) when the last reference goes away.
+class FrameBuffer {
+public:
+    const std::string& bytes() const {
+        return data;
+    }
+
+    size_t size() const {
+        return data.size();
+    }
+
+    // When the message entered the server (monotonic ns), for latency metrics; 0 if not tracked
+    uint64_t enqueuedAt() const {
+        return enqueuedNanos;
+    }
+
+private:
+    friend class FrameRef;
+    friend class BufferPool;
+
+    std::atomic<uint32_t> refs{0};
+    std::string data;
+    uint64_t enqueuedNanos = 0;
+};
+
+class FrameRef {
+public:
+    FrameRef() = default;
+
+    explicit FrameRef(FrameBuffer* buffer) : buffer(buffer) {
+        if (buffer != nullptr) {
+            buffer->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    FrameRef(const FrameRef& other) : FrameRef(other.buffer) {}
+
+    FrameRef(FrameRef&& other) noexcept : buffer(other.buffer) {
+        other.buffer = nullptr;
+    }
+
+    FrameRef& operator=(FrameRef other) noexcept {
+        std::swap(buffer, other.buffer);
+        return *this;
+    }
+
+    ~FrameRef() {
+        release();
+    }
+
+    const FrameBuffer* operator->() const {
+        return buffer;
+    }
+
+    explicit operator bool() const {
+        return buffer != nullptr;
+    }
+
+    // Only while the frame has a single owner, before it is shared
+    void setEnqueuedAt(uint64_t nanos) {
+        buffer->enqueuedNanos = nanos;
+    }
+
+private:
+    FrameBuffer* buffer = nullptr;
+
+    inline void release();
+};
+
+// Recycles FrameBuffers so steady-state messaging does not touch the heap.
+// Each thread keeps a small cache and trades batches with a shared freelist,
+// because buffers are usually filled on one thread and freed on another.
+class BufferPool {
+public:
+    static constexpr size_t kThreadCache = 64;
+    static constexpr size_t kBatch = 32;
+    static constexpr size_t kMaxShared = 8192;
+    static constexpr size_t kMaxKeptCapacity = 64 * 1024;
+
+    static BufferPool& global() {
+        static BufferPool pool;
+        return pool;
+    }
+
+    FrameBuffer* acquire() {
+        ThreadCache& cache = threadCache();
+        if (cache.buffers.empty()) {
+            std::lock_guard<std::mutex> lock(sharedMutex);
+            size_t count = std::min(kBatch, shared.size());
+            cache.buffers.insert(cache.buffers.end(), shared.end() - count, shared.end());
+            shared.resize(shared.size() - count);
+        }
+        if (cache.buffers.empty()) {
+            return new FrameBuffer();
+        }
+        FrameBuffer* buffer = cache.buffers.back();
+        cache.buffers.pop_back();
+        return buffer;
+    }
+
+    void recycle(FrameBuffer* buffer) {
+        if (buffer->data.capacity() > kMaxKeptCapacity) {
+            delete buffer;
+            return;
+        }
+        buffer->data.clear();
+        buffer->enqueuedNanos = 0;
+
+        ThreadCache& cache = threadCache();
+        cache.buffers.push_back(buffer);
+        if (cache.buffers.size() > kThreadCache) {
+            spill(cache, kBatch);
+        }
+    }
+
+    // Frames a payload assembled from several pieces straight into a pooled buffer
+    FrameRef frame(FrameType type, std::initializer_list<std::string_view> parts, uint8_t flags = 0) {
+        FrameBuffer* buffer = acquire();
+        size_t length = 0;
+        for (auto part : parts) {
+            length += part.size();
+        }
+
+        std::string& out = buffer->data;
+        out.reserve(kFrameHeaderSize + length);
+        out.push_back(static_cast<char>(type));
+        out.push_back(static_cast<char>(flags));
+        out.push_back(0);
+        out.push_back(0);
+        putU32(out, static_cast<uint32_t>(length));
+        for (auto part : parts) {
+            out.append(part.data(), part.size());
+        }
+        return FrameRef(buffer);
+    }
+
+    // Just the 8-byte header, for a payload that follows from somewhere else (a file)
+    FrameRef header(FrameType type, uint32_t payloadLength) {
+        FrameBuffer* buffer = acquire();
+        std::string& out = buffer->data;
+        out.push_back(static_cast<char>(type));
+        out.append(3, 0);
+        putU32(out, payloadLength);
+        return FrameRef(buffer);
+    }
+
+    // Lets fill(dest, capacity) write the payload in place, e.g. straight from
+    // a file read, and returns an empty ref if it produced nothing
+    template <typename Fill>
+    FrameRef frameInPlace(FrameType type, size_t maxPayload, Fill&& fill, uint8_t flags = 0) {
+        FrameBuffer* buffer = acquire();
+        std::string& out = buffer->data;
+        out.resize(kFrameHeaderSize + maxPayload);
+        size_t length = fill(&out[kFrameHeaderSize], maxPayload);
+        if (length == 0) {
+            recycle(buffer);
+            return FrameRef();
+        }
+
+        out.resize(kFrameHeaderSize + length);
+        out[0] = static_cast<char>(type);
+        out[1] = static_cast<char>(flags);
+        out[2] = out[3] = 0;
+        out[4] = static_cast<char>(length >> 24);
+        out[5] = static_cast<char>(length >> 16);
+        out[6] = static_cast<char>(length >> 8);
+        out[7] = static_cast<char>(length);
+        return FrameRef(buffer);
+    }
+
+    // Wraps bytes that are already a complete frame
+    FrameRef adopt(std::string&& encoded) {
+        FrameBuffer* buffer = acquire();
+        buffer->data = std::move(encoded);
+        return FrameRef(buffer);
+    }
+
+private:
+    struct ThreadCache {
+        std::vector<FrameBuffer*> buffers;
+
+        ~ThreadCache() {
+            BufferPool::global().spill(*this, buffers.size());
+        }
+    };
+
+    std::mutex sharedMutex;
+    std::vector<FrameBuffer*> shared;
+
+    BufferPool() = default;
+
+    ~BufferPool() {
+        for (FrameBuffer* buffer : shared) {
+            delete buffer;
+        }
+    }
+
+    ThreadCache& threadCache() {
+        thread_local ThreadCache cache;
+        return cache;
+    }
+
+    void spill(ThreadCache& cache, size_t count) {
+        std::lock_guard<std::mutex> lock(sharedMutex);
+        while (count-- > 0 && !cache.buffers.empty()) {
+            if (shared.size() < kMaxShared) {
+                shared.push_back(cache.buffers.back());
+            } else {
+                delete cache.buffers.back();
+            }
+            cache.buffers.pop_back();
+        }
+    }
+};
+
+inline void FrameRef::release() {
+    if (buffer != nullptr && buffer->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        BufferPool::global().recycle(buffer);
+    }
+    buffer = nullptr;
+}
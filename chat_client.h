@@ -0,0 +1,787 @@
+#pragma once
+
+#include "net.h"
+#include "protocol.h"
+#include "compression.h"
+#include "crc32c.h"
+#include "sha256.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A non-blocking client for the chat server, shared by the console client,
+// bots and load tools. ChatConnection is the protocol engine for one
+// connection: it owns no thread and never waits, so a program with its own
+// event loop can drive many of them from readiness events. ChatClient runs
+// one on a thread of its own and takes commands from any thread.
+//
+// Chat and file data share the socket but not a queue. Chat, commands and
+// answers are written as soon as the socket takes them; the next file chunk
+// is read from disk only once they are out, so a line sent during an upload
+// waits behind one chunk at most. Uploads queue up and run back to back,
+// each starting as soon as the server has all of the one before, and
+// downloads run alongside them.
+
+struct ChatClientOptions {
+    std::string host = "127.0.0.1";
+    int port = 12345;
+    std::string name;
+    std::string room;
+    bool compression = true;                         // ask the server for compressed frames
+    std::filesystem::path storage = "clientStorage"; // downloads go to <storage>/<name>
+};
+
+// Called on the thread that drives the connection. Unset ones are skipped.
+// A callback may issue commands, but must not destroy the connection.
+struct ChatClientEvents {
+    std::function<void(std::string_view)> onChat;   // "name: text"
+    std::function<void(std::string_view)> onNotice; // joins, leaves, file offers and other server notices
+    // The server took the offer and sending starts at offset. An offset at
+    // the file's size means it already has the content and nothing is sent.
+    std::function<void(uint64_t id, const std::string& fileName, uint64_t offset, uint64_t size)> onUploadStarted;
+    std::function<void(uint64_t id, bool complete)> onUploadFinished; // complete: the server has every byte
+    std::function<void(uint64_t id)> onUploadSettled;                 // every recipient has the file or said no
+    std::function<void(uint64_t id, const std::string& fileName, uint64_t offset)> onDownloadStarted;
+    std::function<void(uint64_t id, const std::filesystem::path& path, bool intact)> onDownloadFinished;
+    std::function<void(std::string_view)> onError; // local trouble: a file that cannot be read, a server that does not answer
+    std::function<void()> onDisconnected;
+};
+
+class ChatConnection {
+public:
+    // How long an offer may go without a FileAck before its upload is given up
+    static constexpr auto kAckTimeout = std::chrono::seconds(10);
+
+    ChatConnection(ChatClientOptions options, ChatClientEvents events) : options(std::move(options)), events(std::move(events)) {}
+
+    ~ChatConnection() {
+        closeSocket();
+    }
+
+    ChatConnection(const ChatConnection&) = delete;
+    ChatConnection& operator=(const ChatConnection&) = delete;
+
+    // Connects (this one step blocks), then introduces the client and joins its room
+    bool connect() {
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(options.port));
+        if (inet_pton(AF_INET, options.host.c_str(), &address.sin_addr) != 1) {
+            error("Not an IPv4 address: " + options.host);
+            return false;
+        }
+        socket = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (socket == INVALID_SOCKET) {
+            error("Error creating socket: " + std::to_string(WSAGetLastError()));
+            return false;
+        }
+        if (::connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR) {
+            error("Connect failed with error: " + std::to_string(WSAGetLastError()));
+            closeSocket();
+            return false;
+        }
+        setNonBlocking(socket);
+        int noDelay = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&noDelay), sizeof(noDelay));
+
+        queueFrame(FrameType::Hello, options.name, options.compression ? kHelloCompression : 0);
+        queueFrame(FrameType::Join, options.room);
+        return isOpen();
+    }
+
+    bool isOpen() const {
+        return socket != INVALID_SOCKET;
+    }
+
+    SOCKET getSocket() const {
+        return socket;
+    }
+
+    const ChatClientOptions& getOptions() const {
+        return options;
+    }
+
+    // Whether the caller should wait for the socket to become writable
+    bool wantsWrite() const {
+        return outOffset < out.size() || (!uploads.empty() && uploads.front().stage == Upload::Stage::Streaming);
+    }
+
+    void sendChat(std::string_view text) {
+        if (!text.empty()) {
+            queueFrame(FrameType::Chat, text);
+        }
+    }
+
+    void changeRoom(std::string_view room) {
+        options.room = std::string(room);
+        queueFrame(FrameType::Change, room);
+    }
+
+    // Without an ID, answers every open offer. With one, also tells the
+    // server how much of that file is already here from an interrupted download.
+    void accept(std::optional<uint64_t> id = std::nullopt) {
+        std::string payload;
+        if (id) {
+            putU64(payload, *id);
+            if (std::optional<uint64_t> have = partialDownload(*id)) {
+                putU64(payload, *have);
+            }
+        }
+        queueFrame(FrameType::Accept, payload);
+    }
+
+    void decline(std::optional<uint64_t> id = std::nullopt) {
+        std::string payload;
+        if (id) {
+            putU64(payload, *id);
+        }
+        queueFrame(FrameType::Decline, payload);
+    }
+
+    // Queues an upload. The offer carries the file's SHA-256, so the server
+    // can skip the upload when it already has the content; hashing reads the
+    // whole file, so a caller that must not stall can pass the digest in
+    // (see hashFile(), which ChatClient runs on the caller's thread).
+    void sendFile(const std::filesystem::path& path, std::optional<Sha256Digest> digest = std::nullopt) {
+        Upload upload;
+        upload.path = path;
+        upload.digest = digest;
+        uploads.push_back(std::move(upload));
+        startNextUpload();
+    }
+
+    // Finishes an upload cut off by a lost connection
+    void resumeFile(uint64_t id, const std::filesystem::path& path) {
+        Upload upload;
+        upload.path = path;
+        upload.resumeId = id;
+        uploads.push_back(std::move(upload));
+        startNextUpload();
+    }
+
+    // Leaves the room; the connection closes once the Exit frame is written
+    void exit() {
+        if (!isOpen() || closing) {
+            return;
+        }
+        appendFrame(out, FrameType::Exit, {});
+        closing = true;
+        onWritable();
+    }
+
+    // Closes the socket without a word to the server
+    void close() {
+        if (!isOpen()) {
+            return;
+        }
+        closeSocket();
+        download.file.close();
+        if (events.onDisconnected) {
+            events.onDisconnected();
+        }
+    }
+
+    // Drains the socket and handles every complete frame. False once the connection is closed.
+    bool onReadable() {
+        while (isOpen()) {
+            int got = recv(socket, in.writePointer(), static_cast<int>(in.writableContiguous()), 0);
+            if (got < 0 && wouldBlock()) {
+                break;
+            }
+            if (got <= 0) {
+                close();
+                break;
+            }
+            in.commit(static_cast<size_t>(got));
+            ParseResult result = parser.parse(in, [this](const Frame& frame) {
+                handleFrame(frame);
+                return isOpen();
+            });
+            if (result == ParseResult::BadFrame) {
+                error("Malformed frame from server");
+                close();
+            }
+        }
+        return isOpen();
+    }
+
+    // Writes what is queued, then file chunks, until the socket is full. False once the connection is closed.
+    bool onWritable() {
+        while (isOpen()) {
+            if (outOffset == out.size()) {
+                out.clear();
+                outOffset = 0;
+                if (closing) {
+                    close();
+                    break;
+                }
+                if (!nextChunk()) {
+                    break;
+                }
+            }
+            int sent = ::send(socket, out.data() + outOffset, static_cast<int>(out.size() - outOffset), kSendFlags);
+            if (sent < 0 && wouldBlock()) {
+                break;
+            }
+            if (sent <= 0) {
+                close();
+                break;
+            }
+            outOffset += static_cast<size_t>(sent);
+        }
+        return isOpen();
+    }
+
+    // Gives up on an offer the server has not answered in time. Call it
+    // about once a second while hasTimeouts().
+    void tick() {
+        if (!uploads.empty() && uploads.front().stage == Upload::Stage::Offered &&
+            std::chrono::steady_clock::now() - uploads.front().offeredAt > kAckTimeout) {
+            error("The server did not accept the upload of " + uploads.front().path.string());
+            finishUpload(false);
+        }
+    }
+
+    bool hasTimeouts() const {
+        return !uploads.empty() && uploads.front().stage == Upload::Stage::Offered;
+    }
+
+    static Sha256Digest hashFile(const std::filesystem::path& path) {
+        Sha256 hash;
+        std::ifstream file(path, std::ios::binary);
+        std::vector<char> buffer(1024 * 1024);
+        while (file.read(buffer.data(), static_cast<std::streamsize>(buffer.size())) || file.gcount() > 0) {
+            hash.update(buffer.data(), static_cast<size_t>(file.gcount()));
+        }
+        return hash.finish();
+    }
+
+private:
+    struct Upload {
+        enum class Stage {
+            Queued,
+            Offered,   // waiting for the FileAck that names the transfer
+            Streaming, // chunks go out as the socket takes them
+            Sent       // every chunk is out; waiting for the FileAck at the full size
+        };
+
+        std::filesystem::path path;
+        std::optional<uint64_t> resumeId;
+        std::optional<Sha256Digest> digest;
+        Stage stage = Stage::Queued;
+        std::ifstream file;
+        uint64_t size = 0;
+        uint64_t id = 0;
+        uint64_t offset = 0; // next byte to send
+        std::chrono::steady_clock::time_point offeredAt;
+        unsigned uncompressedChunks = 0; // chunks left to send as they are after one would not shrink
+    };
+
+    // Incoming download, filled by FileData frames after a FileBegin. It is
+    // written to "<id>-<name>.part" until FileEnd confirms the checksum, so
+    // an interrupted download can be resumed with accept(id).
+    struct Download {
+        std::fstream file;
+        std::filesystem::path partPath;
+        std::string name;
+        uint64_t id = 0;
+        uint64_t remaining = 0;
+        uint32_t crc = 0;
+    };
+
+    ChatClientOptions options;
+    ChatClientEvents events;
+    SOCKET socket = INVALID_SOCKET;
+    bool closing = false;
+    std::string out;
+    size_t outOffset = 0;
+    RingBuffer in;
+    FrameParser parser;
+
+    // Set when the server answers our Hello: from then on uploads may be
+    // compressed. Compressed chat arrives against the dictionaries kept here.
+    bool serverCompresses = false;
+    ReceivedDictionaries dictionaries;
+    std::string decoded;
+
+    std::deque<Upload> uploads; // the front one is under way
+    Download download;
+
+    void queueFrame(FrameType type, std::string_view payload = {}, uint8_t flags = 0) {
+        if (!isOpen() || closing) {
+            return;
+        }
+        appendFrame(out, type, payload, flags);
+        onWritable();
+    }
+
+    void handleFrame(const Frame& frame) {
+        if (frame.flags & kCompressed) {
+            if (!decompressPayload(frame.payload, frame.flags, &dictionaries, decoded)) {
+                error("Could not decode a compressed message from the server");
+                return;
+            }
+            handleFrame(Frame{frame.type, 0, decoded});
+            return;
+        }
+        switch (frame.type) {
+            case FrameType::Hello:
+                serverCompresses = (frame.flags & kHelloCompression) != 0;
+                break;
+            case FrameType::Dictionary:
+                dictionaries.add(frame.payload);
+                break;
+            case FrameType::Chat:
+                if (events.onChat) {
+                    events.onChat(frame.payload);
+                }
+                break;
+            case FrameType::FileBegin:
+                beginDownload(frame.payload);
+                break;
+            case FrameType::FileData:
+                receiveChunk(frame.payload);
+                break;
+            case FrameType::FileEnd:
+                endDownload(frame.payload);
+                break;
+            case FrameType::FileAck:
+                if (frame.payload.size() >= 16) {
+                    onFileAck(getU64(frame.payload.data()), getU64(frame.payload.data() + 8));
+                }
+                break;
+            case FrameType::AllReceived:
+                if (frame.payload.size() >= 8) {
+                    onAllReceived(getU64(frame.payload.data()));
+                }
+                break;
+            default:
+                if (events.onNotice) {
+                    events.onNotice(frame.payload);
+                }
+                break;
+        }
+    }
+
+    void startNextUpload() {
+        while (!uploads.empty() && uploads.front().stage == Upload::Stage::Queued && isOpen()) {
+            Upload& upload = uploads.front();
+            upload.file.open(upload.path, std::ios::binary | std::ios::ate);
+            if (!upload.file.is_open()) {
+                error("Failed to open the file: " + upload.path.string());
+                uploads.pop_front();
+                continue;
+            }
+            upload.size = static_cast<uint64_t>(upload.file.tellg());
+            upload.stage = Upload::Stage::Offered;
+            upload.offeredAt = std::chrono::steady_clock::now();
+            if (upload.resumeId) {
+                std::string payload;
+                putU64(payload, *upload.resumeId);
+                queueFrame(FrameType::FileResume, payload);
+                return;
+            }
+            if (!upload.digest) {
+                upload.digest = hashFile(upload.path);
+            }
+            std::string offer;
+            putU64(offer, upload.size);
+            offer.append(reinterpret_cast<const char*>(upload.digest->data()), upload.digest->size());
+            offer += upload.path.filename().string();
+            queueFrame(FrameType::FileOffer, offer, kOfferHashed);
+            return;
+        }
+    }
+
+    // The first FileAck names the transfer and where to start; one during
+    // the upload means a chunk arrived damaged and everything from its
+    // offset goes again; one at the full size means the server has it all
+    void onFileAck(uint64_t id, uint64_t offset) {
+        if (uploads.empty()) {
+            return;
+        }
+        Upload& upload = uploads.front();
+        if (upload.stage == Upload::Stage::Offered) {
+            upload.id = id;
+            if (events.onUploadStarted) {
+                events.onUploadStarted(id, upload.path.filename().string(), offset, upload.size);
+            }
+        } else if (upload.stage == Upload::Stage::Queued || upload.id != id) {
+            return;
+        }
+        if (offset >= upload.size) {
+            finishUpload(true);
+            return;
+        }
+        upload.offset = offset;
+        upload.stage = Upload::Stage::Streaming;
+        onWritable();
+    }
+
+    // Ends a failed upload too: the server sends it after telling us why
+    void onAllReceived(uint64_t id) {
+        if (!uploads.empty() && uploads.front().stage != Upload::Stage::Queued && uploads.front().id == id) {
+            finishUpload(false);
+        } else if (events.onUploadSettled) {
+            events.onUploadSettled(id);
+        }
+    }
+
+    void finishUpload(bool complete) {
+        uint64_t id = uploads.front().id;
+        uploads.pop_front();
+        if (events.onUploadFinished) {
+            events.onUploadFinished(id, complete);
+        }
+        startNextUpload();
+    }
+
+    // The next chunk of the upload under way, checksummed and compressed
+    // when the server takes that and it shrinks. False when there is none.
+    bool nextChunk() {
+        if (uploads.empty() || uploads.front().stage != Upload::Stage::Streaming) {
+            return false;
+        }
+        Upload& upload = uploads.front();
+        char buffer[kFileChunkSize];
+        upload.file.clear();
+        upload.file.seekg(static_cast<std::streamoff>(upload.offset));
+        upload.file.read(buffer, static_cast<std::streamsize>(std::min<uint64_t>(sizeof(buffer), upload.size - upload.offset)));
+        size_t bytesRead = static_cast<size_t>(upload.file.gcount());
+        if (bytesRead == 0) {
+            error("Failed to read " + upload.path.string() + " at byte " + std::to_string(upload.offset));
+            upload.stage = Upload::Stage::Sent;
+            return false;
+        }
+
+        std::string chunk;
+        chunk.reserve(kFileDataHeaderSize + bytesRead);
+        putU64(chunk, upload.offset);
+        putU32(chunk, crc32c(0, buffer, bytesRead));
+        uint8_t flags = 0;
+        if (serverCompresses && upload.uncompressedChunks > 0) {
+            upload.uncompressedChunks--;
+        } else if (serverCompresses) {
+            // Compressed in place after the offset and checksum, which stay as they are
+            chunk.resize(kFileDataHeaderSize + compressionBudget(bytesRead));
+            size_t packed = compressPayload(std::string_view(buffer, bytesRead), &chunk[kFileDataHeaderSize], chunk.size() - kFileDataHeaderSize);
+            chunk.resize(kFileDataHeaderSize + packed);
+            flags = packed > 0 ? kCompressed : 0;
+            upload.uncompressedChunks = packed > 0 ? 0 : kUncompressedRun;
+        }
+        if (flags == 0) {
+            chunk.append(buffer, bytesRead);
+        }
+        appendFrame(out, FrameType::FileData, chunk, flags);
+        upload.offset += bytesRead;
+        if (upload.offset >= upload.size) {
+            upload.stage = Upload::Stage::Sent;
+        }
+        return true;
+    }
+
+    std::filesystem::path userFolder() const {
+        return options.storage / options.name;
+    }
+
+    // Size of the .part file an earlier attempt at this download left, if any
+    std::optional<uint64_t> partialDownload(uint64_t id) const {
+        std::error_code ignored;
+        if (!std::filesystem::exists(userFolder(), ignored)) {
+            return std::nullopt;
+        }
+        std::string prefix = std::to_string(id) + "-";
+        for (const auto& entry : std::filesystem::directory_iterator(userFolder(), ignored)) {
+            std::string name = entry.path().filename().string();
+            if (name.rfind(prefix, 0) == 0 && entry.path().extension() == ".part") {
+                return entry.file_size();
+            }
+        }
+        return std::nullopt;
+    }
+
+    void beginDownload(std::string_view payload) {
+        if (payload.size() < 24) {
+            error("Failed to receive file size.");
+            return;
+        }
+        std::filesystem::create_directories(userFolder());
+
+        uint64_t fileSize = getU64(payload.data());
+        uint64_t offset = getU64(payload.data() + 8);
+        download.file.close();
+        download.id = getU64(payload.data() + 16);
+        download.name = std::filesystem::path(std::string(payload.substr(24))).filename().string();
+        download.partPath = userFolder() / (std::to_string(download.id) + "-" + download.name + ".part");
+        download.remaining = fileSize - std::min(offset, fileSize);
+        download.crc = 0;
+
+        // Keeps what an earlier attempt already received
+        if (offset > 0) {
+            download.file.open(download.partPath, std::ios::binary | std::ios::in | std::ios::out);
+            download.crc = checksumOf(download.file, offset);
+            download.file.seekp(static_cast<std::streamoff>(offset));
+        } else {
+            download.file.open(download.partPath, std::ios::binary | std::ios::out | std::ios::trunc);
+        }
+        if (!download.file.is_open()) {
+            error("Failed to open file for writing: " + download.name);
+            return;
+        }
+        if (events.onDownloadStarted) {
+            events.onDownloadStarted(download.id, download.name, offset);
+        }
+    }
+
+    void receiveChunk(std::string_view data) {
+        if (!download.file.is_open()) {
+            return;
+        }
+        download.file.write(data.data(), static_cast<std::streamsize>(data.size()));
+        download.crc = crc32c(download.crc, data.data(), data.size());
+        download.remaining -= std::min<uint64_t>(download.remaining, data.size());
+    }
+
+    // FileEnd carries the checksum of the whole file; only a match is kept under its real name
+    void endDownload(std::string_view payload) {
+        if (!download.file.is_open() || payload.size() < 12) {
+            return;
+        }
+        download.file.close();
+        bool intact = download.remaining == 0 && getU32(payload.data() + 8) == download.crc;
+        std::filesystem::path path = download.partPath;
+        if (intact) {
+            path = userFolder() / download.name;
+            std::filesystem::rename(download.partPath, path);
+        }
+        if (events.onDownloadFinished) {
+            events.onDownloadFinished(download.id, path, intact);
+        }
+    }
+
+    static uint32_t checksumOf(std::fstream& file, uint64_t length) {
+        uint32_t crc = 0;
+        char buffer[kFileChunkSize];
+        file.seekg(0);
+        while (length > 0 && file.read(buffer, static_cast<std::streamsize>(std::min<uint64_t>(sizeof(buffer), length)))) {
+            crc = crc32c(crc, buffer, static_cast<size_t>(file.gcount()));
+            length -= static_cast<uint64_t>(file.gcount());
+        }
+        file.clear();
+        return crc;
+    }
+
+    void error(const std::string& message) {
+        if (events.onError) {
+            events.onError(message);
+        }
+    }
+
+    void closeSocket() {
+        if (socket != INVALID_SOCKET) {
+            closesocket(socket);
+            socket = INVALID_SOCKET;
+        }
+    }
+};
+
+// A ChatConnection on its own thread. Commands may come from any thread;
+// they are handed to the connection's thread, which runs every callback.
+class ChatClient {
+public:
+    ChatClient(ChatClientOptions options, ChatClientEvents events) : connection(std::move(options), std::move(events)) {}
+
+    ~ChatClient() {
+        stop();
+    }
+
+    ChatClient(const ChatClient&) = delete;
+    ChatClient& operator=(const ChatClient&) = delete;
+
+    // Connects and starts the thread. False if the server cannot be reached.
+    bool start() {
+        if (!wakeup.open() || !connection.connect()) {
+            return false;
+        }
+        running = true;
+        thread = std::thread([this]() {
+            run();
+        });
+        return true;
+    }
+
+    // Closes the connection without a word to the server and waits for the thread
+    void stop() {
+        post([this](ChatConnection&) {
+            running = false;
+        });
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    // Until the connection closes, from either side
+    void wait() {
+        std::unique_lock<std::mutex> lock(mutex);
+        closed.wait(lock, [this]() {
+            return finished;
+        });
+    }
+
+    void sendChat(std::string text) {
+        post([text = std::move(text)](ChatConnection& connection) {
+            connection.sendChat(text);
+        });
+    }
+
+    void changeRoom(std::string room) {
+        post([room = std::move(room)](ChatConnection& connection) {
+            connection.changeRoom(room);
+        });
+    }
+
+    void accept(std::optional<uint64_t> id = std::nullopt) {
+        post([id](ChatConnection& connection) {
+            connection.accept(id);
+        });
+    }
+
+    void decline(std::optional<uint64_t> id = std::nullopt) {
+        post([id](ChatConnection& connection) {
+            connection.decline(id);
+        });
+    }
+
+    // The file is hashed here, on the caller's thread, so incoming chat is not held up meanwhile
+    void sendFile(std::filesystem::path path) {
+        Sha256Digest digest = ChatConnection::hashFile(path);
+        post([path = std::move(path), digest](ChatConnection& connection) {
+            connection.sendFile(path, digest);
+        });
+    }
+
+    void resumeFile(uint64_t id, std::filesystem::path path) {
+        post([id, path = std::move(path)](ChatConnection& connection) {
+            connection.resumeFile(id, path);
+        });
+    }
+
+    void exit() {
+        post([](ChatConnection& connection) {
+            connection.exit();
+        });
+    }
+
+private:
+    using Command = std::function<void(ChatConnection&)>;
+
+    // Lets another thread interrupt poll(): a UDP socket on loopback that
+    // sends itself a byte. A pipe would do on POSIX, but this works on Winsock too.
+    class Wakeup {
+    public:
+        ~Wakeup() {
+            if (socket != INVALID_SOCKET) {
+                closesocket(socket);
+            }
+        }
+
+        bool open() {
+            socket = ::socket(AF_INET, SOCK_DGRAM, 0);
+            sockaddr_in address{};
+            address.sin_family = AF_INET;
+            address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            socklen_t length = sizeof(address);
+            return socket != INVALID_SOCKET && bind(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 &&
+                   getsockname(socket, reinterpret_cast<sockaddr*>(&address), &length) == 0 &&
+                   ::connect(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0 && setNonBlocking(socket);
+        }
+
+        SOCKET getSocket() const {
+            return socket;
+        }
+
+        void wake() {
+            char byte = 0;
+            ::send(socket, &byte, 1, 0);
+        }
+
+        void drain() {
+            char bytes[64];
+            while (recv(socket, bytes, sizeof(bytes), 0) > 0) {
+            }
+        }
+
+    private:
+        SOCKET socket = INVALID_SOCKET;
+    };
+
+    ChatConnection connection;
+    Wakeup wakeup;
+    std::thread thread;
+    bool running = false; // connection thread only, once started
+    std::mutex mutex;
+    std::condition_variable closed;
+    std::vector<Command> commands;
+    bool finished = false;
+
+    void post(Command command) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (finished) {
+                return;
+            }
+            commands.push_back(std::move(command));
+        }
+        wakeup.wake();
+    }
+
+    void run() {
+        std::vector<Command> pending;
+        while (running && connection.isOpen()) {
+            pollfd sockets[2] = {};
+            sockets[0].fd = connection.getSocket();
+            sockets[0].events = static_cast<short>(POLLIN | (connection.wantsWrite() ? POLLOUT : 0));
+            sockets[1].fd = wakeup.getSocket();
+            sockets[1].events = POLLIN;
+            if (pollSockets(sockets, 2, connection.hasTimeouts() ? 1000 : -1) < 0 && WSAGetLastError() != EINTR) {
+                break;
+            }
+
+            if (sockets[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+                connection.onReadable();
+            }
+            if (connection.isOpen() && (sockets[0].revents & POLLOUT)) {
+                connection.onWritable();
+            }
+            if (sockets[1].revents & POLLIN) {
+                wakeup.drain();
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    pending.swap(commands);
+                }
+                for (Command& command : pending) {
+                    command(connection);
+                }
+                pending.clear();
+            }
+            connection.tick();
+        }
+        connection.close();
+
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+        commands.clear();
+        closed.notify_all();
+    }
+};
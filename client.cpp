@@ -1,232 +1,225 @@
 #include <iostream>
-#include <WinSock2.h>
-#include <Ws2tcpip.h>
-#include <fstream>
 #include <filesystem>
-#include <thread>
-#include <mutex>
-#include <condition_variable>
-
-#pragma comment(lib, "ws2_32.lib")
+#include <atomic>
+#include <optional>
+#include <string_view>
+#include "net.h"
+#include "chat_client.h"
 
 const int PORT = 12345;
-const CHAR *SERVER_IP = "127.0.0.1";
-
-class Client {
-public:
-    Client() : clientSocket(0) {
-        // Initialize Winsock
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            std::cerr << "WSAStartup failed" << std::endl;
-            exit(EXIT_FAILURE);
-        }
-
-        // Create client socket
-        clientSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (clientSocket == INVALID_SOCKET) {
-            std::cerr << "Error creating socket: " << WSAGetLastError() << std::endl;
-            WSACleanup();
-            exit(EXIT_FAILURE);
-        }
+const char *SERVER_IP = "127.0.0.1";
+
+enum class Command {
+    Chat, // anything that is not a command keyword
+    Exit,
+    Send,
+    Resume,
+    Change,
+    Accept,
+    Decline
+};
 
-        // Configure server address
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_port = htons(PORT);
-        InetPton(AF_INET, SERVER_IP, &serverAddr.sin_addr);
-
-        // Connect to the server
-        if (connect(clientSocket, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) == SOCKET_ERROR) {
-            std::cerr << "Connect failed with error: " << WSAGetLastError() << std::endl;
-            closesocket(clientSocket);
-            WSACleanup();
-            exit(EXIT_FAILURE);
-        }
+// The first word of a typed line is looked up in a perfect-hash table built
+// at compile time: one hash, one comparison, no string copies.
+struct CommandKeyword {
+    std::string_view word;
+    Command command;
+};
 
-        enterName();
-        enterRoom();
-        std::cout << "Connected to server and joined room " << roomID << std::endl;
+constexpr CommandKeyword kCommandKeywords[] = {
+    {"EXIT", Command::Exit},
+    {"SEND", Command::Send},
+    {"RESUME", Command::Resume},
+    {"CHANGE", Command::Change},
+    {"ACCEPT", Command::Accept},
+    {"NO", Command::Decline},
+};
 
-        // Create a new thread to handle receiving messages
-        std::thread([this]() {
-            receiveMessages();
-        }).detach();
-        sendMessages();
-    }
+constexpr size_t kCommandSlots = 8;
 
-    ~Client() {
-        closesocket(clientSocket);
-        WSACleanup();
-    }
+constexpr size_t commandSlot(std::string_view word) {
+    return (static_cast<unsigned char>(word.front()) * 2 + static_cast<unsigned char>(word.back()) + word.size()) % kCommandSlots;
+}
 
-private:
-    SOCKET clientSocket;
-    sockaddr_in serverAddr{};
-    WSADATA wsaData;
-    std::string roomID;
-    std::string userName;
-    std::mutex fileSendMutex;
-    std::condition_variable fileSendCondition;
-    bool fileSendComplete = false;
-
-    void enterRoom() {
-        std::cout << "Enter room ID: ";
-        std::cin >> roomID;
-        send(clientSocket, roomID.c_str(), roomID.size(), 0);
-    }
+struct CommandTable {
+    CommandKeyword slots[kCommandSlots] = {};
+    bool collision = false;
+};
 
-    void enterName() {
-        std::cout << "Enter your name: ";
-        std::getline(std::cin, userName);
-        send(clientSocket, userName.c_str(), userName.size(), 0);
+constexpr CommandTable buildCommandTable() {
+    CommandTable table;
+    for (const CommandKeyword& keyword : kCommandKeywords) {
+        CommandKeyword& slot = table.slots[commandSlot(keyword.word)];
+        table.collision |= !slot.word.empty();
+        slot = keyword;
     }
+    return table;
+}
 
-    void receiveMessages() {
-        char buffer[1024];
-        while (true) {
-            memset(buffer, 0, sizeof(buffer));
-            int bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-            if (bytesRead <= 0) {
-                std::cerr << "Server disconnected" << std::endl;
-                break;
-            }
-            if (strcmp(buffer, "FILE") == 0) {
-                receiveFile();
-                std::cout << "File was received" << std::endl;
-            }
-            else if(strcmp(buffer, "ALL_RECV") == 0) {
-                std::unique_lock<std::mutex> lock(fileSendMutex);
-                fileSendComplete = true;
-                fileSendCondition.notify_one();
+constexpr CommandTable kCommandTable = buildCommandTable();
+static_assert(!kCommandTable.collision, "command keywords must hash to distinct slots");
 
-            }else{
-                    std::cout << buffer << std::endl;
-                }
+struct ParsedCommand {
+    Command command;
+    std::string_view argument; // the rest of the line after the keyword
+};
 
+constexpr ParsedCommand parseCommand(std::string_view line) {
+    size_t space = line.find(' ');
+    std::string_view word = line.substr(0, space);
+    if (!word.empty()) {
+        const CommandKeyword& slot = kCommandTable.slots[commandSlot(word)];
+        if (slot.word == word) {
+            return {slot.command, space == std::string_view::npos ? std::string_view() : line.substr(space + 1)};
         }
     }
+    return {Command::Chat, line};
+}
 
-    void sendMessages() {
-        std::string message;
-        while (true) {
-            std::getline(std::cin, message);
-            if (message == "EXIT") {
-                send(clientSocket, message.c_str(), message.length(), 0);
-
-                std::cout << "Exiting the room and disconnecting..." << std::endl;
-                closesocket(clientSocket);
-                WSACleanup();
-                exit(0);
-            } else if (message.substr(0, 4) == "SEND"){
-                send(clientSocket, "SEND", 4, 0);
-                std::string filePath = message.substr(5);
-                sendFile(filePath);
-                continue;
-            }
-            else {
-                send(clientSocket, message.c_str(), message.length(), 0);
-            }
-        }
-    };
-
-    void receiveFile() {
-        ensureUserFolderExists();
-        const int chunkSize = 1024;
-        char fileBuffer[chunkSize];
-
-        // Receive the file name
-        char fileNameBuffer[256]; // Assuming maximum file name length is 255 characters
-        int fileNameLength = recv(clientSocket, fileNameBuffer, sizeof(fileNameBuffer), 0);
-        if (fileNameLength <= 0) {
-            std::cerr << "Failed to receive file name." << std::endl;
-            return;
-        }
-        fileNameBuffer[fileNameLength] = '\0';
-        std::string fileName(fileNameBuffer);
-        size_t pos = fileName.find("txt");
-        if (pos != std::string::npos) {
-            fileName = fileName.substr(0, pos + 3);
-        }
+static_assert(parseCommand("CHANGE lobby").command == Command::Change);
+static_assert(parseCommand("NOTE to self").command == Command::Chat);
 
-        // Receive the file size
-        long long fileSize;
-        int bytesReceived = recv(clientSocket, reinterpret_cast<char*>(&fileSize), sizeof(fileSize), 0);
-        if (bytesReceived != sizeof(fileSize)) {
-            std::cerr << "Failed to receive file size." << std::endl;
-            return;
-        }
+// Console frontend: prompts for a name and a room, prints what arrives and
+// turns each typed line into a command. The connection, its transfers and
+// every callback run on the library's thread (chat_client.h); this thread
+// only reads the keyboard, so chat keeps flowing during uploads.
+class ConsoleClient {
+public:
+    explicit ConsoleClient(ChatClientOptions options) : room(options.room), client(std::move(options), events()) {}
 
-        // Open the file for writing
-        std::ofstream receivedFile("C:\\KSE IT\\Client Server Concepts\\csc_third\\clientStorage\\" + userName + "\\" + fileName, std::ios::binary);
-        if (!receivedFile.is_open()) {
-            std::cerr << "Failed to open file for writing: " << fileName << std::endl;
-            return;
+    bool start() {
+        if (!client.start()) {
+            return false;
         }
+        std::cout << "Connected to server and joined room " << room << std::endl;
+        return true;
+    }
 
-        // Receive and write file data
-        long long totalBytesReceived = 0;
-        while (totalBytesReceived < fileSize) {
-            int bytesToReceive = std::min(chunkSize, static_cast<int>(fileSize - totalBytesReceived));
-            int bytesReceived = recv(clientSocket, fileBuffer, bytesToReceive, 0);
-            if (bytesReceived <= 0) {
-                std::cerr << "Error while receiving file data." << std::endl;
-                return;
+    // Reads commands until EXIT, end of input or a lost connection
+    void run() {
+        std::string line;
+        while (!disconnected && std::getline(std::cin, line)) {
+            ParsedCommand parsed = parseCommand(line);
+            std::string argument(parsed.argument);
+            switch (parsed.command) {
+                case Command::Exit:
+                    std::cout << "Exiting the room and disconnecting..." << std::endl;
+                    client.exit();
+                    client.wait();
+                    return;
+                case Command::Send:
+                    client.sendFile(argument);
+                    break;
+                case Command::Resume: {
+                    // RESUME <transfer ID> <path>: finish an upload cut off by a lost connection
+                    size_t space = argument.find(' ');
+                    std::optional<uint64_t> id = transferId(argument.substr(0, space));
+                    if (space == std::string::npos || !id) {
+                        std::cerr << "Usage: RESUME <transfer ID> <path>" << std::endl;
+                        break;
+                    }
+                    client.resumeFile(*id, argument.substr(space + 1));
+                    break;
+                }
+                case Command::Change:
+                    room = argument;
+                    client.changeRoom(argument);
+                    break;
+                case Command::Accept:
+                    client.accept(transferId(argument));
+                    break;
+                case Command::Decline:
+                    client.decline(transferId(argument));
+                    break;
+                case Command::Chat:
+                    client.sendChat(line);
+                    break;
             }
-            receivedFile.write(fileBuffer, bytesReceived);
-            totalBytesReceived += bytesReceived;
         }
-
-        // Close the file
-        receivedFile.close();
+        client.stop();
     }
 
-    void sendFile(const std::string& filePath) {
-        std::ifstream fileToSend(filePath, std::ios::binary);
-        if (!fileToSend.is_open()) {
-            std::cerr << "Failed to open the file: " << filePath << std::endl;
-            return;
-        }
-
-        // Sending filename
-        size_t lastSlash = filePath.find_last_of("\\/");
-        std::string fileName = filePath.substr(lastSlash + 1);
-        send(clientSocket, fileName.c_str(), fileName.length(), 0);
-
-        fileToSend.seekg(0, std::ios::end);
-        int fileSize = static_cast<int>(fileToSend.tellg());
-        fileToSend.seekg(0, std::ios::beg);
-        // Sending num of bytes
-        send(clientSocket, reinterpret_cast<const char*>(&fileSize), sizeof(fileSize), 0);
-
-        const int chunkSize = 1024;
-        char buffer[chunkSize];
-
-        //Sending data
-        while (!fileToSend.eof()) {
-            fileToSend.read(buffer, chunkSize);
-            int bytesRead = static_cast<int>(fileToSend.gcount());
-            send(clientSocket, buffer, bytesRead, 0);
+private:
+    std::string room;
+    std::atomic<bool> disconnected{false};
+    ChatClient client;
+
+    // "ACCEPT 7" answers only transfer 7; a bare ACCEPT answers every open offer
+    static std::optional<uint64_t> transferId(const std::string& argument) {
+        try {
+            return std::stoull(argument);
+        } catch (const std::exception&) {
+            return std::nullopt;
         }
-        fileToSend.close();
-
-        std::unique_lock<std::mutex> lock(fileSendMutex);
-        fileSendCondition.wait(lock, [this] { return fileSendComplete; });
-        fileSendComplete = false;
     }
 
-    void ensureUserFolderExists() {
-        std::filesystem::path userFolderPath = "C:\\KSE IT\\Client Server Concepts\\csc_third\\clientStorage\\" + userName;
-
-        if (!std::filesystem::exists(userFolderPath)) {
-            std::filesystem::create_directory(userFolderPath);
-            std::cout << "User folder created: " << userFolderPath << std::endl;
-        }
+    ChatClientEvents events() {
+        ChatClientEvents events;
+        events.onChat = [](std::string_view text) {
+            std::cout << text << std::endl;
+        };
+        events.onNotice = [](std::string_view text) {
+            std::cout << text << std::endl;
+        };
+        events.onUploadStarted = [](uint64_t id, const std::string& fileName, uint64_t offset, uint64_t size) {
+            if (size > 0 && offset >= size) {
+                std::cout << "The server already has " << fileName << "; offered as transfer " << id << " without uploading it" << std::endl;
+            } else {
+                std::cout << "Sending " << fileName << " as transfer " << id << " (RESUME " << id << " <path> continues it if the connection drops)" << std::endl;
+            }
+        };
+        events.onUploadFinished = [](uint64_t id, bool complete) {
+            if (complete) {
+                std::cout << "Transfer " << id << " uploaded" << std::endl;
+            }
+        };
+        events.onUploadSettled = [](uint64_t id) {
+            std::cout << "Everyone has answered transfer " << id << std::endl;
+        };
+        events.onDownloadStarted = [](uint64_t, const std::string& fileName, uint64_t offset) {
+            if (offset > 0) {
+                std::cout << "Resuming " << fileName << " at byte " << offset << std::endl;
+            }
+        };
+        events.onDownloadFinished = [](uint64_t, const std::filesystem::path& path, bool intact) {
+            if (intact) {
+                std::cout << "File was received: " << path.string() << std::endl;
+            } else {
+                std::cerr << "File is corrupt (checksum mismatch); kept as " << path.filename() << std::endl;
+            }
+        };
+        events.onError = [](std::string_view message) {
+            std::cerr << message << std::endl;
+        };
+        events.onDisconnected = [this]() {
+            if (!disconnected.exchange(true)) {
+                std::cerr << "Server disconnected" << std::endl;
+            }
+        };
+        return events;
     }
 };
 
 int main() {
-    Client client;
-
-    std::this_thread::sleep_for(std::chrono::hours(1));
+    if (!netStartup()) {
+        std::cerr << "WSAStartup failed" << std::endl;
+        return EXIT_FAILURE;
+    }
 
+    ChatClientOptions options;
+    options.host = SERVER_IP;
+    options.port = PORT;
+    std::cout << "Enter your name: ";
+    std::getline(std::cin, options.name);
+    std::cout << "Enter room ID: ";
+    std::getline(std::cin, options.room);
+
+    ConsoleClient console(options);
+    if (!console.start()) {
+        netCleanup();
+        return EXIT_FAILURE;
+    }
+    console.run();
+    netCleanup();
     return 0;
-}
\ No newline at end of file
+}
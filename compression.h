@@ -0,0 +1,274 @@
+#pragma once
+
+#include "buffer_pool.h"
+#include "lz4.h"
+#include "protocol.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Compressed chat and file payloads for connections that negotiated them
+// (kHelloCompression). Each payload is compressed on its own, with no state
+// carried from frame to frame, so a compressed frame can still be shared by
+// every queue it goes to and dropped for a slow reader like any other.
+// Chat lines are too short to compress well alone; they are compressed
+// against a dictionary trained on their room's recent traffic.
+
+// Shorter payloads are never worth the 4-8 bytes the compressed form adds
+constexpr size_t kMinCompressible = 32;
+
+// After a file chunk that would not shrink, this many go out as they are
+// before compression is tried again, so an already compressed file costs
+// one failed attempt in every kUncompressedRun + 1 chunks
+constexpr unsigned kUncompressedRun = 16;
+
+// Largest compressed form worth sending: it must save at least 1/16th
+inline size_t compressionBudget(size_t payloadSize) {
+    return payloadSize - payloadSize / 16;
+}
+
+// Writes the compressed form of a payload (size, dictionary ID, block) to
+// out, using at most `capacity` bytes. Returns its size, or 0 when the
+// payload is too short or does not fit: it is then sent as it is.
+inline size_t compressPayload(std::string_view payload, char* out, size_t capacity, const Lz4Dictionary* dictionary = nullptr,
+                              uint32_t dictionaryId = 0) {
+    size_t header = dictionary != nullptr ? 8 : 4;
+    if (payload.size() < kMinCompressible || capacity <= header) {
+        return 0;
+    }
+    size_t block = lz4Compress(payload.data(), payload.size(), out + header, capacity - header, dictionary);
+    if (block == 0) {
+        return 0;
+    }
+    if (dictionary != nullptr) {
+        storeU32(out, dictionaryId);
+    }
+    storeU32(out + header - 4, static_cast<uint32_t>(payload.size()));
+    return header + block;
+}
+
+// A room's chat dictionary, as published by its trainer
+struct ChatDictionary {
+    const uint32_t id;
+    const Lz4Dictionary codec;
+    const FrameRef frame; // the Dictionary frame that hands it to clients, shared by all of them
+
+    ChatDictionary(uint32_t id, std::string content) : id(id), codec(std::move(content)), frame(encode(id, codec.bytes())) {}
+
+private:
+    static FrameRef encode(uint32_t id, std::string_view content) {
+        std::string prefix;
+        putU32(prefix, id);
+        return BufferPool::global().frame(FrameType::Dictionary, {prefix, content});
+    }
+};
+
+// A payload as a compressed frame of the given type, or an empty ref when it
+// is not worth compressing. Built once and shared like any other frame.
+inline FrameRef compressFrame(FrameType type, std::string_view payload, const ChatDictionary* dictionary = nullptr) {
+    if (payload.size() < kMinCompressible) {
+        return FrameRef();
+    }
+    uint8_t flags = dictionary != nullptr ? kCompressed | kDictionaryCompressed : kCompressed;
+    return BufferPool::global().frameInPlace(type, compressionBudget(payload.size()), [&](char* out, size_t capacity) {
+        return dictionary != nullptr ? compressPayload(payload, out, capacity, &dictionary->codec, dictionary->id)
+                                     : compressPayload(payload, out, capacity);
+    }, flags);
+}
+
+// The chat dictionaries a receiver has been sent. The last few are kept, so
+// chat compressed just before a room retrained (or before a room change)
+// still decodes.
+class ReceivedDictionaries {
+public:
+    explicit ReceivedDictionaries(size_t capacity = 4) : capacity(std::max<size_t>(1, capacity)) {}
+
+    // Takes a Dictionary frame's payload
+    void add(std::string_view payload) {
+        if (payload.size() < 4) {
+            return;
+        }
+        uint32_t id = getU32(payload.data());
+        if (find(id).data() != nullptr) {
+            return;
+        }
+        if (dictionaries.size() >= capacity) {
+            dictionaries.erase(dictionaries.begin());
+        }
+        dictionaries.emplace_back(id, std::string(payload.substr(4)));
+    }
+
+    // Null data if this dictionary never arrived or has been forgotten
+    std::string_view find(uint32_t id) const {
+        for (auto it = dictionaries.rbegin(); it != dictionaries.rend(); ++it) {
+            if (it->first == id) {
+                return it->second;
+            }
+        }
+        return {};
+    }
+
+private:
+    size_t capacity;
+    std::vector<std::pair<uint32_t, std::string>> dictionaries;
+};
+
+// Restores a compressed payload into out, decoding at most maxSize bytes.
+// False for a damaged block, one that is too large, or one that needs a
+// dictionary that is not in `dictionaries` (null when none are accepted).
+inline bool decompressPayload(std::string_view payload, uint8_t flags, const ReceivedDictionaries* dictionaries, std::string& out,
+                              size_t maxSize = kMaxFramePayload) {
+    std::string_view dictionary;
+    if (flags & kDictionaryCompressed) {
+        if (dictionaries == nullptr || payload.size() < 4) {
+            return false;
+        }
+        dictionary = dictionaries->find(getU32(payload.data()));
+        if (dictionary.data() == nullptr) {
+            return false;
+        }
+        payload.remove_prefix(4);
+    }
+    if (payload.size() < 4) {
+        return false;
+    }
+    size_t size = getU32(payload.data());
+    if (size > maxSize) {
+        return false;
+    }
+    out.resize(size);
+    return lz4Decompress(payload.data() + 4, payload.size() - 4, &out[0], size, dictionary);
+}
+
+// Learns one room's chat. The room's dispatch worker feeds it every message
+// and, after enough new ones, it trains a dictionary from the recent sample
+// and publishes it. Training keeps whole messages, preferring the ones that
+// share the most 8-byte runs with the rest of the sample (names, greetings,
+// the room's jargon), and puts the best ones last, nearest the text being
+// compressed. Retraining backs off as a room's traffic keeps going, since
+// every new dictionary has to be sent to each of its members.
+class ChatDictionaryTrainer {
+public:
+    static constexpr size_t kSamples = 256;
+    static constexpr size_t kMaxSampleSize = 512;
+    static constexpr size_t kDictionarySize = 8 * 1024;
+    static constexpr size_t kFirstTraining = 32;     // messages before the first dictionary
+    static constexpr size_t kMaxInterval = 16 * 1024; // messages between retrainings, at most
+
+    // Dispatch worker only. Returns the new dictionary when this message completed a round of training.
+    std::shared_ptr<const ChatDictionary> add(std::string_view payload) {
+        std::string_view sample = payload.substr(0, kMaxSampleSize);
+        if (samples.size() < kSamples) {
+            samples.emplace_back(sample);
+        } else {
+            samples[nextSample % kSamples].assign(sample.data(), sample.size());
+        }
+        nextSample++;
+        if (nextSample < trainAt) {
+            return nullptr;
+        }
+        interval = std::min(interval * 2, kMaxInterval);
+        trainAt = nextSample + interval;
+
+        std::string content = train();
+        if (content.empty()) {
+            return nullptr;
+        }
+        auto trained = std::make_shared<const ChatDictionary>(nextId(), std::move(content));
+        std::lock_guard<std::mutex> lock(mutex);
+        published = trained;
+        return trained;
+    }
+
+    // Any thread; null until the room has had enough traffic to train on
+    std::shared_ptr<const ChatDictionary> current() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return published;
+    }
+
+private:
+    static constexpr int kCountBits = 14;
+
+    std::vector<std::string> samples; // the most recent messages, up to kSamples
+    size_t nextSample = 0;
+    size_t interval = kFirstTraining;
+    size_t trainAt = kFirstTraining;
+    mutable std::mutex mutex;
+    std::shared_ptr<const ChatDictionary> published;
+
+    // IDs are unique across the server, so a client moving between rooms
+    // never mixes dictionaries up. They start at random, so clients carried
+    // over from a previous process (see handoff.h) do not mistake a new
+    // dictionary for one they already hold.
+    static uint32_t nextId() {
+        static std::atomic<uint32_t> next{std::random_device{}()};
+        return next.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    static uint32_t runHash(const char* data) {
+        uint64_t run;
+        std::memcpy(&run, data, sizeof(run));
+        return static_cast<uint32_t>((run * 0x9E3779B97F4A7C15ull) >> (64 - kCountBits));
+    }
+
+    std::string train() {
+        thread_local std::array<uint16_t, size_t(1) << kCountBits> counts;
+        thread_local std::vector<std::pair<double, size_t>> ranked;
+        counts.fill(0);
+        for (const std::string& sample : samples) {
+            for (size_t at = 0; at + 8 <= sample.size(); at++) {
+                uint16_t& count = counts[runHash(sample.data() + at)];
+                count += count < UINT16_MAX;
+            }
+        }
+
+        ranked.clear();
+        for (size_t i = 0; i < samples.size(); i++) {
+            const std::string& sample = samples[i];
+            if (sample.size() < 8) {
+                continue;
+            }
+            uint64_t shared = 0;
+            for (size_t at = 0; at + 8 <= sample.size(); at++) {
+                shared += counts[runHash(sample.data() + at)] - 1u;
+            }
+            ranked.emplace_back(static_cast<double>(shared) / static_cast<double>(sample.size()), i);
+        }
+        std::sort(ranked.begin(), ranked.end(), [](const auto& a, const auto& b) {
+            return a.first > b.first;
+        });
+
+        // Best first until full, skipping repeats, then laid out best last
+        size_t chosen = 0;
+        size_t total = 0;
+        for (size_t i = 0; i < ranked.size() && total < kDictionarySize; i++) {
+            const std::string& sample = samples[ranked[i].second];
+            bool repeat = false;
+            for (size_t j = 0; j < chosen && !repeat; j++) {
+                repeat = samples[ranked[j].second] == sample;
+            }
+            if (!repeat) {
+                std::swap(ranked[chosen++], ranked[i]);
+                total += sample.size();
+            }
+        }
+
+        std::string content;
+        content.reserve(total);
+        for (size_t i = chosen; i-- > 0;) {
+            content += samples[ranked[i].second];
+        }
+        if (content.size() > kDictionarySize) {
+            content.erase(0, content.size() - kDictionarySize);
+        }
+        return content;
+    }
+};
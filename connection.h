@@ -0,0 +1,676 @@
+#pragma once
+
+#include "net.h"
+#include "admission.h"
+#include "event_loop.h"
+#include "protocol.h"
+#include "outbound_queue.h"
+#include "session_table.h"
+#include "transfer_manager.h"
+#include "logger.h"
+#include "metrics.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Where a client is in the conversation with the server. Every incoming frame
+// is dispatched according to this instead of a blocking recv() sequence.
+enum class ConnState {
+    AwaitName,
+    AwaitRoom,
+    Chat,
+    ReceivingFile,
+    Closed
+};
+
+struct UploadState {
+    TransferHandle transfer; // set while the upload is in progress
+    uint64_t received = 0;
+    UploadWriter file;
+    uint64_t startedAt = 0; // monotonic ns, for throughput metrics
+    uint64_t startOffset = 0;
+};
+
+// Download of one or more accepted transfers to a client, written a chunk at
+// a time as the outbound queue drains
+struct PendingDownload {
+    TransferHandle transfer;
+    uint64_t offset; // where to start, when resuming
+};
+
+struct DownloadState {
+    std::deque<PendingDownload> pending;
+    TransferHandle transfer; // the one being sent, if any
+    std::shared_ptr<FileHandle> file;
+    uint64_t offset = 0;
+    uint64_t startedAt = 0; // monotonic ns, for throughput metrics
+    uint64_t startOffset = 0;
+    unsigned uncompressedChunks = 0; // chunks left to send as they are after one would not shrink
+};
+
+class Connection;
+
+class ConnectionHandler {
+public:
+    virtual ~ConnectionHandler() = default;
+    virtual void onFrame(const std::shared_ptr<Connection>& connection, const Frame& frame) = 0;
+    virtual void onClose(const std::shared_ptr<Connection>& connection) = 0;
+};
+
+// A non-blocking client socket owned by one EventLoop. Reads happen on the
+// loop thread; send() may be called from any thread. Outgoing frames are
+// queued and written by the loop when the socket is writable, so everything
+// that piles up between two wakeups leaves in one batched sendmsg().
+//
+// On an io_uring loop the same happens through completions: one multishot
+// recv stays armed for the life of the connection, and at most one SENDMSG
+// is in flight, so frames still leave in order. The socket is closed only
+// after every operation on it has completed.
+class Connection : public EventHandler, public std::enable_shared_from_this<Connection> {
+public:
+    const SessionId id;
+    ConnState state = ConnState::AwaitName;
+    std::shared_ptr<Session> session; // set once the client has sent its name
+    bool compression = false;         // negotiated in Hello, before the client joins any room
+    RateLimiter admission;            // this client's chat rate, loop thread only
+    bool throttled = false;           // its last chat message was turned away, and it has been told
+    UploadState upload;
+    DownloadState download;
+
+    Connection(SessionId id, SOCKET socket, EventLoop& loop, ConnectionHandler& handler, const OutboundLimits& limits)
+        : id(id), socket(socket), loop(loop), uring(loop.getBackend() == IoBackend::Uring), handler(handler), outQueue(limits) {}
+
+    void onEvents(uint32_t events) override {
+        if (events & EPOLLERR) {
+            close();
+            return;
+        }
+        if (events & EPOLLOUT) {
+            flush();
+        }
+        if (readPaused) {
+            if (events & EPOLLHUP) {
+                close(); // gone for good; nothing left to hold off
+            }
+            return;
+        }
+        if (events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) {
+            readAvailable();
+        }
+    }
+
+    void onRegistered() override {
+        loop.submitRecv(socket);
+        recvArmed = true;
+    }
+
+    void onCompletion(const Completion& completion) override {
+        switch (completion.op) {
+            case IoOp::Recv:
+                onReceived(completion);
+                break;
+            case IoOp::Send:
+                onSent(completion);
+                break;
+            case IoOp::PollOut:
+                {
+                    std::lock_guard<std::mutex> lock(outMutex);
+                    pollArmed = false;
+                }
+                flush();
+                break;
+            default:
+                break;
+        }
+        if (state == ConnState::Closed) {
+            releaseIfIdle();
+        }
+    }
+
+    // Chat frames are marked droppable so a slow reader sheds them first
+    bool send(FrameRef frame, bool droppable = false) {
+        return enqueue([&](OutboundQueue& queue) {
+            return queue.push(std::move(frame), droppable);
+        });
+    }
+
+    // Queues a frame header followed by file bytes that go out with sendfile()
+    bool sendFileSegment(FrameRef header, std::shared_ptr<FileHandle> file, uint64_t offset, size_t length) {
+        return enqueue([&](OutboundQueue& queue) {
+            return queue.pushFile(std::move(header), std::move(file), offset, length);
+        });
+    }
+
+    // Queues a FileData frame already in memory; like sendFileSegment(), it
+    // is paced by canWrite() and not subject to the slow-consumer policy
+    bool sendFileData(FrameRef frame) {
+        return enqueue([&](OutboundQueue& queue) {
+            return queue.pushData(std::move(frame));
+        });
+    }
+
+    // Room broadcasts from other threads: through the loop's mailbox, so the
+    // caller takes no lock and makes no system call per recipient. Never
+    // sent directly from another thread, which could overtake frames still
+    // waiting in the mailbox.
+    bool deliver(const FrameRef& frame, bool droppable) {
+        if (loop.isInLoopThread()) {
+            return send(frame, droppable);
+        }
+        loop.deliver(shared_from_this(), frame, droppable);
+        return true;
+    }
+
+    void onDelivery(const FrameRef& frame, bool droppable) override {
+        send(frame, droppable);
+    }
+
+    bool sendFrame(FrameType type, std::string_view payload = {}) {
+        return send(BufferPool::global().frame(type, {payload}));
+    }
+
+    // False once the outbound queue is past the high watermark; producers
+    // should then wait for the drain callback before queueing more
+    bool canWrite() {
+        std::lock_guard<std::mutex> lock(outMutex);
+        return !closed && !outQueue.aboveHighWatermark();
+    }
+
+    // One-shot callback, run on the loop thread when the queue falls under
+    // the low watermark
+    void onDrain(std::function<void()> callback) {
+        std::lock_guard<std::mutex> lock(outMutex);
+        drainCallback = std::move(callback);
+        if (!writeArmed && !closed) {
+            writeArmed = armWrite();
+        }
+    }
+
+    size_t queuedBytes() {
+        std::lock_guard<std::mutex> lock(outMutex);
+        return outQueue.bytes();
+    }
+
+    uint64_t droppedFrames() {
+        std::lock_guard<std::mutex> lock(outMutex);
+        return outQueue.droppedFrames();
+    }
+
+    // May be called from any thread; the socket is torn down on its own loop
+    void close() {
+        auto self = shared_from_this();
+        loop.runInLoop([self]() {
+            self->closeInLoop();
+        });
+    }
+
+    // Loop thread only. Stops taking frames from this client for a while:
+    // what has already arrived waits in the input buffer, and the socket is
+    // not read, so a client sending faster than it is allowed fills its own
+    // TCP window instead of server memory.
+    void pauseReading(uint64_t nanos) {
+        if (readPaused || state == ConnState::Closed) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(outMutex);
+            readPaused = true;
+            if (!uring) {
+                setInterest();
+            }
+        }
+        if (uring && recvArmed) {
+            loop.cancelRecv(socket);
+        }
+        auto self = shared_from_this();
+        loop.runAfter(nanos, [self]() {
+            self->resumeReading();
+        });
+    }
+
+    // Handoff, loop thread only. Stops reading for good and, on io_uring,
+    // cancels every operation on the socket and issues no new sends, so the
+    // connection can go still before detach().
+    void freeze() {
+        if (frozen || state == ConnState::Closed) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(outMutex);
+            frozen = true;
+            readPaused = true;
+            if (!uring) {
+                setInterest();
+            }
+        }
+        if (uring) {
+            loop.cancelAll(socket);
+        }
+    }
+
+    // Handoff, loop thread only. Once nothing is in flight on the frozen
+    // socket, copies out the input not yet parsed and the output not yet
+    // written, and lets go of the connection without closing the socket or
+    // leaving its room: both now belong to the process taking over. False
+    // while an operation has still to complete.
+    bool detach(std::string& input, std::string& output) {
+        std::lock_guard<std::mutex> lock(outMutex);
+        if (!frozen || state == ConnState::Closed || (uring && (recvArmed || sendInFlight || pollArmed))) {
+            return false;
+        }
+        input.resize(inBuffer.size());
+        inBuffer.copyOut(0, &input[0], input.size());
+        if (!outQueue.unsent(output)) {
+            logWarning("Client ", id, " lost queued file data in the handoff");
+        }
+        state = ConnState::Closed;
+        closed = true;
+        released = true;
+        drainCallback = nullptr;
+        loop.remove(socket);
+        return true;
+    }
+
+    // The other side of a handoff: input the previous process had read but
+    // not parsed. Parsed by processInput() once the loop runs.
+    void restoreInput(std::string_view input) {
+        inBuffer.reserve(input.size());
+        std::memcpy(inBuffer.writePointer(), input.data(), input.size());
+        inBuffer.commit(input.size());
+    }
+
+    void processInput() {
+        if (!readPaused && state != ConnState::Closed) {
+            parseInput();
+        }
+    }
+
+    SOCKET getSocket() const {
+        return socket;
+    }
+
+    EventLoop& getLoop() {
+        return loop;
+    }
+
+private:
+    SOCKET socket;
+    EventLoop& loop;
+    const bool uring;
+    ConnectionHandler& handler;
+    RingBuffer inBuffer;
+    FrameParser parser;
+    std::mutex outMutex;
+    OutboundQueue outQueue;
+    std::function<void()> drainCallback;
+    bool writeArmed = false;   // a write is scheduled, waiting for EPOLLOUT, or in flight
+    bool watchingOut = false;  // epoll: EPOLLOUT is in the interest set
+    bool overflowed = false;
+    bool closed = false;
+    bool readPaused = false;   // written on the loop thread under outMutex, which setInterest() holds too
+    bool frozen = false;       // being handed to another process; never reads or starts a send again
+
+    // io_uring only; the send state is guarded by outMutex
+    bool recvArmed = false;
+    bool sendInFlight = false;
+    bool pollArmed = false;
+    bool released = false;
+    msghdr sendMessage{};
+    iovec sendBatch[OutboundQueue::kMaxBatch];
+
+    template <typename Push>
+    bool enqueue(Push&& push) {
+        PushResult result;
+        {
+            std::lock_guard<std::mutex> lock(outMutex);
+            if (closed || overflowed) {
+                return false;
+            }
+            result = push(outQueue);
+            overflowed = result == PushResult::Overflow;
+            if (!writeArmed) {
+                writeArmed = armWrite();
+            }
+        }
+
+        if (result == PushResult::Overflow) {
+            logWarning("Client ", id, " is not reading, disconnecting");
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    // Called with outMutex held. On the loop thread (mailbox deliveries,
+    // replies to the client's own frames) the write waits for the end of
+    // the loop's pass; from elsewhere epoll is asked for EPOLLOUT.
+    bool armWrite() {
+        if (uring || loop.isInLoopThread()) {
+            loop.scheduleWrite(shared_from_this());
+            return true;
+        }
+        watchOut(true);
+        return watchingOut;
+    }
+
+    void watchOut(bool on) {
+        if (on != watchingOut) {
+            watchingOut = on;
+            if (!setInterest()) {
+                watchingOut = !on;
+            }
+        }
+    }
+
+    // Called with outMutex held. A paused reader is not even watched for a
+    // hang-up, which would otherwise be reported on every pass.
+    bool setInterest() {
+        uint32_t events = readPaused ? 0 : EPOLLIN | EPOLLRDHUP;
+        return loop.modify(socket, watchingOut ? events | EPOLLOUT : events);
+    }
+
+    void resumeReading() {
+        if (!readPaused || frozen || state == ConnState::Closed) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(outMutex);
+            readPaused = false;
+            if (!uring) {
+                setInterest();
+            }
+        }
+        if (!parseInput()) {
+            return;
+        }
+        if (uring && !recvArmed && !readPaused) {
+            loop.submitRecv(socket);
+            recvArmed = true;
+        }
+    }
+
+    // Parses what has arrived; false once the connection is closing or has
+    // paused its reading, leaving the rest in the buffer
+    bool parseInput() {
+        auto self = shared_from_this();
+        ParseResult result = parser.parse(inBuffer, [this, &self](const Frame& frame) {
+            handler.onFrame(self, frame);
+            return state != ConnState::Closed && !readPaused;
+        }, [this](FrameType type) {
+            return maxPayload(type);
+        });
+        if (result == ParseResult::BadFrame) {
+            logWarning("Malformed frame, dropping client");
+            close();
+            return false;
+        }
+        return state != ConnState::Closed && !readPaused;
+    }
+
+    // Only an upload in progress may send frames past kMaxControlPayload, so
+    // a client cannot make the server reserve megabytes with a bare header
+    uint32_t maxPayload(FrameType type) const {
+        return state == ConnState::ReceivingFile && type == FrameType::FileData ? kMaxFramePayload : kMaxControlPayload;
+    }
+
+    void readAvailable() {
+        // Bounded so one busy client cannot starve the rest of the loop
+        for (int reads = 0; reads < 16 && state != ConnState::Closed && !readPaused; reads++) {
+            ssize_t bytesRead = recv(socket, inBuffer.writePointer(), inBuffer.writableContiguous(), 0);
+            if (bytesRead > 0) {
+                inBuffer.commit(static_cast<size_t>(bytesRead));
+                countMetric(Counter::BytesIn, static_cast<uint64_t>(bytesRead));
+                if (!parseInput()) {
+                    return;
+                }
+                continue;
+            }
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytesRead < 0 && wouldBlock()) {
+                return;
+            }
+            close();
+            return;
+        }
+    }
+
+    // io_uring: the kernel filled a provided buffer, which goes back to it
+    // when this returns, so the bytes are copied into the ring first
+    void onReceived(const Completion& completion) {
+        recvArmed = completion.more;
+        if (state == ConnState::Closed) {
+            return;
+        }
+        if (completion.result > 0) {
+            countMetric(Counter::BytesIn, static_cast<uint64_t>(completion.result));
+            const char* data = completion.data;
+            size_t remaining = static_cast<size_t>(completion.result);
+            while (remaining > 0) {
+                if (readPaused) {
+                    // Arrived before the cancellation took effect; kept for when reading resumes
+                    inBuffer.reserve(inBuffer.size() + remaining);
+                }
+                size_t length = std::min(remaining, inBuffer.writableContiguous());
+                std::memcpy(inBuffer.writePointer(), data, length);
+                inBuffer.commit(length);
+                data += length;
+                remaining -= length;
+                if (!readPaused && !parseInput() && state == ConnState::Closed) {
+                    return;
+                }
+            }
+        } else if (completion.result == -ECANCELED && readPaused) {
+            return; // resumeReading() arms a new one
+        } else if (completion.result != -ENOBUFS) {
+            close(); // end of stream or an error
+            return;
+        }
+        // Out of provided buffers, or the kernel ended the multishot
+        if (!recvArmed && !readPaused) {
+            loop.submitRecv(socket);
+            recvArmed = true;
+        }
+    }
+
+    void onSent(const Completion& completion) {
+        bool failed = false;
+        {
+            std::lock_guard<std::mutex> lock(outMutex);
+            sendInFlight = false;
+            if (completion.result >= 0) {
+                outQueue.completed(static_cast<size_t>(completion.result));
+            } else {
+                outQueue.unpin();
+                if (completion.result == -EAGAIN && !closed) {
+                    loop.submitPollOut(socket);
+                    pollArmed = true;
+                } else {
+                    failed = completion.result != -ECANCELED;
+                }
+            }
+        }
+        if (failed) {
+            close();
+            return;
+        }
+        flush();
+    }
+
+    // io_uring: hands the queue's leading frames to one SENDMSG. File
+    // segments still go out with sendfile() here on the loop thread, and a
+    // POLLOUT wait takes over when the socket is full. Called with outMutex held.
+    FlushResult startSend() {
+        if (sendInFlight || pollArmed || frozen) {
+            return FlushResult::Partial;
+        }
+        if (outQueue.empty()) {
+            return FlushResult::Drained;
+        }
+        if (!outQueue.frontIsFile()) {
+            sendMessage.msg_iov = sendBatch;
+            sendMessage.msg_iovlen = static_cast<size_t>(outQueue.gather(sendBatch));
+            loop.submitSend(socket, &sendMessage);
+            sendInFlight = true;
+            return FlushResult::Partial;
+        }
+        FlushResult result = outQueue.flush(socket);
+        if (result == FlushResult::Partial) {
+            loop.submitPollOut(socket);
+            pollArmed = true;
+        }
+        return result;
+    }
+
+    void flush() {
+        std::function<void()> callback;
+        FlushResult result;
+        {
+            std::lock_guard<std::mutex> lock(outMutex);
+            if (closed) {
+                return;
+            }
+            result = uring ? startSend() : outQueue.flush(socket);
+            if (!uring) {
+                watchOut(result == FlushResult::Partial);
+            }
+            writeArmed = result == FlushResult::Partial;
+            if (drainCallback && outQueue.belowLowWatermark()) {
+                callback = std::move(drainCallback);
+                drainCallback = nullptr;
+            }
+        }
+
+        if (result == FlushResult::Error) {
+            close();
+            return;
+        }
+        if (callback) {
+            callback();
+        }
+    }
+
+    void closeInLoop() {
+        if (state == ConnState::Closed) {
+            return;
+        }
+        state = ConnState::Closed;
+        {
+            std::lock_guard<std::mutex> lock(outMutex);
+            closed = true;
+            drainCallback = nullptr;
+        }
+
+        auto self = shared_from_this();
+        if (uring) {
+            handler.onClose(self);
+            loop.cancelAll(socket);
+            releaseIfIdle();
+            return;
+        }
+        loop.remove(socket);
+        handler.onClose(self);
+
+        // Closed under the send lock so no other thread writes to a reused descriptor
+        std::lock_guard<std::mutex> lock(outMutex);
+        closesocket(socket);
+    }
+
+    // io_uring: the descriptor stays open, and the handler registered, until
+    // the last operation on it has completed, so no completion can reach a
+    // new connection that reused the number
+    void releaseIfIdle() {
+        {
+            std::lock_guard<std::mutex> lock(outMutex);
+            if (released || recvArmed || sendInFlight || pollArmed) {
+                return;
+            }
+            released = true;
+        }
+        loop.remove(socket);
+        closesocket(socket);
+    }
+};
+
+// Accepts every pending connection on a non-blocking listening socket and
+// hands each new client socket to the server.
+class Acceptor : public EventHandler {
+public:
+    using AcceptCallback = std::function<void(SOCKET)>;
+
+    Acceptor(SOCKET listenSocket, EventLoop& loop, AcceptCallback onAccept)
+        : listenSocket(listenSocket), loop(loop), onAccept(std::move(onAccept)) {}
+
+    void onEvents(uint32_t) override {
+        while (true) {
+            SOCKET clientSocket = accept4(listenSocket, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (clientSocket == INVALID_SOCKET) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                if (!wouldBlock()) {
+                    logError("Accept failed with error: ", WSAGetLastError());
+                }
+                return;
+            }
+
+            accepted(clientSocket);
+        }
+    }
+
+    // io_uring: one multishot accept posts a completion per new client
+    void onRegistered() override {
+        loop.submitAccept(listenSocket);
+    }
+
+    void onCompletion(const Completion& completion) override {
+        if (completion.result >= 0) {
+            accepted(completion.result);
+        } else if (stopped) {
+            return;
+        } else if (completion.result != -EINTR && completion.result != -ECONNABORTED) {
+            logError("Accept failed with error: ", -completion.result);
+        }
+        if (!completion.more && !stopped) {
+            loop.submitAccept(listenSocket);
+        }
+    }
+
+    // Handoff, loop thread only: takes no more clients from the socket, which
+    // stays open for the process taking over. Clients already accepted by
+    // the kernel wait in its queue for that process.
+    void stop() {
+        stopped = true;
+        if (loop.getBackend() == IoBackend::Uring) {
+            loop.cancelAll(listenSocket);
+        } else {
+            loop.remove(listenSocket);
+        }
+    }
+
+    SOCKET getSocket() const {
+        return listenSocket;
+    }
+
+    EventLoop& getLoop() {
+        return loop;
+    }
+
+private:
+    SOCKET listenSocket;
+    EventLoop& loop;
+    AcceptCallback onAccept;
+    bool stopped = false;
+
+    void accepted(SOCKET clientSocket) {
+        int noDelay = 1;
+        setsockopt(clientSocket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        onAccept(clientSocket);
+    }
+};
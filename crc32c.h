@@ -0,0 +1,146 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(_M_X64) && defined(_MSC_VER)
+#include <intrin.h>
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define CRC32C_ARM 1
+#endif
+
+// CRC-32C (Castagnoli), the checksum carried by file chunks. Chained like
+// zlib's crc32: start from 0 and pass the previous result back in.
+//
+//   uint32_t crc = crc32c(0, first, n);
+//   crc = crc32c(crc, second, m);
+//
+// Uses the SSE4.2 / ARMv8 CRC32 instructions when the CPU has them and a
+// slicing-by-8 table otherwise.
+namespace crc32c_detail {
+
+constexpr uint32_t kPolynomial = 0x82F63B78; // reflected
+
+inline const std::array<std::array<uint32_t, 256>, 8>& tables() {
+    static const auto built = []() {
+        std::array<std::array<uint32_t, 256>, 8> table{};
+        for (uint32_t i = 0; i < 256; i++) {
+            uint32_t crc = i;
+            for (int bit = 0; bit < 8; bit++) {
+                crc = (crc >> 1) ^ (kPolynomial & (0u - (crc & 1)));
+            }
+            table[0][i] = crc;
+        }
+        for (uint32_t i = 0; i < 256; i++) {
+            for (int slice = 1; slice < 8; slice++) {
+                table[slice][i] = (table[slice - 1][i] >> 8) ^ table[0][table[slice - 1][i] & 0xFF];
+            }
+        }
+        return table;
+    }();
+    return built;
+}
+
+// Works on the inverted register; callers handle the pre/post inversion
+inline uint32_t software(uint32_t crc, const unsigned char* data, size_t length) {
+    const auto& table = tables();
+    while (length >= 8) {
+        uint32_t low;
+        uint32_t high;
+        std::memcpy(&low, data, 4);
+        std::memcpy(&high, data + 4, 4);
+        low ^= crc; // little-endian hosts; the only ones the server runs on
+        crc = table[7][low & 0xFF] ^ table[6][(low >> 8) & 0xFF] ^ table[5][(low >> 16) & 0xFF] ^ table[4][low >> 24] ^
+              table[3][high & 0xFF] ^ table[2][(high >> 8) & 0xFF] ^ table[1][(high >> 16) & 0xFF] ^ table[0][high >> 24];
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = (crc >> 8) ^ table[0][(crc ^ *data++) & 0xFF];
+    }
+    return crc;
+}
+
+#if defined(CRC32C_X86)
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("sse4.2")))
+#endif
+inline uint32_t hardware(uint32_t crc, const unsigned char* data, size_t length) {
+    uint64_t wide = crc;
+    while (length >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        wide = _mm_crc32_u64(wide, word);
+        data += 8;
+        length -= 8;
+    }
+    crc = static_cast<uint32_t>(wide);
+    while (length-- > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    return crc;
+}
+
+inline bool hardwareAvailable() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#elif defined(CRC32C_ARM)
+inline uint32_t hardware(uint32_t crc, const unsigned char* data, size_t length) {
+    while (length >= 8) {
+        uint64_t word;
+        std::memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length-- > 0) {
+        crc = __crc32cb(crc, *data++);
+    }
+    return crc;
+}
+
+inline bool hardwareAvailable() {
+    return true;
+}
+#else
+inline uint32_t hardware(uint32_t crc, const unsigned char* data, size_t length) {
+    return software(crc, data, length);
+}
+
+inline bool hardwareAvailable() {
+    return false;
+}
+#endif
+
+} // namespace crc32c_detail
+
+inline bool crc32cHardware() {
+    static const bool available = crc32c_detail::hardwareAvailable();
+    return available;
+}
+
+inline uint32_t crc32c(uint32_t crc, const void* data, size_t length) {
+    const auto* bytes = static_cast<const unsigned char*>(data);
+    crc = ~crc;
+    crc = crc32cHardware() ? crc32c_detail::hardware(crc, bytes, length) : crc32c_detail::software(crc, bytes, length);
+    return ~crc;
+}
+
+// The table version regardless of the CPU, for comparison in bench
+inline uint32_t crc32cSoftware(uint32_t crc, const void* data, size_t length) {
+    return ~crc32c_detail::software(~crc, static_cast<const unsigned char*>(data), length);
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Bounded multi-producer, single-consumer ring (Vyukov's sequence-numbered
+// cells). Producers claim a slot with one CAS; the consumer never contends.
+template <typename T>
+class MpscQueue {
+public:
+    explicit MpscQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        cells.reset(new Cell[size]);
+        mask = size - 1;
+        for (size_t i = 0; i < size; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    bool tryPush(T&& value) {
+        size_t position = enqueuePos.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[position & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+            if (difference == 0) {
+                if (enqueuePos.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (difference < 0) {
+                return false; // full
+            } else {
+                position = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(position + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer thread only
+    bool tryPop(T& out) {
+        Cell& cell = cells[dequeuePos & mask];
+        size_t sequence = cell.sequence.load(std::memory_order_acquire);
+        if (static_cast<intptr_t>(sequence) - static_cast<intptr_t>(dequeuePos + 1) < 0) {
+            return false;
+        }
+        out = std::move(cell.value);
+        cell.value = T();
+        cell.sequence.store(dequeuePos + mask + 1, std::memory_order_release);
+        dequeuePos++;
+        return true;
+    }
+
+    size_t sizeApprox() const {
+        size_t enqueued = enqueuePos.load(std::memory_order_relaxed);
+        size_t dequeued = dequeueCount.load(std::memory_order_relaxed);
+        return enqueued > dequeued ? enqueued - dequeued : 0;
+    }
+
+    void publishDequeued() {
+        dequeueCount.store(dequeuePos, std::memory_order_relaxed);
+    }
+
+private:
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePos{0};
+    alignas(64) size_t dequeuePos = 0;
+    std::atomic<size_t> dequeueCount{0};
+};
+
+struct DispatcherWorkerStats {
+    size_t queueDepth;
+    uint64_t processed;
+    uint64_t batches;
+    uint64_t fullWaits;
+};
+
+// Fans work out over N worker threads. Every item carries a key (the room)
+// and a key always maps to the same worker, so items for one room stay in
+// order while different rooms are processed in parallel. Each worker drains
+// its queue in batches and only sleeps when it finds the queue empty.
+template <typename T>
+class Dispatcher {
+public:
+    using Handler = std::function<void(T&)>;
+    static constexpr size_t kMaxBatch = 256;
+
+    Dispatcher(size_t workerCount, size_t queueCapacity, Handler handler) : handler(std::move(handler)) {
+        for (size_t i = 0; i < std::max<size_t>(1, workerCount); i++) {
+            workers.push_back(std::make_unique<Worker>(queueCapacity));
+        }
+        for (auto& worker : workers) {
+            Worker* self = worker.get();
+            worker->thread = std::thread([this, self]() {
+                run(*self);
+            });
+        }
+    }
+
+    ~Dispatcher() {
+        for (auto& worker : workers) {
+            {
+                std::lock_guard<std::mutex> lock(worker->sleepMutex);
+                worker->stopping = true;
+                worker->sleeping = false;
+            }
+            worker->wakeCondition.notify_one();
+        }
+        for (auto& worker : workers) {
+            worker->thread.join();
+        }
+    }
+
+    void submit(size_t key, T item) {
+        Worker& worker = *workers[key % workers.size()];
+        while (!worker.queue.tryPush(std::move(item))) {
+            // Full: make sure the worker is draining and give it a moment
+            worker.fullWaits.fetch_add(1, std::memory_order_relaxed);
+            wake(worker);
+            std::this_thread::yield();
+        }
+        wake(worker);
+    }
+
+    size_t workerCount() const {
+        return workers.size();
+    }
+
+    std::vector<DispatcherWorkerStats> stats() const {
+        std::vector<DispatcherWorkerStats> result;
+        for (const auto& worker : workers) {
+            result.push_back({worker->queue.sizeApprox(), worker->processed.load(std::memory_order_relaxed),
+                              worker->batches.load(std::memory_order_relaxed), worker->fullWaits.load(std::memory_order_relaxed)});
+        }
+        return result;
+    }
+
+private:
+    struct Worker {
+        MpscQueue<T> queue;
+        std::thread thread;
+        std::atomic<bool> sleeping{false};
+        bool stopping = false;
+        std::mutex sleepMutex;
+        std::condition_variable wakeCondition;
+        std::atomic<uint64_t> processed{0};
+        std::atomic<uint64_t> batches{0};
+        std::atomic<uint64_t> fullWaits{0};
+
+        explicit Worker(size_t capacity) : queue(capacity) {}
+    };
+
+    Handler handler;
+    std::vector<std::unique_ptr<Worker>> workers;
+
+    static void wake(Worker& worker) {
+        // Pairs with the fence in run(): either we see the worker asleep or it sees our item
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (worker.sleeping.load() && worker.sleeping.exchange(false)) {
+            std::lock_guard<std::mutex> lock(worker.sleepMutex);
+            worker.wakeCondition.notify_one();
+        }
+    }
+
+    void run(Worker& worker) {
+        std::vector<T> batch;
+        batch.reserve(kMaxBatch);
+        while (true) {
+            T item;
+            while (batch.size() < kMaxBatch && worker.queue.tryPop(item)) {
+                batch.push_back(std::move(item));
+            }
+            worker.queue.publishDequeued();
+
+            if (!batch.empty()) {
+                for (auto& queued : batch) {
+                    handler(queued);
+                }
+                worker.processed.fetch_add(batch.size(), std::memory_order_relaxed);
+                worker.batches.fetch_add(1, std::memory_order_relaxed);
+                batch.clear();
+                continue;
+            }
+
+            // Announce the nap, then look once more so a racing submit is not missed
+            worker.sleeping.store(true);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (worker.queue.tryPop(item)) {
+                worker.sleeping.store(false);
+                batch.push_back(std::move(item));
+                continue;
+            }
+
+            std::unique_lock<std::mutex> lock(worker.sleepMutex);
+            worker.wakeCondition.wait(lock, [&worker]() {
+                return !worker.sleeping.load() || worker.stopping;
+            });
+            if (worker.stopping) {
+                return;
+            }
+        }
+    }
+};
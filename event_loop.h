@@ -0,0 +1,553 @@
+#pragma once
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include "buffer_pool.h"
+#include "dispatcher.h"
+#include "logger.h"
+#include "uring.h"
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+enum class IoBackend {
+    Epoll, // readiness: epoll_wait, then recv() and sendmsg() per socket
+    Uring  // completions: multishot accept and recv, sends batched into one io_uring_enter
+};
+
+// What a completion on an io_uring loop belongs to
+enum class IoOp : uint8_t {
+    None, // nobody waits for it, e.g. a cancellation
+    Wake,
+    Timer,
+    Accept,
+    Recv,
+    Send,
+    PollOut
+};
+
+struct Completion {
+    IoOp op;
+    int result;       // bytes, a new descriptor, or -errno
+    bool more;        // a multishot operation is still armed
+    const char* data; // the received bytes, for Recv
+};
+
+// Anything registered with an EventLoop: a listening socket or a client connection
+class EventHandler {
+public:
+    virtual ~EventHandler() = default;
+    virtual void onEvents(uint32_t events) = 0;
+
+    // io_uring loops only: arm the first operations, then handle their results
+    virtual void onRegistered() {}
+    virtual void onCompletion(const Completion&) {}
+
+    // A frame another thread passed through the loop's mailbox
+    virtual void onDelivery(const FrameRef&, bool /*droppable*/) {}
+};
+
+// One epoll instance or io_uring driven by one thread. Handlers are owned by
+// the loop and only touched from its thread; other threads hand work over
+// with post(), or with deliver() for broadcast frames.
+//
+// deliver() is the hot cross-thread path: a lock-free push onto the loop's
+// mailbox, with one eventfd wake for however many frames arrive before the
+// loop gets to them. The loop queues each frame on its handler and writes
+// them all at the end of its pass. When the mailbox is full, frames wait
+// in an overflow list behind it instead, so they still arrive in order.
+//
+// With io_uring the loop submits operations instead of waiting for
+// readiness. Writes are not issued from other threads: scheduleWrite() puts
+// the handler on a list, and on its next pass the loop calls onEvents(EPOLLOUT)
+// for every handler on it. Their sends go to the kernel together with the
+// next io_uring_enter, so a broadcast to thousands of sockets on this loop
+// costs one system call.
+class EventLoop {
+public:
+    using Task = std::function<void()>;
+
+    static constexpr unsigned kRingEntries = 4096;
+    static constexpr unsigned kRecvBuffers = 256; // provided to multishot receives, a power of two
+    static constexpr unsigned kRecvBufferSize = 16 * 1024;
+    static constexpr size_t kMailboxCapacity = 64 * 1024;
+
+    explicit EventLoop(int index, IoBackend backend = IoBackend::Epoll) : index(index) {
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (backend == IoBackend::Uring) {
+            ring = std::make_unique<IoUring>(kRingEntries, kRecvBuffers, kRecvBufferSize);
+            if (!ring->valid()) {
+                logWarning("Event loop ", index, " could not set up io_uring, using epoll");
+                ring.reset();
+            }
+        }
+        if (!ring) {
+            epollFd = epoll_create1(EPOLL_CLOEXEC);
+        }
+        if ((!ring && epollFd == -1) || wakeFd == -1 || timerFd == -1) {
+            logError("Failed to create event loop ", index);
+            Logger::global().flush();
+            exit(EXIT_FAILURE);
+        }
+
+        if (ring) {
+            armWake();
+            armTimer();
+            return;
+        }
+        for (int fd : {wakeFd, timerFd}) {
+            epoll_event event{};
+            event.events = EPOLLIN;
+            event.data.fd = fd;
+            epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event);
+        }
+    }
+
+    ~EventLoop() {
+        ::close(wakeFd);
+        ::close(timerFd);
+        if (epollFd != -1) {
+            ::close(epollFd);
+        }
+    }
+
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    IoBackend getBackend() const {
+        return ring ? IoBackend::Uring : IoBackend::Epoll;
+    }
+
+    void run() {
+        loopThread = std::this_thread::get_id();
+        if (ring) {
+            runUring();
+            return;
+        }
+        std::vector<epoll_event> events(256);
+
+        while (running) {
+            int count = epoll_wait(epollFd, events.data(), static_cast<int>(events.size()), writesScheduled() ? 0 : -1);
+            if (count == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                logError("epoll_wait failed in loop ", index, ": ", errno);
+                break;
+            }
+
+            for (int i = 0; i < count; i++) {
+                int fd = events[i].data.fd;
+                if (fd == wakeFd) {
+                    runPendingTasks();
+                    continue;
+                }
+                if (fd == timerFd) {
+                    runDueTimers();
+                    continue;
+                }
+
+                // Hold a reference so the handler survives removing itself
+                auto it = handlers.find(fd);
+                if (it == handlers.end()) {
+                    continue;
+                }
+                std::shared_ptr<EventHandler> handler = it->second;
+                handler->onEvents(events[i].events);
+            }
+            runScheduledWrites();
+        }
+    }
+
+    void stop() {
+        running = false;
+        wake();
+    }
+
+    // Safe to call from any thread; the task runs on the loop thread
+    void post(Task task) {
+        {
+            std::lock_guard<std::mutex> lock(taskMutex);
+            tasks.push_back(std::move(task));
+        }
+        wake();
+    }
+
+    void runInLoop(Task task) {
+        if (isInLoopThread()) {
+            task();
+        } else {
+            post(std::move(task));
+        }
+    }
+
+    // Loop thread only. Runs the task on the loop thread once the delay has
+    // passed; every timer of the loop shares one timerfd, set to the earliest.
+    void runAfter(uint64_t delayNanos, Task task) {
+        uint64_t due = now() + delayNanos;
+        timers.push_back({due, std::move(task)});
+        std::push_heap(timers.begin(), timers.end(), laterFirst);
+        if (timers.front().due == due) {
+            setTimer(due);
+        }
+    }
+
+    bool add(int fd, uint32_t events, std::shared_ptr<EventHandler> handler) {
+        if (ring) {
+            handlers[fd] = handler;
+            handler->onRegistered();
+            return true;
+        }
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            logError("Failed to watch socket ", fd, ": ", errno);
+            return false;
+        }
+        handlers[fd] = std::move(handler);
+        return true;
+    }
+
+    // epoll_ctl is thread-safe, so interest changes may come from any thread
+    bool modify(int fd, uint32_t events) {
+        if (ring) {
+            return true;
+        }
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+        return epoll_ctl(epollFd, EPOLL_CTL_MOD, fd, &event) == 0;
+    }
+
+    // With io_uring, only once nothing is in flight on the descriptor
+    void remove(int fd) {
+        if (!ring) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+        handlers.erase(fd);
+    }
+
+    // Safe to call from any thread; the handler gets onEvents(EPOLLOUT) on
+    // the loop thread at the end of the current pass, before the loop waits
+    // or submits again. Lets a handler that queued data on the loop thread
+    // write once for everything instead of changing its epoll interest.
+    void scheduleWrite(std::shared_ptr<EventHandler> handler) {
+        bool first;
+        {
+            std::lock_guard<std::mutex> lock(taskMutex);
+            first = writers.empty();
+            writers.push_back(std::move(handler));
+        }
+        if (first && !isInLoopThread()) {
+            wake();
+        }
+    }
+
+    // Any thread. Once the mailbox has filled up, frames go to the overflow
+    // list, and keep going there until the loop has emptied both; a frame
+    // never overtakes one its producer handed over earlier.
+    void deliver(const std::shared_ptr<EventHandler>& target, const FrameRef& frame, bool droppable) {
+        Delivery delivery{target, frame, droppable};
+        if (overflowing.load(std::memory_order_acquire) || !mailbox.tryPush(std::move(delivery))) {
+            std::lock_guard<std::mutex> lock(overflowMutex);
+            overflow.push_back(std::move(delivery));
+            overflowDepth.store(overflow.size(), std::memory_order_relaxed);
+            overflowing.store(true, std::memory_order_release);
+        }
+        if (!mailboxWake.exchange(true)) {
+            wake();
+        }
+    }
+
+    size_t mailboxDepth() const {
+        return mailbox.sizeApprox() + overflowDepth.load(std::memory_order_relaxed);
+    }
+
+    // Operations for io_uring handlers, loop thread only. They are queued
+    // and reach the kernel with the loop's next io_uring_enter.
+    void submitAccept(int fd) {
+        io_uring_sqe* sqe = prepare(IORING_OP_ACCEPT, fd, IoOp::Accept);
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    }
+
+    // Multishot: one completion per arrival, each in a provided buffer
+    void submitRecv(int fd) {
+        io_uring_sqe* sqe = prepare(IORING_OP_RECV, fd, IoOp::Recv);
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = IoUring::kBufferGroup;
+    }
+
+    // The message and the buffers it points to must stay put until completion
+    void submitSend(int fd, const msghdr* message) {
+        io_uring_sqe* sqe = prepare(IORING_OP_SENDMSG, fd, IoOp::Send);
+        sqe->addr = reinterpret_cast<uint64_t>(message);
+        sqe->len = 1;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+
+    void submitPollOut(int fd) {
+        io_uring_sqe* sqe = prepare(IORING_OP_POLL_ADD, fd, IoOp::PollOut);
+        sqe->poll32_events = POLLOUT;
+    }
+
+    // Ends the multishot receive on fd; its last completion comes with -ECANCELED
+    void cancelRecv(int fd) {
+        io_uring_sqe* sqe = prepare(IORING_OP_ASYNC_CANCEL, fd, IoOp::None);
+        sqe->addr = (static_cast<uint64_t>(fd) << 8) | static_cast<uint8_t>(IoOp::Recv);
+    }
+
+    // Every operation on fd completes soon after, with -ECANCELED if it had not run
+    void cancelAll(int fd) {
+        io_uring_sqe* sqe = prepare(IORING_OP_ASYNC_CANCEL, fd, IoOp::None);
+        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    }
+
+    bool isInLoopThread() const {
+        return loopThread == std::this_thread::get_id();
+    }
+
+    int getIndex() const {
+        return index;
+    }
+
+    size_t handlerCount() const {
+        return handlers.size();
+    }
+
+    // Loop thread only; fn may remove the handler it is given
+    template <typename Callback>
+    void forEachHandler(Callback&& fn) {
+        std::vector<std::shared_ptr<EventHandler>> snapshot;
+        snapshot.reserve(handlers.size());
+        for (const auto& entry : handlers) {
+            snapshot.push_back(entry.second);
+        }
+        for (auto& handler : snapshot) {
+            fn(handler);
+        }
+    }
+
+private:
+    int index;
+    int epollFd = -1;
+    int wakeFd;
+    int timerFd;
+    std::unique_ptr<IoUring> ring;
+    std::atomic<bool> running{true};
+    std::thread::id loopThread;
+    std::unordered_map<int, std::shared_ptr<EventHandler>> handlers;
+    std::mutex taskMutex;
+    std::vector<Task> tasks;
+    std::vector<std::shared_ptr<EventHandler>> writers; // waiting for onEvents(EPOLLOUT)
+    std::vector<std::shared_ptr<EventHandler>> writing;
+
+    struct Delivery {
+        std::shared_ptr<EventHandler> target;
+        FrameRef frame;
+        bool droppable = false;
+    };
+    struct Timer {
+        uint64_t due; // CLOCK_MONOTONIC ns
+        Task task;
+    };
+    std::vector<Timer> timers; // a heap, earliest first
+
+    MpscQueue<Delivery> mailbox{kMailboxCapacity};
+    std::atomic<bool> mailboxWake{false}; // a wake is on its way for what is in the mailbox
+    std::mutex overflowMutex;
+    std::deque<Delivery> overflow; // deliveries that found the mailbox full, and all after them
+    std::atomic<bool> overflowing{false};
+    std::atomic<size_t> overflowDepth{0};
+
+    // user_data carries the descriptor and the operation; handlers keep
+    // their descriptor open until every operation on it has completed
+    io_uring_sqe* prepare(uint8_t opcode, int fd, IoOp op) {
+        io_uring_sqe* sqe = ring->sqe();
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = (static_cast<uint64_t>(fd) << 8) | static_cast<uint8_t>(op);
+        return sqe;
+    }
+
+    void armWake() {
+        io_uring_sqe* sqe = prepare(IORING_OP_POLL_ADD, wakeFd, IoOp::Wake);
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+
+    void armTimer() {
+        io_uring_sqe* sqe = prepare(IORING_OP_POLL_ADD, timerFd, IoOp::Timer);
+        sqe->poll32_events = POLLIN;
+        sqe->len = IORING_POLL_ADD_MULTI;
+    }
+
+    static bool laterFirst(const Timer& a, const Timer& b) {
+        return a.due > b.due;
+    }
+
+    static uint64_t now() {
+        timespec time{};
+        clock_gettime(CLOCK_MONOTONIC, &time);
+        return static_cast<uint64_t>(time.tv_sec) * 1'000'000'000ull + static_cast<uint64_t>(time.tv_nsec);
+    }
+
+    void setTimer(uint64_t due) {
+        itimerspec spec{};
+        spec.it_value.tv_sec = static_cast<time_t>(due / 1'000'000'000ull);
+        spec.it_value.tv_nsec = static_cast<long>(due % 1'000'000'000ull);
+        timerfd_settime(timerFd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    }
+
+    // Due tasks are taken off the heap before any runs, so they may add timers of their own
+    void runDueTimers() {
+        uint64_t expirations;
+        while (::read(timerFd, &expirations, sizeof(expirations)) > 0) {
+        }
+        uint64_t current = now();
+        std::vector<Task> due;
+        while (!timers.empty() && timers.front().due <= current) {
+            std::pop_heap(timers.begin(), timers.end(), laterFirst);
+            due.push_back(std::move(timers.back().task));
+            timers.pop_back();
+        }
+        if (!timers.empty()) {
+            setTimer(timers.front().due);
+        }
+        for (auto& task : due) {
+            task();
+        }
+    }
+
+    // Writes scheduled on the loop thread do not wake it
+    bool writesScheduled() {
+        std::lock_guard<std::mutex> lock(taskMutex);
+        return !writers.empty();
+    }
+
+    void runScheduledWrites() {
+        {
+            std::lock_guard<std::mutex> lock(taskMutex);
+            writing.swap(writers);
+        }
+        for (auto& handler : writing) {
+            handler->onEvents(EPOLLOUT);
+        }
+        writing.clear();
+    }
+
+    void runUring() {
+        while (running) {
+            runScheduledWrites();
+
+            // Submits every send queued above and in the last pass, then sleeps
+            // unless a handler scheduled another write while those ran
+            int result = ring->enter(writesScheduled() ? 0 : 1);
+            if (result < 0 && result != -EBUSY && result != -EAGAIN) {
+                logError("io_uring_enter failed in loop ", index, ": ", -result);
+                break;
+            }
+            ring->forEachCompletion([this](const io_uring_cqe& cqe) {
+                dispatch(cqe);
+            });
+        }
+    }
+
+    void dispatch(const io_uring_cqe& cqe) {
+        IoOp op = static_cast<IoOp>(cqe.user_data & 0xff);
+        int fd = static_cast<int>(cqe.user_data >> 8);
+        bool buffered = (cqe.flags & IORING_CQE_F_BUFFER) != 0;
+        Completion completion{op, cqe.res, (cqe.flags & IORING_CQE_F_MORE) != 0, buffered ? ring->buffer(cqe.flags) : nullptr};
+
+        if (op == IoOp::Wake) {
+            runPendingTasks();
+            if (!completion.more) {
+                armWake();
+            }
+        } else if (op == IoOp::Timer) {
+            runDueTimers();
+            if (!completion.more) {
+                armTimer();
+            }
+        } else if (op != IoOp::None) {
+            // Hold a reference so the handler survives removing itself
+            auto it = handlers.find(fd);
+            if (it != handlers.end()) {
+                std::shared_ptr<EventHandler> handler = it->second;
+                handler->onCompletion(completion);
+            }
+        }
+        if (buffered) {
+            ring->recycle(cqe.flags);
+        }
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        ssize_t written = ::write(wakeFd, &one, sizeof(one));
+        (void) written;
+    }
+
+    void runPendingTasks() {
+        uint64_t value;
+        while (::read(wakeFd, &value, sizeof(value)) > 0) {
+        }
+
+        // Bounded so producers that never stop cannot keep the loop here
+        mailboxWake.exchange(false);
+        Delivery delivery;
+        size_t delivered = 0;
+        for (; delivered < kMailboxCapacity && mailbox.tryPop(delivery); delivered++) {
+            delivery.target->onDelivery(delivery.frame, delivery.droppable);
+        }
+        mailbox.publishDequeued();
+        delivery = Delivery();
+
+        // The overflow is newer than anything in the mailbox, including pushes
+        // still being written, so it waits until the mailbox is empty
+        bool behind = false;
+        if (overflowing.load(std::memory_order_acquire)) {
+            if (mailbox.sizeApprox() == 0) {
+                std::deque<Delivery> overflowed;
+                {
+                    std::lock_guard<std::mutex> lock(overflowMutex);
+                    overflowed.swap(overflow);
+                    overflowDepth.store(0, std::memory_order_relaxed);
+                    overflowing.store(false, std::memory_order_release);
+                }
+                for (Delivery& parked : overflowed) {
+                    parked.target->onDelivery(parked.frame, parked.droppable);
+                }
+            } else {
+                behind = true;
+            }
+        }
+        if ((delivered == kMailboxCapacity || behind) && !mailboxWake.exchange(true)) {
+            wake();
+        }
+
+        std::vector<Task> pending;
+        {
+            std::lock_guard<std::mutex> lock(taskMutex);
+            pending.swap(tasks);
+        }
+        for (auto& task : pending) {
+            task();
+        }
+    }
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include "room_registry.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Splits a broadcast to a large room into chunks of members and spreads them
+// over a pool of helper threads. The caller (the room's dispatch worker)
+// takes chunks too and returns only once every chunk is done, so a room's
+// messages still reach each member in order and the member list snapshot
+// stays in the caller's read section throughout. Rooms that fit in one
+// chunk, and every room when the pool has no threads, run on the caller alone.
+// Because the caller can always finish a job by itself, a busy pool only
+// slows a broadcast down; it never stalls it.
+class FanoutPool {
+public:
+    using Members = MemberList::const_iterator;
+
+    FanoutPool(size_t threadCount, size_t chunkSize) : chunkSize(std::max<size_t>(1, chunkSize)) {
+        for (size_t i = 0; i < threadCount; i++) {
+            threads.emplace_back([this]() {
+                run();
+            });
+        }
+    }
+
+    ~FanoutPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeCondition.notify_all();
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    FanoutPool(const FanoutPool&) = delete;
+    FanoutPool& operator=(const FanoutPool&) = delete;
+
+    size_t threadCount() const {
+        return threads.size();
+    }
+
+    size_t getChunkSize() const {
+        return chunkSize;
+    }
+
+    // Runs fn(first, last) over consecutive ranges of at most chunkSize
+    // members, possibly on several threads at once. Returns the number of
+    // chunks the list was split into.
+    template <typename Callback>
+    size_t forEachChunk(const MemberList& members, Callback&& fn) {
+        size_t chunks = (members.size() + chunkSize - 1) / chunkSize;
+        if (chunks <= 1 || threads.empty()) {
+            fn(members.begin(), members.end());
+            return std::max<size_t>(1, chunks);
+        }
+
+        auto job = std::make_shared<Job>();
+        job->chunks = chunks;
+        job->run = [&](size_t chunk) {
+            size_t first = chunk * chunkSize;
+            size_t last = std::min(first + chunkSize, members.size());
+            fn(members.begin() + static_cast<std::ptrdiff_t>(first), members.begin() + static_cast<std::ptrdiff_t>(last));
+        };
+        size_t helpers = std::min(threads.size(), chunks - 1);
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (size_t i = 0; i < helpers; i++) {
+                jobs.push_back(job);
+            }
+        }
+        if (helpers == 1) {
+            wakeCondition.notify_one();
+        } else {
+            wakeCondition.notify_all();
+        }
+
+        job->work();
+        std::unique_lock<std::mutex> lock(job->mutex);
+        job->finished.wait(lock, [&job]() {
+            return job->done.load() == job->chunks;
+        });
+        return chunks;
+    }
+
+private:
+    // One broadcast. Every thread that picks it up claims chunks until none
+    // are left; whoever completes the last one wakes the caller. A helper
+    // that gets to it after that finds nothing to claim and never touches
+    // `run`, whose captures live on the caller's stack.
+    struct Job {
+        std::function<void(size_t)> run;
+        size_t chunks = 0;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+        std::mutex mutex;
+        std::condition_variable finished;
+
+        void work() {
+            for (size_t chunk = next.fetch_add(1); chunk < chunks; chunk = next.fetch_add(1)) {
+                run(chunk);
+                if (done.fetch_add(1) + 1 == chunks) {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    finished.notify_one();
+                }
+            }
+        }
+    };
+
+    size_t chunkSize;
+    std::vector<std::thread> threads;
+    std::mutex mutex;
+    std::condition_variable wakeCondition;
+    std::deque<std::shared_ptr<Job>> jobs; // one entry per helper wanted
+    bool stopping = false;
+
+    void run() {
+        while (true) {
+            std::shared_ptr<Job> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wakeCondition.wait(lock, [this]() {
+                    return stopping || !jobs.empty();
+                });
+                if (stopping) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job->work();
+        }
+    }
+};
@@ -0,0 +1,585 @@
+#pragma once
+
+#include "net.h"
+#include "logger.h"
+#include "protocol.h"
+#include "room_registry.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Frames on the links between server nodes. Same 8-byte header as the
+// client protocol, with its own types:
+//
+//   Hello    u32 node ID                         first frame from the dialing node
+//   Welcome  u32 node ID                         the answer, so the dialer knows whom it reached
+//   Join     u64 session ID, u16 room length, room ID, name
+//   Leave    u64 session ID, u16 room length, room ID
+//   Chat     u16 room length, room ID, "name: text"
+//   Ping     (empty)                             after a second with nothing else to send
+enum class PeerMessage : uint8_t {
+    Hello = 1,
+    Welcome = 2,
+    Join = 3,
+    Leave = 4,
+    Chat = 5,
+    Ping = 6
+};
+
+struct FederationOptions {
+    uint32_t nodeId = 0;                  // 0 picks one at random
+    int peerPort = 0;                     // where other nodes link in, 0 to not accept links
+    std::vector<std::string> peers;       // "ip:port" of every other node's peer port
+    size_t maxPending = 64 * 1024 * 1024; // bytes queued for one peer before its link is reset
+    SOCKET listener = INVALID_SOCKET;     // the peer port's socket, when taken over from a previous process
+};
+
+// Called on link threads with what other nodes report
+class PeerHandler {
+public:
+    virtual ~PeerHandler() = default;
+    virtual void onPeerJoin(const std::string& roomID, const std::string& name) = 0;
+    virtual void onPeerLeave(const std::string& roomID, const std::string& name) = 0;
+    virtual void onPeerChat(const std::string& roomID, std::string_view payload) = 0;
+};
+
+// Lets several server processes share rooms without a broker. Each node
+// dials every peer in --peers and sends it this node's joins, leaves and
+// chat; the peers' own traffic comes in on the links they dial to this
+// node's --peer-port. So every pair of nodes has one TCP connection per
+// direction, each written by one thread and read by another.
+//
+// A new outgoing link starts with a Join for every local member, then
+// carries live events in the order they happened. The receiving node keeps
+// a view of who is in which room on every other node. Chat only goes to
+// nodes that have someone in its room, once per node however many members
+// it has there; that node fans it out to its own clients. Everything queued
+// for a peer between two writes leaves in a single send().
+//
+// A link that drops or goes quiet for kPeerTimeout, or a node that says
+// Hello again, takes that node's members out of the view, and local members
+// see them leave. The dialer reconnects and resends its members.
+class Federation {
+public:
+    static constexpr auto kPeerTimeout = std::chrono::seconds(5);
+    static constexpr auto kPingInterval = std::chrono::seconds(1);
+    static constexpr auto kRedialDelay = std::chrono::seconds(1);
+
+    Federation(const FederationOptions& options, PeerHandler& handler)
+        : nodeId(options.nodeId), maxPending(options.maxPending), handler(handler) {
+        while (nodeId == 0) {
+            nodeId = std::random_device{}();
+        }
+
+        for (const std::string& peer : options.peers) {
+            size_t colon = peer.rfind(':');
+            auto link = std::make_unique<Link>();
+            link->address.sin_family = AF_INET;
+            if (colon == std::string::npos || inet_pton(AF_INET, peer.substr(0, colon).c_str(), &link->address.sin_addr) != 1) {
+                logWarning("Ignoring peer ", peer, ": expected ip:port");
+                continue;
+            }
+            link->address.sin_port = htons(static_cast<uint16_t>(std::stoi(peer.substr(colon + 1))));
+            link->name = peer;
+            links.push_back(std::move(link));
+        }
+        for (auto& link : links) {
+            std::thread([this, link = link.get()]() {
+                runLink(*link);
+            }).detach();
+        }
+
+        if (options.peerPort > 0) {
+            listener = options.listener != INVALID_SOCKET ? options.listener : openListener(options.peerPort);
+            if (listener == INVALID_SOCKET) {
+                logWarning("Peer port ", options.peerPort, " is unavailable; other nodes cannot link to this one");
+            } else {
+                std::thread([this]() {
+                    acceptLinks();
+                }).detach();
+            }
+        }
+    }
+
+    Federation(const Federation&) = delete;
+    Federation& operator=(const Federation&) = delete;
+
+    uint32_t getNodeId() const {
+        return nodeId;
+    }
+
+    SOCKET getListener() const {
+        return listener;
+    }
+
+    void publishJoin(const std::string& roomID, SessionId session, const std::string& name) {
+        std::lock_guard<std::mutex> lock(localMutex);
+        localMembers[session] = {roomID, name};
+        std::string message;
+        appendJoin(message, session, roomID, name);
+        for (auto& link : links) {
+            queue(*link, message);
+        }
+    }
+
+    void publishLeave(const std::string& roomID, SessionId session) {
+        std::lock_guard<std::mutex> lock(localMutex);
+        localMembers.erase(session);
+        std::string message;
+        appendHeader(message, PeerMessage::Leave, 8 + 2 + roomID.size());
+        putU64(message, session);
+        appendRoom(message, roomID);
+        for (auto& link : links) {
+            queue(*link, message);
+        }
+    }
+
+    // Called by dispatcher workers for every local chat message. The
+    // message is encoded once into a per-thread buffer and copied onto the
+    // queue of each node with members in the room.
+    void publishChat(const std::string& roomID, std::string_view payload) {
+        thread_local std::string message;
+        message.clear();
+        appendHeader(message, PeerMessage::Chat, 2 + roomID.size() + payload.size());
+        appendRoom(message, roomID);
+        message.append(payload.data(), payload.size());
+        for (auto& link : links) {
+            uint32_t peer = link->peerNode.load(std::memory_order_acquire);
+            if (peer != 0 && hasMembers(peer, roomID)) {
+                queue(*link, message);
+            }
+        }
+    }
+
+    size_t linksUp() const {
+        size_t up = 0;
+        for (const auto& link : links) {
+            up += link->peerNode.load(std::memory_order_relaxed) != 0;
+        }
+        return up;
+    }
+
+    size_t remoteMembers() const {
+        std::shared_lock<std::shared_mutex> lock(viewMutex);
+        size_t total = 0;
+        for (const auto& node : nodes) {
+            total += node.second.members.size();
+        }
+        return total;
+    }
+
+private:
+    // Outgoing: this node's traffic for one peer
+    struct Link {
+        std::string name;
+        sockaddr_in address{};
+        std::atomic<uint32_t> peerNode{0}; // set while connected
+        std::mutex mutex;
+        std::condition_variable wake;
+        std::string pending;
+        bool connected = false;
+        bool overflowed = false;
+    };
+
+    struct Member {
+        std::string room;
+        std::string name;
+    };
+
+    // Incoming: what one peer has reported
+    struct NodeView {
+        uint64_t generation = 0; // the link currently speaking for the node
+        std::unordered_map<SessionId, Member> members;
+        std::unordered_map<std::string, size_t> rooms; // members per room
+    };
+
+    uint32_t nodeId;
+    size_t maxPending;
+    PeerHandler& handler;
+    std::vector<std::unique_ptr<Link>> links;
+    SOCKET listener = INVALID_SOCKET;
+
+    std::mutex localMutex; // also orders a new link's snapshot against live joins and leaves
+    std::unordered_map<SessionId, Member> localMembers;
+
+    mutable std::shared_mutex viewMutex;
+    std::unordered_map<uint32_t, NodeView> nodes;
+    uint64_t nextGeneration = 0;
+
+    static void appendHeader(std::string& out, PeerMessage type, size_t length) {
+        out.push_back(static_cast<char>(type));
+        out.append(3, '\0');
+        putU32(out, static_cast<uint32_t>(length));
+    }
+
+    static void appendRoom(std::string& out, const std::string& roomID) {
+        putU16(out, static_cast<uint16_t>(roomID.size()));
+        out += roomID;
+    }
+
+    static void appendJoin(std::string& out, SessionId session, const std::string& roomID, const std::string& name) {
+        appendHeader(out, PeerMessage::Join, 8 + 2 + roomID.size() + name.size());
+        putU64(out, session);
+        appendRoom(out, roomID);
+        out += name;
+    }
+
+    // Splits "u16 length, room ID, rest"; false if the length runs past the end
+    static bool splitRoom(std::string_view payload, std::string& roomID, std::string_view& rest) {
+        if (payload.size() < 2 || getU16(payload.data()) > payload.size() - 2) {
+            return false;
+        }
+        size_t length = getU16(payload.data());
+        roomID.assign(payload.data() + 2, length);
+        rest = payload.substr(2 + length);
+        return true;
+    }
+
+    void queue(Link& link, const std::string& message) {
+        std::lock_guard<std::mutex> lock(link.mutex);
+        if (!link.connected || link.overflowed) {
+            return;
+        }
+        if (link.pending.size() + message.size() > maxPending) {
+            // The peer is not keeping up; reconnecting resynchronises it
+            logWarning("Peer ", link.name, " fell ", link.pending.size(), " bytes behind, resetting the link");
+            link.overflowed = true;
+            link.wake.notify_one();
+            return;
+        }
+        bool first = link.pending.empty();
+        link.pending += message;
+        if (first) {
+            link.wake.notify_one();
+        }
+    }
+
+    bool hasMembers(uint32_t peer, const std::string& roomID) const {
+        std::shared_lock<std::shared_mutex> lock(viewMutex);
+        auto node = nodes.find(peer);
+        return node != nodes.end() && node->second.rooms.count(roomID) != 0;
+    }
+
+    static bool sendAll(SOCKET socket, const std::string& data) {
+        for (size_t sent = 0; sent < data.size();) {
+            ssize_t written = send(socket, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (written <= 0) {
+                return false;
+            }
+            sent += static_cast<size_t>(written);
+        }
+        return true;
+    }
+
+    static void setTimeouts(SOCKET socket) {
+        timeval timeout{static_cast<time_t>(kPeerTimeout.count()), 0};
+        setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        int noDelay = 1;
+        setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    }
+
+    static SOCKET openListener(int port) {
+        SOCKET socket = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (socket == INVALID_SOCKET) {
+            return INVALID_SOCKET;
+        }
+        int reuse = 1;
+        setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = INADDR_ANY;
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        if (bind(socket, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+            listen(socket, 16) == SOCKET_ERROR) {
+            closesocket(socket);
+            return INVALID_SOCKET;
+        }
+        return socket;
+    }
+
+    // Connects and says Hello; returns the socket once the peer has answered
+    SOCKET dial(Link& link, uint32_t& peer) {
+        SOCKET socket = ::socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (socket == INVALID_SOCKET) {
+            return INVALID_SOCKET;
+        }
+        setTimeouts(socket);
+        std::string hello;
+        appendHeader(hello, PeerMessage::Hello, 4);
+        putU32(hello, nodeId);
+        char welcome[kFrameHeaderSize + 4];
+        if (connect(socket, reinterpret_cast<const sockaddr*>(&link.address), sizeof(link.address)) == SOCKET_ERROR ||
+            !sendAll(socket, hello) || recv(socket, welcome, sizeof(welcome), MSG_WAITALL) != static_cast<ssize_t>(sizeof(welcome)) ||
+            welcome[0] != static_cast<char>(PeerMessage::Welcome)) {
+            closesocket(socket);
+            return INVALID_SOCKET;
+        }
+        peer = getU32(welcome + kFrameHeaderSize);
+        return socket;
+    }
+
+    void runLink(Link& link) {
+        bool wasUp = true; // log the first failure
+        while (true) {
+            uint32_t peer = 0;
+            SOCKET socket = dial(link, peer);
+            if (socket == INVALID_SOCKET) {
+                if (wasUp) {
+                    logWarning("Cannot reach peer ", link.name, ", retrying every ", kRedialDelay.count(), "s");
+                    wasUp = false;
+                }
+                std::this_thread::sleep_for(kRedialDelay);
+                continue;
+            }
+            wasUp = true;
+
+            // Everyone here right now, then whatever happens next, in order
+            {
+                std::lock_guard<std::mutex> localLock(localMutex);
+                std::lock_guard<std::mutex> lock(link.mutex);
+                link.pending.clear();
+                for (const auto& [session, member] : localMembers) {
+                    appendJoin(link.pending, session, member.room, member.name);
+                }
+                link.connected = true;
+                link.overflowed = false;
+            }
+            link.peerNode.store(peer, std::memory_order_release);
+            logInfo("Linked to node ", peer, " at ", link.name);
+
+            pump(link, socket);
+
+            link.peerNode.store(0, std::memory_order_release);
+            {
+                std::lock_guard<std::mutex> lock(link.mutex);
+                link.connected = false;
+                link.pending.clear();
+            }
+            closesocket(socket);
+            logWarning("Lost link to node ", peer, " at ", link.name);
+            std::this_thread::sleep_for(kRedialDelay);
+        }
+    }
+
+    // Writes everything queued since the last write in one go
+    void pump(Link& link, SOCKET socket) {
+        std::string out;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(link.mutex);
+                link.wake.wait_for(lock, kPingInterval, [&link]() {
+                    return !link.pending.empty() || link.overflowed;
+                });
+                if (link.overflowed) {
+                    return;
+                }
+                out.swap(link.pending);
+            }
+            if (out.empty()) {
+                appendHeader(out, PeerMessage::Ping, 0);
+            }
+            if (!sendAll(socket, out)) {
+                return;
+            }
+            out.clear();
+        }
+    }
+
+    void acceptLinks() {
+        while (true) {
+            SOCKET socket = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (socket == INVALID_SOCKET) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                logError("Peer port stopped accepting: ", errno);
+                return;
+            }
+            std::thread([this, socket]() {
+                serveLink(socket);
+                closesocket(socket);
+            }).detach();
+        }
+    }
+
+    void serveLink(SOCKET socket) {
+        setTimeouts(socket);
+        std::string input;
+        char buffer[64 * 1024];
+        uint32_t peer = 0;
+        uint64_t generation = 0;
+        while (true) {
+            ssize_t got = recv(socket, buffer, sizeof(buffer), 0);
+            if (got <= 0) {
+                break;
+            }
+            input.append(buffer, static_cast<size_t>(got));
+
+            size_t offset = 0;
+            bool good = true;
+            while (good && input.size() - offset >= kFrameHeaderSize) {
+                uint32_t length = getU32(input.data() + offset + 4);
+                if (length > kMaxFramePayload) {
+                    good = false;
+                    break;
+                }
+                if (input.size() - offset < kFrameHeaderSize + length) {
+                    break;
+                }
+                auto type = static_cast<PeerMessage>(input[offset]);
+                std::string_view payload(input.data() + offset + kFrameHeaderSize, length);
+                offset += kFrameHeaderSize + length;
+
+                if (peer == 0) {
+                    good = type == PeerMessage::Hello && payload.size() >= 4 && welcome(socket, getU32(payload.data()), peer, generation);
+                } else {
+                    good = apply(peer, generation, type, payload);
+                }
+            }
+            input.erase(0, offset);
+            if (!good) {
+                logWarning("Dropping link from node ", peer, ": bad frame");
+                break;
+            }
+        }
+        if (peer != 0) {
+            logWarning("Node ", peer, " disconnected");
+            forget(peer, generation);
+        }
+    }
+
+    bool welcome(SOCKET socket, uint32_t node, uint32_t& peer, uint64_t& generation) {
+        if (node == 0 || node == nodeId) {
+            logWarning("Refusing a link from node ", node, ": same ID as this node");
+            return false;
+        }
+        std::string answer;
+        appendHeader(answer, PeerMessage::Welcome, 4);
+        putU32(answer, nodeId);
+        if (!sendAll(socket, answer)) {
+            return false;
+        }
+
+        // A node saying Hello again has restarted or redialed; what it said before is stale
+        std::vector<Member> gone;
+        {
+            std::unique_lock<std::shared_mutex> lock(viewMutex);
+            NodeView& view = nodes[node];
+            for (auto& entry : view.members) {
+                gone.push_back(std::move(entry.second));
+            }
+            view.members.clear();
+            view.rooms.clear();
+            view.generation = generation = ++nextGeneration;
+        }
+        for (const Member& member : gone) {
+            handler.onPeerLeave(member.room, member.name);
+        }
+        peer = node;
+        logInfo("Node ", node, " linked in");
+        return true;
+    }
+
+    bool apply(uint32_t peer, uint64_t generation, PeerMessage type, std::string_view payload) {
+        switch (type) {
+            case PeerMessage::Join:
+            case PeerMessage::Leave: {
+                if (payload.size() < 8) {
+                    return false;
+                }
+                SessionId session = getU64(payload.data());
+                std::string roomID;
+                std::string_view name;
+                if (!splitRoom(payload.substr(8), roomID, name)) {
+                    return false;
+                }
+                std::optional<Member> left = removeMember(peer, generation, session);
+                if (left) {
+                    handler.onPeerLeave(left->room, left->name);
+                }
+                if (type == PeerMessage::Join && addMember(peer, generation, session, Member{roomID, std::string(name)})) {
+                    handler.onPeerJoin(roomID, std::string(name));
+                }
+                return true;
+            }
+            case PeerMessage::Chat: {
+                std::string roomID;
+                std::string_view text;
+                if (!splitRoom(payload, roomID, text)) {
+                    return false;
+                }
+                handler.onPeerChat(roomID, text);
+                return true;
+            }
+            case PeerMessage::Ping:
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Both ignore a link that a newer Hello from the same node has replaced
+    bool addMember(uint32_t peer, uint64_t generation, SessionId session, Member member) {
+        std::unique_lock<std::shared_mutex> lock(viewMutex);
+        auto node = nodes.find(peer);
+        if (node == nodes.end() || node->second.generation != generation) {
+            return false;
+        }
+        NodeView& view = node->second;
+        view.rooms[member.room]++;
+        view.members[session] = std::move(member);
+        return true;
+    }
+
+    std::optional<Member> removeMember(uint32_t peer, uint64_t generation, SessionId session) {
+        std::unique_lock<std::shared_mutex> lock(viewMutex);
+        auto node = nodes.find(peer);
+        if (node == nodes.end() || node->second.generation != generation) {
+            return std::nullopt;
+        }
+        NodeView& view = node->second;
+        auto it = view.members.find(session);
+        if (it == view.members.end()) {
+            return std::nullopt;
+        }
+        Member member = std::move(it->second);
+        view.members.erase(it);
+        auto room = view.rooms.find(member.room);
+        if (--room->second == 0) {
+            view.rooms.erase(room);
+        }
+        return member;
+    }
+
+    // The link that spoke for the node is gone, unless a newer one has taken over
+    void forget(uint32_t peer, uint64_t generation) {
+        std::vector<Member> gone;
+        {
+            std::unique_lock<std::shared_mutex> lock(viewMutex);
+            auto node = nodes.find(peer);
+            if (node == nodes.end() || node->second.generation != generation) {
+                return;
+            }
+            for (auto& entry : node->second.members) {
+                gone.push_back(std::move(entry.second));
+            }
+            nodes.erase(node);
+        }
+        for (const Member& member : gone) {
+            handler.onPeerLeave(member.room, member.name);
+        }
+    }
+};
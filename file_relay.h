@@ -0,0 +1,170 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+constexpr size_t kDefaultFileChunkSize = 256 * 1024;
+
+// An open file descriptor shared by every outbound segment queued from it
+class FileHandle {
+public:
+    static std::shared_ptr<FileHandle> open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            return nullptr;
+        }
+        return std::shared_ptr<FileHandle>(new FileHandle(fd));
+    }
+
+    ~FileHandle() {
+        ::close(fd);
+    }
+
+    FileHandle(const FileHandle&) = delete;
+    FileHandle& operator=(const FileHandle&) = delete;
+
+    int descriptor() const {
+        return fd;
+    }
+
+    uint64_t size() const {
+        struct stat info{};
+        return fstat(fd, &info) == 0 ? static_cast<uint64_t>(info.st_size) : 0;
+    }
+
+    // Copies a range into memory, for bytes that are transformed on the way
+    // out instead of going straight to the socket. False on a short read.
+    bool read(uint64_t offset, char* out, size_t length) const {
+        while (length > 0) {
+            ssize_t got = ::pread(fd, out, length, static_cast<off_t>(offset));
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            out += got;
+            offset += static_cast<uint64_t>(got);
+            length -= static_cast<size_t>(got);
+        }
+        return true;
+    }
+
+private:
+    int fd;
+
+    explicit FileHandle(int fd) : fd(fd) {}
+};
+
+// Copies file bytes to a socket inside the kernel. Returns what sendfile()
+// returns: bytes written, or -1 with errno set (EAGAIN when the socket is full).
+inline ssize_t sendFileRange(int socket, const FileHandle& file, uint64_t offset, size_t length) {
+    off_t position = static_cast<off_t>(offset);
+    return ::sendfile(socket, file.descriptor(), &position, length);
+}
+
+// Writes an upload to disk in large blocks. Payloads at least one chunk long
+// go straight from the receive buffer to write(); smaller ones are gathered
+// first so a stream of small frames still costs one syscall per chunk.
+class UploadWriter {
+public:
+    explicit UploadWriter(size_t chunkSize = kDefaultFileChunkSize) : chunkSize(chunkSize) {}
+
+    ~UploadWriter() {
+        close();
+    }
+
+    // Starts writing at `offset`, dropping anything already past it (a
+    // resumed upload continues from the last verified byte)
+    bool open(const std::string& path, uint64_t offset = 0) {
+        close();
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        failed = fd == -1 || ftruncate(fd, static_cast<off_t>(offset)) != 0 || lseek(fd, static_cast<off_t>(offset), SEEK_SET) == -1;
+        if (failed && fd != -1) {
+            ::close(fd);
+            fd = -1;
+        }
+        flushed = offset;
+        return !failed;
+    }
+
+    bool isOpen() const {
+        return fd != -1;
+    }
+
+    void setChunkSize(size_t size) {
+        chunkSize = size;
+    }
+
+    bool write(std::string_view data) {
+        if (fd == -1) {
+            return false;
+        }
+        if (pending.empty() && data.size() >= chunkSize) {
+            return writeAll(data);
+        }
+        pending.append(data.data(), data.size());
+        if (pending.size() >= chunkSize) {
+            bool ok = writeAll(pending);
+            pending.clear();
+            return ok;
+        }
+        return true;
+    }
+
+    // Pushes gathered bytes to the file now, so readers of the file see them
+    bool flush() {
+        if (fd == -1 || pending.empty()) {
+            return !failed;
+        }
+        bool ok = writeAll(pending);
+        pending.clear();
+        return ok;
+    }
+
+    // Bytes already handed to the kernel, i.e. visible to other readers of the file
+    uint64_t written() const {
+        return flushed;
+    }
+
+    // Flushes what is left and closes; false if any write failed
+    bool close() {
+        if (fd == -1) {
+            return !failed;
+        }
+        flush();
+        ::close(fd);
+        fd = -1;
+        return !failed;
+    }
+
+private:
+    int fd = -1;
+    bool failed = false;
+    uint64_t flushed = 0;
+    size_t chunkSize;
+    std::string pending;
+
+    bool writeAll(std::string_view data) {
+        while (!data.empty()) {
+            ssize_t written = ::write(fd, data.data(), data.size());
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                failed = true;
+                return false;
+            }
+            data.remove_prefix(static_cast<size_t>(written));
+            flushed += static_cast<uint64_t>(written);
+        }
+        return true;
+    }
+};
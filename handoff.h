@@ -0,0 +1,302 @@
+#pragma once
+
+#include "net.h"
+#include "protocol.h"
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Hot upgrade: a new server process takes the running one's sockets over a
+// Unix domain socket instead of making every client reconnect. Both are
+// started with the same --handoff path. The running process listens there;
+// a new one connects, and is sent the listening sockets and every client
+// socket (as SCM_RIGHTS) with what it needs to carry on each conversation.
+//
+// The channel carries records: a type byte and a 4-byte big-endian length,
+// sent with at most one descriptor attached, then the payload. The new
+// process opens with a Hello carrying kHandoffVersion and acknowledges the
+// final End record, after which the old process exits.
+constexpr uint32_t kHandoffVersion = 1;
+
+// How long the old process waits for its dispatch queues to drain and its
+// sockets to go still; clients it cannot detach by then are disconnected
+constexpr auto kHandoffDrainTime = std::chrono::seconds(5);
+
+enum class HandoffRecord : uint8_t {
+    Hello = 'H',           // new -> old: u32 version
+    Listener = 'L',        // a client listening socket
+    PeerListener = 'P',    // the federation listening socket
+    MetricsListener = 'M', // the metrics endpoint's listening socket
+    Transfers = 'T',       // u64: the next transfer ID
+    Client = 'C',          // a client socket and its state, see encodeClient()
+    End = 'E',             // nothing follows
+    Ack = 'A'              // new -> old: everything arrived
+};
+
+// One client as the old process left it
+struct HandedClient {
+    SOCKET socket = INVALID_SOCKET;
+    uint64_t id = 0;
+    uint8_t state = 0;         // ConnState
+    bool compression = false;
+    std::string name;          // empty before Hello
+    std::string roomID;        // empty before Join
+    std::string input;         // read but not yet parsed
+    std::string output;        // queued but not yet written
+};
+
+struct HandoffState {
+    std::vector<SOCKET> listeners;
+    SOCKET peerListener = INVALID_SOCKET;
+    SOCKET metricsListener = INVALID_SOCKET;
+    uint64_t nextTransferId = 0;
+    std::vector<HandedClient> clients;
+};
+
+class HandoffChannel {
+public:
+    explicit HandoffChannel(int socket = -1) : socket(socket) {}
+
+    ~HandoffChannel() {
+        if (socket != -1) {
+            ::close(socket);
+        }
+    }
+
+    HandoffChannel(const HandoffChannel&) = delete;
+    HandoffChannel& operator=(const HandoffChannel&) = delete;
+
+    bool valid() const {
+        return socket != -1;
+    }
+
+    // -1 when nobody is listening at the path
+    static int connect(const std::string& path) {
+        sockaddr_un address{};
+        if (!fill(address, path)) {
+            return -1;
+        }
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd != -1 && ::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+            ::close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    // Replaces whatever is at the path, including the socket of a process being taken over
+    static int listen(const std::string& path) {
+        sockaddr_un address{};
+        if (!fill(address, path)) {
+            return -1;
+        }
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        ::unlink(path.c_str());
+        // Whoever connects is handed every client, so only the owner may
+        if (fd != -1 && (::bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+                         ::chmod(path.c_str(), 0600) != 0 || ::listen(fd, 1) != 0)) {
+            ::close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+
+    bool send(HandoffRecord type, std::string_view payload = {}, int descriptor = -1) {
+        char header[5];
+        header[0] = static_cast<char>(type);
+        storeU32(header + 1, static_cast<uint32_t>(payload.size()));
+        iovec part{header, sizeof(header)};
+        msghdr message{};
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        if (descriptor != -1) {
+            message.msg_control = control;
+            message.msg_controllen = sizeof(control);
+            cmsghdr* attached = CMSG_FIRSTHDR(&message);
+            attached->cmsg_level = SOL_SOCKET;
+            attached->cmsg_type = SCM_RIGHTS;
+            attached->cmsg_len = CMSG_LEN(sizeof(int));
+            std::memcpy(CMSG_DATA(attached), &descriptor, sizeof(int));
+        }
+        ssize_t sent;
+        do {
+            sent = sendmsg(socket, &message, MSG_NOSIGNAL);
+        } while (sent < 0 && errno == EINTR);
+        return sent == static_cast<ssize_t>(sizeof(header)) && writeAll(payload);
+    }
+
+    // The descriptor is -1 when the record carried none
+    bool receive(HandoffRecord& type, std::string& payload, int& descriptor) {
+        char header[5];
+        iovec part{header, sizeof(header)};
+        msghdr message{};
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))];
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t got;
+        do {
+            got = recvmsg(socket, &message, MSG_CMSG_CLOEXEC);
+        } while (got < 0 && errno == EINTR);
+        if (got <= 0) {
+            return false;
+        }
+
+        descriptor = -1;
+        for (cmsghdr* attached = CMSG_FIRSTHDR(&message); attached != nullptr; attached = CMSG_NXTHDR(&message, attached)) {
+            if (attached->cmsg_level == SOL_SOCKET && attached->cmsg_type == SCM_RIGHTS) {
+                std::memcpy(&descriptor, CMSG_DATA(attached), sizeof(int));
+            }
+        }
+        if (got < static_cast<ssize_t>(sizeof(header)) && !readAll(header + got, sizeof(header) - static_cast<size_t>(got))) {
+            return false;
+        }
+        type = static_cast<HandoffRecord>(header[0]);
+        payload.resize(getU32(header + 1));
+        return readAll(&payload[0], payload.size());
+    }
+
+private:
+    int socket;
+
+    static bool fill(sockaddr_un& address, const std::string& path) {
+        address.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) {
+            return false;
+        }
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+        return true;
+    }
+
+    bool writeAll(std::string_view data) {
+        while (!data.empty()) {
+            ssize_t written = ::send(socket, data.data(), data.size(), MSG_NOSIGNAL);
+            if (written < 0 && errno == EINTR) {
+                continue;
+            }
+            if (written <= 0) {
+                return false;
+            }
+            data.remove_prefix(static_cast<size_t>(written));
+        }
+        return true;
+    }
+
+    bool readAll(char* out, size_t length) {
+        while (length > 0) {
+            ssize_t got = ::recv(socket, out, length, 0);
+            if (got < 0 && errno == EINTR) {
+                continue;
+            }
+            if (got <= 0) {
+                return false;
+            }
+            out += got;
+            length -= static_cast<size_t>(got);
+        }
+        return true;
+    }
+};
+
+// u64 id, u8 state, u8 compression, then name, room ID, input and output,
+// each a u32 length and the bytes
+inline std::string encodeClient(const HandedClient& client) {
+    std::string out;
+    out.reserve(8 + 2 + 16 + client.name.size() + client.roomID.size() + client.input.size() + client.output.size());
+    putU64(out, client.id);
+    out.push_back(static_cast<char>(client.state));
+    out.push_back(client.compression ? 1 : 0);
+    for (const std::string* field : {&client.name, &client.roomID, &client.input, &client.output}) {
+        putU32(out, static_cast<uint32_t>(field->size()));
+        out += *field;
+    }
+    return out;
+}
+
+inline bool decodeClient(std::string_view payload, HandedClient& client) {
+    if (payload.size() < 10) {
+        return false;
+    }
+    client.id = getU64(payload.data());
+    client.state = static_cast<uint8_t>(payload[8]);
+    client.compression = payload[9] != 0;
+    payload.remove_prefix(10);
+    for (std::string* field : {&client.name, &client.roomID, &client.input, &client.output}) {
+        if (payload.size() < 4 || getU32(payload.data()) > payload.size() - 4) {
+            return false;
+        }
+        size_t length = getU32(payload.data());
+        field->assign(payload.data() + 4, length);
+        payload.remove_prefix(4 + length);
+    }
+    return true;
+}
+
+// The new process's side: asks the process listening at the path for its
+// sockets and reads them until End. Nullopt when nobody listens there;
+// a handoff that breaks off part way also ends in nullopt, with `broken` set.
+inline std::optional<HandoffState> takeOver(const std::string& path, bool& broken) {
+    broken = false;
+    HandoffChannel channel(HandoffChannel::connect(path));
+    if (!channel.valid()) {
+        return std::nullopt;
+    }
+    std::string version;
+    putU32(version, kHandoffVersion);
+    broken = true;
+    if (!channel.send(HandoffRecord::Hello, version)) {
+        return std::nullopt;
+    }
+
+    HandoffState state;
+    HandoffRecord type;
+    std::string payload;
+    int descriptor;
+    while (channel.receive(type, payload, descriptor)) {
+        switch (type) {
+            case HandoffRecord::Listener:
+                state.listeners.push_back(descriptor);
+                break;
+            case HandoffRecord::PeerListener:
+                state.peerListener = descriptor;
+                break;
+            case HandoffRecord::MetricsListener:
+                state.metricsListener = descriptor;
+                break;
+            case HandoffRecord::Transfers:
+                if (payload.size() >= 8) {
+                    state.nextTransferId = getU64(payload.data());
+                }
+                break;
+            case HandoffRecord::Client: {
+                HandedClient client;
+                if (descriptor == -1 || !decodeClient(payload, client)) {
+                    return std::nullopt;
+                }
+                client.socket = descriptor;
+                state.clients.push_back(std::move(client));
+                break;
+            }
+            case HandoffRecord::End:
+                if (!channel.send(HandoffRecord::Ack)) {
+                    return std::nullopt;
+                }
+                broken = false;
+                return state;
+            default:
+                if (descriptor != -1) {
+                    ::close(descriptor);
+                }
+                break;
+        }
+    }
+    return std::nullopt;
+}
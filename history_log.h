@@ -0,0 +1,647 @@
+#pragma once
+
+#include "protocol.h"
+#include "crc32c.h"
+#include "room_registry.h"
+#include "logger.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+struct HistoryOptions {
+    std::filesystem::path directory = "history";
+    size_t backlog = 50;                  // messages replayed on join; 0 turns history off
+    size_t segmentBytes = 8 * 1024 * 1024; // a segment is sealed once it would grow past this
+    size_t maxSegments = 8;               // per room; the oldest is deleted beyond this
+    size_t indexInterval = 4096;          // bytes of log between sparse index entries
+    int commitDelayMs = 2;                // how long the writer lingers to gather a bigger batch
+    int idleSeconds = 60;                 // a room's log is closed after this long unused
+};
+
+// One file of a room's log. Records are appended as
+//
+//   | length (4 bytes) | CRC-32C of payload (4 bytes) | payload |
+//
+// and numbered implicitly from the segment's base sequence, which is also the
+// file name. A sidecar .idx file holds a sparse index: every indexInterval
+// bytes, (record number within segment, byte position), both 4 bytes. Reads
+// go through a read-only mapping of the whole segment.
+class LogSegment {
+public:
+    static constexpr size_t kRecordHeaderSize = 8;
+
+    const uint64_t baseSequence;
+
+    // Opens or creates the segment, dropping a torn record at the end if the
+    // server died mid-write
+    static std::unique_ptr<LogSegment> open(const std::filesystem::path& directory, uint64_t baseSequence, const HistoryOptions& options) {
+        std::unique_ptr<LogSegment> segment(new LogSegment(directory, baseSequence, options));
+        return segment->recover() ? std::move(segment) : nullptr;
+    }
+
+    ~LogSegment() {
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, mappedBytes);
+        }
+        if (fd != -1) {
+            ::close(fd);
+        }
+        if (indexFd != -1) {
+            ::close(indexFd);
+        }
+    }
+
+    LogSegment(const LogSegment&) = delete;
+    LogSegment& operator=(const LogSegment&) = delete;
+
+    bool fits(size_t recordBytes) const {
+        return size + recordBytes <= mappedBytes;
+    }
+
+    bool empty() const {
+        return count == 0;
+    }
+
+    uint64_t endSequence() const {
+        return baseSequence + count;
+    }
+
+    // Appends already-encoded records (count of them) in one write
+    bool append(const std::string& records, uint32_t recordCount, const std::vector<uint32_t>& offsets) {
+        if (pwrite(fd, records.data(), records.size(), static_cast<off_t>(size)) != static_cast<ssize_t>(records.size())) {
+            return false;
+        }
+        for (uint32_t i = 0; i < recordCount; i++) {
+            maybeIndex(count + i, static_cast<uint32_t>(size + offsets[i]));
+        }
+        size += records.size();
+        count += recordCount;
+        return true;
+    }
+
+    void sync() {
+        fdatasync(fd);
+        fdatasync(indexFd);
+    }
+
+    // Calls fn(payload) for each record from `sequence` to the end of the
+    // segment. Payloads point into the mapping.
+    template <typename Callback>
+    void read(uint64_t sequence, Callback&& fn) const {
+        if (sequence >= endSequence()) {
+            return;
+        }
+        uint32_t target = static_cast<uint32_t>(sequence - baseSequence);
+
+        // Nearest index entry at or before the target, then walk
+        uint32_t record = 0;
+        size_t position = 0;
+        auto it = std::upper_bound(index.begin(), index.end(), target, [](uint32_t value, const IndexEntry& entry) {
+            return value < entry.record;
+        });
+        if (it != index.begin()) {
+            --it;
+            record = it->record;
+            position = it->position;
+        }
+
+        const char* base = static_cast<const char*>(mapping);
+        while (position + kRecordHeaderSize <= size) {
+            uint32_t length = getU32(base + position);
+            if (record >= target) {
+                fn(std::string_view(base + position + kRecordHeaderSize, length));
+            }
+            position += kRecordHeaderSize + length;
+            record++;
+        }
+    }
+
+    void remove() {
+        std::error_code error;
+        std::filesystem::remove(logPath, error);
+        std::filesystem::remove(indexPath, error);
+    }
+
+    static std::string fileName(uint64_t baseSequence, const char* extension) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%020llu%s", static_cast<unsigned long long>(baseSequence), extension);
+        return name;
+    }
+
+private:
+    struct IndexEntry {
+        uint32_t record;
+        uint32_t position;
+    };
+
+    std::filesystem::path logPath;
+    std::filesystem::path indexPath;
+    size_t indexInterval;
+    int fd = -1;
+    int indexFd = -1;
+    void* mapping = MAP_FAILED;
+    size_t mappedBytes;
+    size_t size = 0;    // bytes of complete records
+    uint32_t count = 0; // records in the segment
+    std::vector<IndexEntry> index;
+
+    LogSegment(const std::filesystem::path& directory, uint64_t baseSequence, const HistoryOptions& options)
+        : baseSequence(baseSequence), logPath(directory / fileName(baseSequence, ".log")),
+          indexPath(directory / fileName(baseSequence, ".idx")), indexInterval(options.indexInterval),
+          mappedBytes(options.segmentBytes) {}
+
+    bool recover() {
+        fd = ::open(logPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        indexFd = ::open(indexPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        struct stat info{};
+        if (fd == -1 || indexFd == -1 || fstat(fd, &info) != 0) {
+            return false;
+        }
+        size_t fileSize = static_cast<size_t>(info.st_size);
+        mappedBytes = std::max(mappedBytes, fileSize);
+        mapping = mmap(nullptr, mappedBytes, PROT_READ, MAP_SHARED, fd, 0);
+        if (mapping == MAP_FAILED) {
+            return false;
+        }
+
+        // Trust index entries that point inside the file; scan on from the last one
+        std::string indexBytes = readIndexFile();
+        for (size_t i = 0; i + 8 <= indexBytes.size(); i += 8) {
+            IndexEntry entry{getU32(&indexBytes[i]), getU32(&indexBytes[i + 4])};
+            if (entry.position >= fileSize || (!index.empty() && entry.record <= index.back().record)) {
+                break;
+            }
+            index.push_back(entry);
+        }
+        if (ftruncate(indexFd, static_cast<off_t>(index.size() * 8)) != 0) {
+            return false;
+        }
+        if (!index.empty()) {
+            count = index.back().record;
+            size = index.back().position;
+        }
+
+        const char* base = static_cast<const char*>(mapping);
+        while (size + kRecordHeaderSize <= fileSize) {
+            uint32_t length = getU32(base + size);
+            if (size + kRecordHeaderSize + length > fileSize || crc32c(0, base + size + kRecordHeaderSize, length) != getU32(base + size + 4)) {
+                break;
+            }
+            maybeIndex(count, static_cast<uint32_t>(size));
+            size += kRecordHeaderSize + length;
+            count++;
+        }
+        if (size < fileSize) {
+            logWarning("History: dropping ", fileSize - size, " torn bytes from ", logPath);
+            if (ftruncate(fd, static_cast<off_t>(size)) != 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    std::string readIndexFile() {
+        std::string bytes;
+        char buffer[4096];
+        ssize_t got;
+        off_t offset = 0;
+        while ((got = pread(indexFd, buffer, sizeof(buffer), offset)) > 0) {
+            bytes.append(buffer, static_cast<size_t>(got));
+            offset += got;
+        }
+        return bytes;
+    }
+
+    void maybeIndex(uint32_t record, uint32_t position) {
+        if (!index.empty() && position < index.back().position + indexInterval) {
+            return;
+        }
+        if (!index.empty() && record == index.back().record) {
+            return;
+        }
+        index.push_back({record, position});
+        std::string entry;
+        putU32(entry, record);
+        putU32(entry, position);
+        if (pwrite(indexFd, entry.data(), entry.size(), static_cast<off_t>((index.size() - 1) * 8)) != 8) {
+            index.pop_back();
+        }
+    }
+};
+
+// All segments of one room, oldest first. Only the history thread opens,
+// appends to or reads a RoomLog.
+class RoomLog {
+public:
+    RoomLog(std::filesystem::path directory, const HistoryOptions& options) : directory(std::move(directory)), options(options) {}
+
+    // Loads whatever segments exist; false if the room has no usable log
+    bool load(bool create) {
+        std::error_code error;
+        std::vector<uint64_t> bases;
+        for (const auto& entry : std::filesystem::directory_iterator(directory, error)) {
+            if (entry.path().extension() == ".log" && entry.path().stem().string().size() == 20) {
+                bases.push_back(std::stoull(entry.path().stem().string()));
+            }
+        }
+        std::sort(bases.begin(), bases.end());
+        for (uint64_t base : bases) {
+            auto segment = LogSegment::open(directory, base, options);
+            if (!segment) {
+                logError("History: cannot open segment ", base, " in ", directory);
+                return false;
+            }
+            segments.push_back(std::move(segment));
+        }
+        if (segments.empty()) {
+            if (!create) {
+                return false;
+            }
+            std::filesystem::create_directories(directory, error);
+            auto segment = LogSegment::open(directory, 0, options);
+            if (!segment) {
+                return false;
+            }
+            segments.push_back(std::move(segment));
+        }
+        return true;
+    }
+
+    // Writer thread only. Adds the segments written to `dirty` for the caller to sync.
+    void append(const std::vector<std::string_view>& payloads, std::vector<LogSegment*>& dirty) {
+        uint32_t pending = 0;
+        for (std::string_view payload : payloads) {
+            size_t recordBytes = LogSegment::kRecordHeaderSize + payload.size();
+            if (recordBytes > options.segmentBytes) {
+                continue; // never fits a segment; not kept
+            }
+            if (!segments.back()->fits(records.size() + recordBytes)) {
+                flush(pending, dirty);
+                roll(dirty);
+                if (!segments.back()->fits(recordBytes)) {
+                    continue; // could not start a new segment
+                }
+            }
+            offsets.push_back(static_cast<uint32_t>(records.size()));
+            putU32(records, static_cast<uint32_t>(payload.size()));
+            putU32(records, crc32c(0, payload.data(), payload.size()));
+            records.append(payload.data(), payload.size());
+            pending++;
+        }
+        flush(pending, dirty);
+    }
+
+    // Calls fn(payload) for up to the last `count` records, oldest first
+    template <typename Callback>
+    void recent(size_t count, Callback&& fn) {
+        uint64_t end = segments.back()->endSequence();
+        uint64_t first = segments.front()->baseSequence;
+        uint64_t start = end - std::min<uint64_t>(count, end - first);
+        for (const auto& segment : segments) {
+            if (segment->endSequence() > start) {
+                segment->read(std::max(start, segment->baseSequence), fn);
+            }
+        }
+    }
+
+private:
+    std::filesystem::path directory;
+    const HistoryOptions& options;
+    std::deque<std::unique_ptr<LogSegment>> segments;
+    std::string records;            // encoding buffer, kept between batches
+    std::vector<uint32_t> offsets;
+
+    void flush(uint32_t& pending, std::vector<LogSegment*>& dirty) {
+        if (pending == 0) {
+            return;
+        }
+        LogSegment* segment = segments.back().get();
+        if (!segment->append(records, pending, offsets)) {
+            logError("History: write failed in ", directory);
+        }
+        if (std::find(dirty.begin(), dirty.end(), segment) == dirty.end()) {
+            dirty.push_back(segment);
+        }
+        records.clear();
+        offsets.clear();
+        pending = 0;
+    }
+
+    // Seals the active segment and starts the next one; drops the oldest past the limit
+    void roll(std::vector<LogSegment*>& dirty) {
+        LogSegment* sealed = segments.back().get();
+        sealed->sync();
+        dirty.erase(std::remove(dirty.begin(), dirty.end(), sealed), dirty.end());
+        auto next = LogSegment::open(directory, sealed->endSequence(), options);
+        if (!next) {
+            logError("History: cannot start a new segment in ", directory);
+            return;
+        }
+        segments.push_back(std::move(next));
+        while (segments.size() > std::max<size_t>(1, options.maxSegments)) {
+            segments.front()->remove();
+            segments.pop_front();
+        }
+    }
+};
+
+// Per-room chat history on disk. append() only copies the message into a
+// staging buffer, so the live fan-out never waits for the disk and no frame
+// is held while an fsync runs. A background writer swaps the staging buffer
+// out, writes each room's records with one write(), then fdatasync()s every
+// touched segment once: one group commit for the whole batch. Both staging
+// buffers keep their capacity, so a steady load does not allocate.
+//
+// The writer is also the only thread that opens, recovers and closes room
+// logs, so a join never waits on the disk or on a commit. It publishes each
+// open room's last `backlog` messages as an immutable snapshot for recent(),
+// and closes a room's log once it has gone --history-idle seconds unused.
+class HistoryLog {
+public:
+    using Backlog = std::vector<std::string>;
+    using BacklogCallback = std::function<void(const Backlog&)>;
+
+    explicit HistoryLog(const HistoryOptions& options) : options(options) {
+        if (enabled()) {
+            std::filesystem::create_directories(options.directory);
+            queued.reserve(kQueueReserve);
+            queuedBytes.reserve(kQueueReserve * 64);
+            writer = std::thread([this]() {
+                run();
+            });
+        }
+    }
+
+    ~HistoryLog() {
+        close();
+    }
+
+    // Commits everything appended so far and stops the writer; later appends are dropped
+    void close() {
+        if (writer.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(queueMutex);
+                stopping = true;
+            }
+            queueCondition.notify_one();
+            writer.join();
+        }
+    }
+
+    bool enabled() const {
+        return options.backlog > 0;
+    }
+
+    void append(RoomRegistry::RoomHandle room, std::string_view payload) {
+        if (!enabled()) {
+            return;
+        }
+        bool wasEmpty;
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (stopping) {
+                return;
+            }
+            wasEmpty = queued.empty();
+            queued.push_back({std::move(room), queuedBytes.size(), payload.size()});
+            queuedBytes.append(payload.data(), payload.size());
+        }
+        if (wasEmpty) {
+            queueCondition.notify_one();
+        }
+    }
+
+    // Calls done(backlog) with the room's last `backlog` messages, oldest
+    // first. When the room's log is open that happens here, from its
+    // snapshot; otherwise the writer opens the log and calls done on its own
+    // thread. A room with no history gets no call.
+    void recent(const std::string& roomID, BacklogCallback done) {
+        if (!enabled()) {
+            return;
+        }
+        if (std::shared_ptr<const Backlog> backlog = snapshot(roomID)) {
+            done(*backlog);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            if (stopping) {
+                return;
+            }
+            loads.push_back({roomID, std::move(done)});
+        }
+        queueCondition.notify_one();
+    }
+
+    uint64_t commits() const {
+        return commitCount.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t kQueueReserve = 4096;
+    static constexpr std::chrono::seconds kIdleCheckInterval{1};
+
+    struct Entry {
+        RoomRegistry::RoomHandle room;
+        size_t offset; // payload position in the staging bytes
+        size_t length;
+    };
+
+    struct Load {
+        std::string roomID;
+        BacklogCallback done;
+    };
+
+    struct OpenLog {
+        std::unique_ptr<RoomLog> log;
+        std::chrono::steady_clock::time_point lastUsed;
+    };
+
+    HistoryOptions options;
+    std::mutex queueMutex;
+    std::condition_variable queueCondition;
+    std::vector<Entry> queued;
+    std::string queuedBytes;
+    std::vector<Load> loads; // recent() calls for rooms whose log is not open
+    bool stopping = false;
+    std::atomic<uint64_t> commitCount{0};
+
+    std::unordered_map<std::string, OpenLog> logs; // writer thread only
+    std::mutex snapshotsMutex;
+    std::unordered_map<std::string, std::shared_ptr<const Backlog>> snapshots; // one per open log
+    std::thread writer;
+
+    // Room IDs are arbitrary text, so each room's directory is its ID in hex
+    std::filesystem::path directoryFor(const std::string& roomID) const {
+        static const char* digits = "0123456789abcdef";
+        std::string name;
+        for (unsigned char c : roomID) {
+            name.push_back(digits[c >> 4]);
+            name.push_back(digits[c & 15]);
+        }
+        return options.directory / (name.empty() ? "_" : name);
+    }
+
+    std::shared_ptr<const Backlog> snapshot(const std::string& roomID) {
+        std::lock_guard<std::mutex> lock(snapshotsMutex);
+        auto it = snapshots.find(roomID);
+        return it != snapshots.end() ? it->second : nullptr;
+    }
+
+    void publish(const std::string& roomID, std::shared_ptr<const Backlog> backlog) {
+        std::lock_guard<std::mutex> lock(snapshotsMutex);
+        if (backlog) {
+            snapshots[roomID] = std::move(backlog);
+        } else {
+            snapshots.erase(roomID);
+        }
+    }
+
+    // Writer thread only. Opens the room's log and publishes its snapshot.
+    RoomLog* logFor(const std::string& roomID, bool create) {
+        auto now = std::chrono::steady_clock::now();
+        auto it = logs.find(roomID);
+        if (it != logs.end()) {
+            it->second.lastUsed = now;
+            return it->second.log.get();
+        }
+        std::filesystem::path directory = directoryFor(roomID);
+        if (!create && !std::filesystem::exists(directory)) {
+            return nullptr;
+        }
+        auto log = std::make_unique<RoomLog>(directory, options);
+        if (!log->load(create)) {
+            return nullptr;
+        }
+        auto backlog = std::make_shared<Backlog>();
+        log->recent(options.backlog, [&](std::string_view payload) {
+            backlog->emplace_back(payload);
+        });
+        publish(roomID, std::move(backlog));
+        return logs.emplace(roomID, OpenLog{std::move(log), now}).first->second.log.get();
+    }
+
+    // Replaces the room's snapshot with its tail plus the newly written
+    // payloads, skipping any too big for a segment as RoomLog::append does
+    void extendSnapshot(const std::string& roomID, const std::vector<std::string_view>& payloads) {
+        std::vector<std::string_view> added;
+        for (auto it = payloads.rbegin(); it != payloads.rend() && added.size() < options.backlog; ++it) {
+            if (LogSegment::kRecordHeaderSize + it->size() <= options.segmentBytes) {
+                added.push_back(*it);
+            }
+        }
+        std::shared_ptr<const Backlog> current = snapshot(roomID);
+        size_t kept = current ? std::min(current->size(), options.backlog - added.size()) : 0;
+        auto backlog = std::make_shared<Backlog>();
+        backlog->reserve(kept + added.size());
+        if (kept > 0) {
+            backlog->insert(backlog->end(), current->end() - static_cast<std::ptrdiff_t>(kept), current->end());
+        }
+        for (auto it = added.rbegin(); it != added.rend(); ++it) {
+            backlog->emplace_back(*it);
+        }
+        publish(roomID, std::move(backlog));
+    }
+
+    // Every touched segment has been synced by now, so closing is all that is left
+    void closeIdle(std::unordered_map<std::string, std::vector<std::string_view>>& byRoom) {
+        auto cutoff = std::chrono::steady_clock::now() - std::chrono::seconds(options.idleSeconds);
+        for (auto it = logs.begin(); it != logs.end();) {
+            if (it->second.lastUsed < cutoff) {
+                publish(it->first, nullptr);
+                byRoom.erase(it->first);
+                it = logs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    void run() {
+        // All kept across batches, so a steady load reuses their storage
+        std::vector<Entry> batch;
+        std::string batchBytes;
+        batch.reserve(kQueueReserve);
+        batchBytes.reserve(kQueueReserve * 64);
+        std::unordered_map<std::string, std::vector<std::string_view>> byRoom;
+        std::vector<LogSegment*> dirty;
+        std::vector<Load> loading;
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                auto ready = [this]() {
+                    return stopping || !queued.empty() || !loads.empty();
+                };
+                if (logs.empty()) {
+                    queueCondition.wait(lock, ready);
+                } else {
+                    // Wake now and then to close logs that have gone idle
+                    queueCondition.wait_for(lock, kIdleCheckInterval, ready);
+                }
+                if (queued.empty() && stopping) {
+                    return;
+                }
+                if (!queued.empty() && !stopping && options.commitDelayMs > 0) {
+                    // Linger briefly so a burst lands in one commit
+                    queueCondition.wait_for(lock, std::chrono::milliseconds(options.commitDelayMs), [this]() {
+                        return stopping;
+                    });
+                }
+                batch.swap(queued);
+                batchBytes.swap(queuedBytes);
+                loading.swap(loads);
+            }
+
+            for (const Entry& entry : batch) {
+                byRoom[entry.room->id].push_back(std::string_view(batchBytes).substr(entry.offset, entry.length));
+            }
+            for (auto& [roomID, payloads] : byRoom) {
+                if (payloads.empty()) {
+                    continue;
+                }
+                if (RoomLog* log = logFor(roomID, true)) {
+                    log->append(payloads, dirty);
+                    extendSnapshot(roomID, payloads);
+                }
+                payloads.clear();
+            }
+            bool committed = !batch.empty();
+            batch.clear();
+            batchBytes.clear();
+
+            for (LogSegment* segment : dirty) {
+                segment->sync();
+            }
+            dirty.clear();
+            if (committed) {
+                commitCount.fetch_add(1, std::memory_order_relaxed);
+            }
+
+            // After the writes, so a backlog includes this batch
+            for (Load& load : loading) {
+                if (logFor(load.roomID, false)) {
+                    load.done(*snapshot(load.roomID));
+                }
+            }
+            loading.clear();
+            closeIdle(byRoom);
+        }
+    }
+};
@@ -0,0 +1,507 @@
+// Headless load generator for the chat server. Opens many connections over
+// loopback, spreads them over rooms and replays a weighted mix of chat,
+// CHANGE and SEND operations, then reports throughput and fan-out latency.
+//
+//   loadgen [--host ip] [--port n] [--clients n] [--rooms n] [--threads n]
+//           [--duration s] [--warmup s] [--rate msgs/s per client]
+//           [--size bytes] [--mix chat=98,change=2,send=0] [--file-size bytes]
+//           [--compress 0|1]
+//
+// Every chat payload starts with the monotonic time it was sent, so each
+// recipient measures send-to-delivery latency directly (same box, same clock).
+// With --compress 1 the clients ask for compressed chat and decode it, and
+// the bytes-in figure shows what that saved on the wire.
+#include <iostream>
+#include <vector>
+#include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <memory>
+#include <csignal>
+#include <cstring>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "net.h"
+#include "protocol.h"
+#include "compression.h"
+#include "crc32c.h"
+#include "metrics.h"
+
+struct Mix {
+    unsigned chat = 98;
+    unsigned change = 2;
+    unsigned send = 0;
+};
+
+struct LoadConfig {
+    std::string host = "127.0.0.1";
+    int port = 12345;
+    int clients = 1000;
+    int rooms = 50;
+    int threads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency() / 2));
+    int duration = 10; // seconds of measured load
+    int warmup = 2;    // seconds of load before measuring
+    double rate = 1;   // operations per second per client
+    size_t size = 64;  // chat payload bytes
+    size_t fileSize = 64 * 1024;
+    bool compress = false;
+    Mix mix;
+};
+
+// Totals shared by all threads; each thread adds its own once a second
+struct LoadTotals {
+    std::atomic<uint64_t> connected{0};
+    std::atomic<uint64_t> failed{0};
+    std::atomic<uint64_t> disconnected{0};
+    std::atomic<uint64_t> sent{0};
+    std::atomic<uint64_t> delivered{0};
+    std::atomic<uint64_t> changes{0};
+    std::atomic<uint64_t> uploads{0};
+    std::atomic<uint64_t> bytesIn{0};
+};
+
+enum class Phase {
+    Warmup,
+    Measure,
+    Stop
+};
+
+class LoadClient {
+public:
+    SOCKET socket = INVALID_SOCKET;
+    int index;
+    int room;
+    uint64_t nextOp = 0;
+    bool connected = false;
+    bool writeArmed = false;
+    std::string out;
+    size_t outOffset = 0;
+    RingBuffer in;
+    FrameParser parser;
+
+    LoadClient(int index, int room) : index(index), room(room) {}
+
+    void queue(FrameType type, std::string_view payload, uint8_t flags = 0) {
+        appendFrame(out, type, payload, flags);
+    }
+};
+
+class LoadThread {
+public:
+    LoadThread(const LoadConfig& config, LoadTotals& totals, const std::atomic<Phase>& phase, int first, int count)
+        : config(config), totals(totals), phase(phase), random(static_cast<uint64_t>(first) * 7919 + 1),
+          dictionaries(static_cast<size_t>(config.rooms) * 2) {
+        epoll = epoll_create1(EPOLL_CLOEXEC);
+        for (int i = first; i < first + count; i++) {
+            clients.push_back(std::make_unique<LoadClient>(i, i % config.rooms));
+        }
+    }
+
+    ~LoadThread() {
+        for (auto& client : clients) {
+            if (client->socket != INVALID_SOCKET) {
+                closesocket(client->socket);
+            }
+        }
+        close(epoll);
+    }
+
+    void run() {
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(static_cast<uint16_t>(config.port));
+        inet_pton(AF_INET, config.host.c_str(), &address.sin_addr);
+
+        // Connect in small steps so the listen backlog never overflows
+        for (size_t i = 0; i < clients.size(); i++) {
+            open(*clients[i], address);
+            if (i % 64 == 63) {
+                poll(1);
+            }
+        }
+
+        uint64_t interval = config.rate > 0 ? static_cast<uint64_t>(1e9 / config.rate) : 0;
+        std::uniform_int_distribution<uint64_t> jitter(0, std::max<uint64_t>(1, interval));
+        uint64_t start = monotonicNanos();
+        for (auto& client : clients) {
+            client->nextOp = start + jitter(random);
+        }
+
+        uint64_t lastReport = start;
+        while (phase.load(std::memory_order_relaxed) != Phase::Stop) {
+            uint64_t now = monotonicNanos();
+            if (interval > 0) {
+                for (auto& client : clients) {
+                    if (client->connected && client->nextOp <= now) {
+                        operate(*client, now);
+                        client->nextOp += interval;
+                        if (client->nextOp < now) {
+                            client->nextOp = now + interval; // fell behind; do not burst to catch up
+                        }
+                    }
+                }
+            }
+            poll(1);
+            if (now - lastReport >= 1000000000ull) {
+                publish();
+                lastReport = now;
+            }
+        }
+        publish();
+    }
+
+    const Histogram& latency() const {
+        return latencyNs;
+    }
+
+private:
+    const LoadConfig& config;
+    LoadTotals& totals;
+    const std::atomic<Phase>& phase;
+    std::mt19937_64 random;
+    int epoll;
+    std::vector<std::unique_ptr<LoadClient>> clients;
+    Histogram latencyNs;
+    std::string fileData;
+    ReceivedDictionaries dictionaries; // shared by this thread's clients; IDs are unique per server
+    std::string decoded;
+
+    // Counted locally and added to the totals in publish()
+    uint64_t sent = 0;
+    uint64_t delivered = 0;
+    uint64_t changes = 0;
+    uint64_t uploads = 0;
+    uint64_t bytesIn = 0;
+
+    void open(LoadClient& client, const sockaddr_in& address) {
+        client.socket = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int noDelay = 1;
+        setsockopt(client.socket, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+        if (client.socket == INVALID_SOCKET ||
+            (connect(client.socket, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR && errno != EINPROGRESS)) {
+            totals.failed++;
+            closeClient(client);
+            return;
+        }
+        client.queue(FrameType::Hello, "load" + std::to_string(client.index), config.compress ? kHelloCompression : 0);
+        client.queue(FrameType::Join, roomName(client.room));
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+        event.data.ptr = &client;
+        client.writeArmed = true;
+        epoll_ctl(epoll, EPOLL_CTL_ADD, client.socket, &event);
+    }
+
+    static std::string roomName(int room) {
+        return "room" + std::to_string(room);
+    }
+
+    void operate(LoadClient& client, uint64_t now) {
+        unsigned total = config.mix.chat + config.mix.change + config.mix.send;
+        unsigned pick = static_cast<unsigned>(random() % std::max(1u, total));
+        if (pick < config.mix.chat) {
+            // "<send time> <padding>"; the server prefixes "name: "
+            std::string payload = std::to_string(now) + " ";
+            if (payload.size() < config.size) {
+                payload.resize(config.size, '.');
+            }
+            client.queue(FrameType::Chat, payload);
+            sent++;
+        } else if (pick < config.mix.chat + config.mix.change) {
+            client.room = static_cast<int>(random() % static_cast<uint64_t>(config.rooms));
+            client.queue(FrameType::Change, roomName(client.room));
+            changes++;
+        } else {
+            upload(client);
+            uploads++;
+        }
+        flush(client);
+    }
+
+    // Offer and every chunk go out back to back; the server accepts data
+    // right after the offer, and nobody ever accepts the file
+    void upload(LoadClient& client) {
+        if (fileData.size() != config.fileSize) {
+            fileData.assign(config.fileSize, 'x');
+        }
+        std::string offer;
+        putU64(offer, fileData.size());
+        offer += "load.bin";
+        client.queue(FrameType::FileOffer, offer);
+        for (size_t offset = 0; offset < fileData.size(); offset += kFileChunkSize) {
+            std::string_view chunk = std::string_view(fileData).substr(offset, kFileChunkSize);
+            std::string payload;
+            putU64(payload, offset);
+            putU32(payload, crc32c(0, chunk.data(), chunk.size()));
+            payload += chunk;
+            client.queue(FrameType::FileData, payload);
+        }
+    }
+
+    void poll(int timeoutMs) {
+        epoll_event events[256];
+        int ready = epoll_wait(epoll, events, 256, timeoutMs);
+        for (int i = 0; i < ready; i++) {
+            LoadClient& client = *static_cast<LoadClient*>(events[i].data.ptr);
+            if (client.socket == INVALID_SOCKET) {
+                continue;
+            }
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                closeClient(client);
+                continue;
+            }
+            if (events[i].events & EPOLLOUT) {
+                if (!client.connected) {
+                    client.connected = true;
+                    totals.connected++;
+                }
+                flush(client);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+                read(client);
+            }
+        }
+    }
+
+    void flush(LoadClient& client) {
+        while (client.outOffset < client.out.size()) {
+            ssize_t written = send(client.socket, client.out.data() + client.outOffset, client.out.size() - client.outOffset, MSG_NOSIGNAL);
+            if (written <= 0) {
+                if (written < 0 && wouldBlock()) {
+                    break;
+                }
+                closeClient(client);
+                return;
+            }
+            client.outOffset += static_cast<size_t>(written);
+        }
+        if (client.outOffset == client.out.size()) {
+            client.out.clear();
+            client.outOffset = 0;
+        }
+        bool wantWrite = !client.out.empty();
+        if (wantWrite != client.writeArmed) {
+            epoll_event event{};
+            event.events = EPOLLIN | EPOLLRDHUP | (wantWrite ? uint32_t(EPOLLOUT) : 0u);
+            event.data.ptr = &client;
+            epoll_ctl(epoll, EPOLL_CTL_MOD, client.socket, &event);
+            client.writeArmed = wantWrite;
+        }
+    }
+
+    void read(LoadClient& client) {
+        while (true) {
+            ssize_t got = recv(client.socket, client.in.writePointer(), client.in.writableContiguous(), 0);
+            if (got > 0) {
+                bytesIn += static_cast<uint64_t>(got);
+                client.in.commit(static_cast<size_t>(got));
+                uint64_t now = monotonicNanos();
+                client.parser.parse(client.in, [&](const Frame& frame) {
+                    if (frame.type == FrameType::Dictionary) {
+                        dictionaries.add(frame.payload);
+                    } else if (frame.type == FrameType::Chat && (frame.flags & kCompressed)) {
+                        if (decompressPayload(frame.payload, frame.flags, &dictionaries, decoded)) {
+                            onChat(decoded, now);
+                        }
+                    } else if (frame.type == FrameType::Chat) {
+                        onChat(frame.payload, now);
+                    }
+                    return true;
+                });
+                continue;
+            }
+            if (got < 0 && (errno == EINTR)) {
+                continue;
+            }
+            if (got < 0 && wouldBlock()) {
+                return;
+            }
+            closeClient(client);
+            return;
+        }
+    }
+
+    // Chat payloads are "name: <send time> ...". Replayed history is older
+    // than the run and skipped.
+    void onChat(std::string_view payload, uint64_t now) {
+        size_t colon = payload.find(": ");
+        if (colon == std::string_view::npos) {
+            return;
+        }
+        uint64_t sentAt = 0;
+        for (size_t i = colon + 2; i < payload.size() && payload[i] >= '0' && payload[i] <= '9'; i++) {
+            sentAt = sentAt * 10 + static_cast<uint64_t>(payload[i] - '0');
+        }
+        if (sentAt == 0 || sentAt > now) {
+            return;
+        }
+        delivered++;
+        if (phase.load(std::memory_order_relaxed) == Phase::Measure) {
+            latencyNs.record(now - sentAt);
+        }
+    }
+
+    void closeClient(LoadClient& client) {
+        if (client.socket != INVALID_SOCKET) {
+            epoll_ctl(epoll, EPOLL_CTL_DEL, client.socket, nullptr);
+            closesocket(client.socket);
+            client.socket = INVALID_SOCKET;
+            if (client.connected) {
+                totals.disconnected++;
+            }
+        }
+        client.connected = false;
+    }
+
+    void publish() {
+        totals.sent += sent;
+        totals.delivered += delivered;
+        totals.changes += changes;
+        totals.uploads += uploads;
+        totals.bytesIn += bytesIn;
+        sent = delivered = changes = uploads = bytesIn = 0;
+    }
+};
+
+Mix parseMix(const std::string& value) {
+    Mix mix{0, 0, 0};
+    size_t start = 0;
+    while (start < value.size()) {
+        size_t end = value.find(',', start);
+        std::string item = value.substr(start, end == std::string::npos ? std::string::npos : end - start);
+        size_t equals = item.find('=');
+        if (equals != std::string::npos) {
+            std::string name = item.substr(0, equals);
+            unsigned weight = static_cast<unsigned>(std::stoul(item.substr(equals + 1)));
+            if (name == "chat") {
+                mix.chat = weight;
+            } else if (name == "change") {
+                mix.change = weight;
+            } else if (name == "send") {
+                mix.send = weight;
+            } else {
+                std::cerr << "Unknown operation in --mix: " << name << std::endl;
+            }
+        }
+        if (end == std::string::npos) {
+            break;
+        }
+        start = end + 1;
+    }
+    return mix;
+}
+
+LoadConfig parseArgs(int argc, char* argv[]) {
+    LoadConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
+        if (option == "--host") {
+            config.host = value;
+        } else if (option == "--port") {
+            config.port = std::stoi(value);
+        } else if (option == "--clients") {
+            config.clients = std::max(1, std::stoi(value));
+        } else if (option == "--rooms") {
+            config.rooms = std::max(1, std::stoi(value));
+        } else if (option == "--threads") {
+            config.threads = std::max(1, std::stoi(value));
+        } else if (option == "--duration") {
+            config.duration = std::max(1, std::stoi(value));
+        } else if (option == "--warmup") {
+            config.warmup = std::max(0, std::stoi(value));
+        } else if (option == "--rate") {
+            config.rate = std::stod(value);
+        } else if (option == "--size") {
+            config.size = std::clamp<size_t>(std::stoul(value), 24, kMaxFramePayload / 2);
+        } else if (option == "--mix") {
+            config.mix = parseMix(value);
+        } else if (option == "--file-size") {
+            config.fileSize = std::stoul(value);
+        } else if (option == "--compress") {
+            config.compress = value != "0";
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+        }
+    }
+    return config;
+}
+
+// Thousands of sockets need more descriptors than the usual soft limit
+void raiseDescriptorLimit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+std::string formatNanos(uint64_t nanos) {
+    char text[32];
+    if (nanos >= 1000000) {
+        std::snprintf(text, sizeof(text), "%.2f ms", nanos / 1e6);
+    } else {
+        std::snprintf(text, sizeof(text), "%.1f us", nanos / 1e3);
+    }
+    return text;
+}
+
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    LoadConfig config = parseArgs(argc, argv);
+    raiseDescriptorLimit();
+
+    LoadTotals totals;
+    std::atomic<Phase> phase{Phase::Warmup};
+    int threadCount = std::min(config.threads, config.clients);
+    std::vector<std::unique_ptr<LoadThread>> workers;
+    for (int t = 0, first = 0; t < threadCount; t++) {
+        int count = config.clients / threadCount + (t < config.clients % threadCount ? 1 : 0);
+        workers.push_back(std::make_unique<LoadThread>(config, totals, phase, first, count));
+        first += count;
+    }
+
+    std::cout << "Load: " << config.clients << " clients in " << config.rooms << " rooms on " << threadCount << " threads, "
+              << config.rate << " ops/s each, mix chat=" << config.mix.chat << " change=" << config.mix.change
+              << " send=" << config.mix.send << std::endl;
+    std::vector<std::thread> threads;
+    for (auto& worker : workers) {
+        threads.emplace_back([&worker]() {
+            worker->run();
+        });
+    }
+
+    std::this_thread::sleep_for(std::chrono::seconds(config.warmup));
+    uint64_t sentBefore = totals.sent;
+    uint64_t deliveredBefore = totals.delivered;
+    phase = Phase::Measure;
+    auto start = std::chrono::steady_clock::now();
+    for (int second = 1; second <= config.duration; second++) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        std::cout << "  " << second << "s: " << totals.connected << " connected, " << totals.sent << " sent, "
+                  << totals.delivered << " delivered" << std::endl;
+    }
+    phase = Phase::Stop;
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    HistogramSnapshot latency;
+    for (auto& worker : workers) {
+        latency.merge(worker->latency());
+    }
+    uint64_t sent = totals.sent - sentBefore;
+    uint64_t delivered = totals.delivered - deliveredBefore;
+    std::cout << "Connections: " << totals.connected << " opened, " << totals.failed << " failed, "
+              << totals.disconnected << " dropped by the server" << std::endl;
+    std::cout << "Operations: " << sent << " chat, " << totals.changes << " CHANGE, " << totals.uploads << " SEND" << std::endl;
+    std::cout << "Throughput: " << static_cast<uint64_t>(sent / elapsed) << " msgs/s in, "
+              << static_cast<uint64_t>(delivered / elapsed) << " deliveries/s out" << std::endl;
+    std::cout << "Fan-out latency: p50 " << formatNanos(latency.quantile(0.5)) << ", p99 " << formatNanos(latency.quantile(0.99))
+              << ", p99.9 " << formatNanos(latency.quantile(0.999)) << ", max " << formatNanos(latency.quantile(1.0))
+              << " (" << latency.count << " deliveries)" << std::endl;
+    return totals.failed > 0 || totals.disconnected > 0 ? 1 : 0;
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "dispatcher.h"
+#include <atomic>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+
+enum class LogLevel {
+    Info,    // to stdout
+    Warning, // to stderr
+    Error    // to stderr
+};
+
+// Asynchronous line logger. The calling thread formats a line into a
+// fixed-size record and pushes it onto a lock-free ring; one background
+// thread writes whatever has piled up with a single fwrite() per stream.
+// Nothing on the calling side locks, allocates or waits for the terminal.
+// When the ring is full the line is dropped and counted.
+class Logger {
+public:
+    static constexpr size_t kLineCapacity = 240; // longer lines are cut short
+    static constexpr size_t kRingCapacity = 8192;
+
+    static Logger& global() {
+        static Logger logger;
+        return logger;
+    }
+
+    template <typename... Parts>
+    void log(LogLevel level, const Parts&... parts) {
+        Record record;
+        record.level = level;
+        (append(record, parts), ...);
+        if (!ring.tryPush(std::move(record))) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        accepted.fetch_add(1, std::memory_order_relaxed);
+        if (level != LogLevel::Info) {
+            wake.notify_one();
+        }
+    }
+
+    uint64_t droppedLines() const {
+        return dropped.load(std::memory_order_relaxed);
+    }
+
+    // Blocks until everything logged so far is written, e.g. before exit()
+    void flush() {
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t target = accepted.load();
+        wake.notify_one();
+        flushed.wait(lock, [this, target]() {
+            return written >= target;
+        });
+    }
+
+    ~Logger() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+    }
+
+private:
+    struct Record {
+        LogLevel level = LogLevel::Info;
+        uint16_t length = 0;
+        char text[kLineCapacity];
+    };
+
+    MpscQueue<Record> ring{kRingCapacity};
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<uint64_t> accepted{0};
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable flushed;
+    uint64_t written = 0;
+    bool stopping = false;
+    std::thread writer;
+
+    Logger() {
+        writer = std::thread([this]() {
+            run();
+        });
+    }
+
+    static void appendBytes(Record& record, const char* data, size_t length) {
+        size_t room = kLineCapacity - record.length;
+        length = std::min(length, room);
+        std::memcpy(record.text + record.length, data, length);
+        record.length += static_cast<uint16_t>(length);
+    }
+
+    static void append(Record& record, std::string_view text) {
+        appendBytes(record, text.data(), text.size());
+    }
+
+    static void append(Record& record, const char* text) {
+        append(record, std::string_view(text));
+    }
+
+    static void append(Record& record, const std::string& text) {
+        append(record, std::string_view(text));
+    }
+
+    static void append(Record& record, const std::filesystem::path& path) {
+        append(record, std::string_view(path.native()));
+    }
+
+    static void append(Record& record, char c) {
+        appendBytes(record, &c, 1);
+    }
+
+    template <typename Number, typename = std::enable_if_t<std::is_arithmetic_v<Number>>>
+    static void append(Record& record, Number value) {
+        char digits[32];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        appendBytes(record, digits, static_cast<size_t>(result.ptr - digits));
+    }
+
+    void run() {
+        std::string out;
+        std::string errors;
+        out.reserve(64 * 1024);
+        errors.reserve(4 * 1024);
+        while (true) {
+            Record record;
+            uint64_t batch = 0;
+            while (ring.tryPop(record)) {
+                std::string& target = record.level == LogLevel::Info ? out : errors;
+                target.append(record.text, record.length);
+                target.push_back('\n');
+                batch++;
+            }
+            ring.publishDequeued();
+            if (!errors.empty()) {
+                std::fwrite(errors.data(), 1, errors.size(), stderr);
+                std::fflush(stderr);
+                errors.clear();
+            }
+            if (!out.empty()) {
+                std::fwrite(out.data(), 1, out.size(), stdout);
+                std::fflush(stdout);
+                out.clear();
+            }
+
+            std::unique_lock<std::mutex> lock(mutex);
+            written += batch;
+            flushed.notify_all();
+            if (batch > 0) {
+                continue;
+            }
+            if (stopping) {
+                return;
+            }
+            // Info lines are picked up on the next tick; warnings wake the writer at once
+            wake.wait_for(lock, std::chrono::milliseconds(10));
+        }
+    }
+};
+
+template <typename... Parts>
+void logInfo(const Parts&... parts) {
+    Logger::global().log(LogLevel::Info, parts...);
+}
+
+template <typename... Parts>
+void logWarning(const Parts&... parts) {
+    Logger::global().log(LogLevel::Warning, parts...);
+}
+
+template <typename... Parts>
+void logError(const Parts&... parts) {
+    Logger::global().log(LogLevel::Error, parts...);
+}
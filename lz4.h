@@ -0,0 +1,322 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// LZ4 block compression: bare blocks in the reference format, without the
+// LZ4 frame format around them. Compresses at several hundred MB/s and
+// decodes faster still, so it can run on every broadcast and file chunk.
+//
+// A block is a run of sequences. Each is a token byte (literal count in the
+// high nibble, match length minus 4 in the low one, 15 meaning more length
+// bytes follow), the literals, then a 2-byte little-endian offset back into
+// the output. The last sequence is literals only. A dictionary is treated as
+// output that came just before the block, so a short chat line can refer to
+// text from earlier messages in its room.
+namespace lz4_detail {
+
+constexpr int kHashBits = 12;
+constexpr size_t kMinMatch = 4;
+constexpr size_t kLastLiterals = 5; // a block always ends with at least this many literals
+constexpr size_t kMatchLimit = 12;  // and no match starts closer than this to its end
+constexpr size_t kMaxOffset = 65535;
+
+inline uint32_t read32(const unsigned char* data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+inline uint64_t read64(const unsigned char* data) {
+    uint64_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+inline uint32_t hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - kHashBits);
+}
+
+inline void writeLength(unsigned char*& out, size_t length) {
+    for (; length >= 255; length -= 255) {
+        *out++ = 255;
+    }
+    *out++ = static_cast<unsigned char>(length);
+}
+
+inline bool readLength(const unsigned char*& in, const unsigned char* end, size_t& length) {
+    unsigned char byte;
+    do {
+        if (in == end) {
+            return false;
+        }
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return true;
+}
+
+} // namespace lz4_detail
+
+// Text both ends prepend to a block, with the compressor's match index over
+// it built once, so compressing against it costs a copy rather than a rescan
+class Lz4Dictionary {
+public:
+    static constexpr size_t kMaxSize = lz4_detail::kMaxOffset;
+    static constexpr size_t kIndexSize = size_t(1) << lz4_detail::kHashBits;
+
+    explicit Lz4Dictionary(std::string content)
+        : content(content.size() > kMaxSize ? content.substr(content.size() - kMaxSize) : std::move(content)),
+          index(new uint32_t[kIndexSize]()) {
+        const auto* data = reinterpret_cast<const unsigned char*>(this->content.data());
+        for (size_t i = 0; i + lz4_detail::kMinMatch <= this->content.size(); i++) {
+            index[lz4_detail::hash(lz4_detail::read32(data + i))] = static_cast<uint32_t>(i);
+        }
+    }
+
+    std::string_view bytes() const {
+        return content;
+    }
+
+    const uint32_t* matchIndex() const {
+        return index.get();
+    }
+
+private:
+    std::string content;
+    std::unique_ptr<uint32_t[]> index;
+};
+
+// Worst-case block size for n input bytes
+constexpr size_t lz4Bound(size_t n) {
+    return n + n / 255 + 16;
+}
+
+// Compresses n bytes into at most `capacity` bytes of dst and returns the
+// block size, or 0 when the block does not fit. Passing a capacity below n
+// is how callers skip data that would not shrink enough: on incompressible
+// input the search speeds up as misses pile up, so finding out is cheap.
+//
+// The hash table is sized to the input, so a short chat line does not pay
+// for clearing one meant for a file chunk. The dictionary is searched
+// through its own index, read-only, beside the table for the input.
+inline size_t lz4Compress(const void* source, size_t n, void* destination, size_t capacity, const Lz4Dictionary* dictionary = nullptr) {
+    using namespace lz4_detail;
+    thread_local uint32_t table[Lz4Dictionary::kIndexSize];
+    int tableBits = 8;
+    while (tableBits < kHashBits && (size_t(1) << tableBits) < n) {
+        tableBits++;
+    }
+    std::memset(table, 0, sizeof(uint32_t) << tableBits);
+
+    const auto* base = static_cast<const unsigned char*>(source);
+    const unsigned char* dict = nullptr;
+    const unsigned char* dictEnd = nullptr;
+    const uint32_t* dictIndex = nullptr;
+    if (dictionary != nullptr && dictionary->bytes().size() >= kMinMatch) {
+        dict = reinterpret_cast<const unsigned char*>(dictionary->bytes().data());
+        dictEnd = dict + dictionary->bytes().size();
+        dictIndex = dictionary->matchIndex();
+    }
+
+    const unsigned char* ip = base;
+    const unsigned char* anchor = ip;
+    const unsigned char* end = ip + n;
+    auto* op = static_cast<unsigned char*>(destination);
+    unsigned char* const outEnd = op + capacity;
+
+    if (n > kMatchLimit) {
+        const unsigned char* const matchStartLimit = end - kMatchLimit;
+        const unsigned char* const matchEndLimit = end - kLastLiterals;
+        unsigned misses = 0;
+        while (ip < matchStartLimit) {
+            uint32_t sequence = read32(ip);
+            uint32_t hashed = sequence * 2654435761u;
+            uint32_t& slot = table[hashed >> (32 - tableBits)];
+            const unsigned char* ref = base + slot;
+            slot = static_cast<uint32_t>(ip - base);
+
+            bool inInput = ref < ip && static_cast<size_t>(ip - ref) <= kMaxOffset && read32(ref) == sequence;
+            bool inDictionary = false;
+            if (!inInput && dict != nullptr) {
+                ref = dict + dictIndex[hashed >> (32 - kHashBits)];
+                inDictionary = static_cast<size_t>(ip - base) + static_cast<size_t>(dictEnd - ref) <= kMaxOffset && read32(ref) == sequence;
+            }
+
+            const unsigned char* matchStart;
+            size_t offset;
+            if (inInput) {
+                while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                    ip--;
+                    ref--;
+                }
+                matchStart = ip;
+                offset = static_cast<size_t>(ip - ref);
+                ip += kMinMatch;
+                ref += kMinMatch;
+                while (ip + 8 <= matchEndLimit && read64(ip) == read64(ref)) {
+                    ip += 8;
+                    ref += 8;
+                }
+                while (ip < matchEndLimit && *ip == *ref) {
+                    ip++;
+                    ref++;
+                }
+            } else if (inDictionary) {
+                // A match in the dictionary may run past its end into the start of the input
+                while (ip > anchor && ref > dict && ip[-1] == ref[-1]) {
+                    ip--;
+                    ref--;
+                }
+                matchStart = ip;
+                offset = static_cast<size_t>(ip - base) + static_cast<size_t>(dictEnd - ref);
+                ip += kMinMatch;
+                ref += kMinMatch;
+                while (ip < matchEndLimit && ref < dictEnd && *ip == *ref) {
+                    ip++;
+                    ref++;
+                }
+                if (ref == dictEnd) {
+                    for (ref = base; ip < matchEndLimit && *ip == *ref;) {
+                        ip++;
+                        ref++;
+                    }
+                }
+            } else {
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            size_t literals = static_cast<size_t>(matchStart - anchor);
+            size_t matchLength = static_cast<size_t>(ip - matchStart) - kMinMatch;
+            if (static_cast<size_t>(outEnd - op) < 1 + literals / 255 + 1 + literals + 2 + matchLength / 255 + 1) {
+                return 0;
+            }
+            unsigned char* token = op++;
+            *token = static_cast<unsigned char>(std::min<size_t>(literals, 15) << 4 | std::min<size_t>(matchLength, 15));
+            if (literals >= 15) {
+                writeLength(op, literals - 15);
+            }
+            std::memcpy(op, anchor, literals);
+            op += literals;
+            *op++ = static_cast<unsigned char>(offset);
+            *op++ = static_cast<unsigned char>(offset >> 8);
+            if (matchLength >= 15) {
+                writeLength(op, matchLength - 15);
+            }
+            anchor = ip;
+            if (ip < matchStartLimit) {
+                table[(read32(ip - 2) * 2654435761u) >> (32 - tableBits)] = static_cast<uint32_t>(ip - 2 - base);
+            }
+        }
+    }
+
+    size_t literals = static_cast<size_t>(end - anchor);
+    if (static_cast<size_t>(outEnd - op) < 1 + literals / 255 + 1 + literals) {
+        return 0;
+    }
+    *op++ = static_cast<unsigned char>(std::min<size_t>(literals, 15) << 4);
+    if (literals >= 15) {
+        writeLength(op, literals - 15);
+    }
+    std::memcpy(op, anchor, literals);
+    op += literals;
+    return static_cast<size_t>(op - static_cast<unsigned char*>(destination));
+}
+
+// Decodes a block that must expand to exactly `length` bytes. Only the
+// dictionary's text is needed here, not its index. Every length and offset
+// is checked against the buffers, so a damaged or hostile block only makes
+// this return false.
+inline bool lz4Decompress(const void* source, size_t n, void* destination, size_t length, std::string_view dictionary = {}) {
+    using namespace lz4_detail;
+    const auto* ip = static_cast<const unsigned char*>(source);
+    const unsigned char* const inEnd = ip + n;
+    auto* op = static_cast<unsigned char*>(destination);
+    unsigned char* const outStart = op;
+    unsigned char* const outEnd = op + length;
+    const auto* dict = reinterpret_cast<const unsigned char*>(dictionary.data());
+    size_t dictSize = dictionary.size();
+
+    while (ip < inEnd) {
+        unsigned token = *ip++;
+        size_t literals = token >> 4;
+        // Short runs with room to spare on both sides are copied as one
+        // fixed 16 bytes; the bytes past the run are overwritten later
+        if (literals < 15 && inEnd - ip >= 16 + 2 && outEnd - op >= 16) {
+            std::memcpy(op, ip, 16);
+            op += literals;
+            ip += literals;
+        } else {
+            if (literals == 15 && !readLength(ip, inEnd, literals)) {
+                return false;
+            }
+            if (literals > static_cast<size_t>(inEnd - ip) || literals > static_cast<size_t>(outEnd - op)) {
+                return false;
+            }
+            std::memcpy(op, ip, literals);
+            op += literals;
+            ip += literals;
+            if (ip == inEnd) {
+                return op == outEnd;
+            }
+            if (inEnd - ip < 2) {
+                return false;
+            }
+        }
+
+        size_t offset = ip[0] | static_cast<size_t>(ip[1]) << 8;
+        ip += 2;
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !readLength(ip, inEnd, matchLength)) {
+            return false;
+        }
+        matchLength += kMinMatch;
+        size_t produced = static_cast<size_t>(op - outStart);
+        if (offset == 0 || offset > produced + dictSize || matchLength > static_cast<size_t>(outEnd - op)) {
+            return false;
+        }
+
+        const unsigned char* ref;
+        if (offset > produced) {
+            // Starts in the dictionary and may run on into the output
+            size_t back = offset - produced;
+            size_t fromDict = std::min(matchLength, back);
+            std::memcpy(op, dict + dictSize - back, fromDict);
+            op += fromDict;
+            matchLength -= fromDict;
+            ref = outStart;
+        } else {
+            ref = op - offset;
+        }
+        // Short matches far enough back are one fixed copy too. An
+        // overlapping match repeats the bytes before it; at 8 or more bytes
+        // back it can still be copied 8 at a time.
+        size_t distance = static_cast<size_t>(op - ref);
+        if (distance >= 16 && matchLength <= 16 && outEnd - op >= 16) {
+            std::memcpy(op, ref, 16);
+            op += matchLength;
+            continue;
+        }
+        if (distance >= matchLength) {
+            std::memcpy(op, ref, matchLength);
+            op += matchLength;
+            continue;
+        }
+        if (distance >= 8) {
+            for (; matchLength >= 8; matchLength -= 8, op += 8, ref += 8) {
+                std::memcpy(op, ref, 8);
+            }
+        }
+        for (; matchLength > 0; matchLength--) {
+            *op++ = *ref++;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,339 @@
+#pragma once
+
+#include "net.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <string_view>
+#include <thread>
+
+enum class Counter {
+    ConnectionsOpened,
+    ConnectionsClosed,
+    FramesIn,
+    BytesIn,
+    BytesOut,
+    ChatMessages,
+    Deliveries,   // chat frames queued to recipients
+    FileBytesIn,  // upload payload accepted
+    FileBytesOut, // download payload queued
+    UploadsCompleted,
+    DownloadsCompleted,
+    DedupHits,       // offers served from the blob store without an upload
+    DedupBytesSaved, // upload bytes those offers did not have to send
+    CompressionBytesSaved, // payload bytes compression kept off the wire, both directions
+    CompressionSkipped,    // payloads sent as they were because they would not shrink enough
+    ChatRejectedClientRate, // chat turned away: its sender was over its rate
+    ChatRejectedRoomRate,   // chat turned away: its room was over its rate
+    ChatShed,               // chat turned away: the dispatch queues were over their byte limit
+    ChatDelayed,            // times a sender's reads were paused to hold it to its limits
+    FanoutChunks,           // pieces that broadcasts to large rooms were split into across the fan-out pool
+    PresenceBatches,        // batched join/leave notices sent to large rooms
+    PresenceEventsBatched,  // joins and leaves those notices stood for
+    Count
+};
+
+enum class Metric {
+    DispatchWaitNs, // chat message accepted -> its room's worker picks it up
+    SendLatencyNs,  // chat message accepted -> written to a recipient's socket
+    FanoutSize,     // recipients per chat message
+    UploadBytesPerSecond,
+    DownloadBytesPerSecond,
+    Count
+};
+
+inline uint64_t monotonicNanos() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Log-linear histogram in the style of HdrHistogram. Values below 64 have a
+// bucket each; above that every power of two is split into 32 buckets, so a
+// recorded value is off by at most 1/32 (~3%). Values past 2^40 share the
+// top bucket. One thread records; any thread may read.
+class Histogram {
+public:
+    static constexpr int kSubBits = 5;
+    static constexpr int kMaxBits = 40;
+    static constexpr size_t kBuckets = (kMaxBits - kSubBits + 1) << kSubBits;
+
+    void record(uint64_t value) {
+        bump(buckets[indexOf(value)], 1);
+        bump(total, value);
+    }
+
+    uint64_t bucket(size_t index) const {
+        return buckets[index].load(std::memory_order_relaxed);
+    }
+
+    uint64_t sum() const {
+        return total.load(std::memory_order_relaxed);
+    }
+
+    static size_t indexOf(uint64_t value) {
+        if (value < (uint64_t(2) << kSubBits)) {
+            return static_cast<size_t>(value);
+        }
+        int top = 63 - __builtin_clzll(value);
+        if (top >= kMaxBits) {
+            return kBuckets - 1;
+        }
+        int shift = top - kSubBits;
+        return (static_cast<size_t>(shift) << kSubBits) + static_cast<size_t>(value >> shift);
+    }
+
+    // Smallest value that lands in the bucket
+    static uint64_t lowestOf(size_t index) {
+        if (index < (size_t(2) << kSubBits)) {
+            return index;
+        }
+        size_t shift = (index >> kSubBits) - 1;
+        return static_cast<uint64_t>(index - (shift << kSubBits)) << shift;
+    }
+
+private:
+    std::array<std::atomic<uint64_t>, kBuckets> buckets{};
+    std::atomic<uint64_t> total{0};
+
+    // Single writer, so a plain load and store is enough and avoids a locked add
+    static void bump(std::atomic<uint64_t>& cell, uint64_t amount) {
+        cell.store(cell.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+};
+
+// Plain copy of one or more histograms, for reading quantiles
+struct HistogramSnapshot {
+    std::array<uint64_t, Histogram::kBuckets> buckets{};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    void merge(const Histogram& histogram) {
+        for (size_t i = 0; i < Histogram::kBuckets; i++) {
+            uint64_t value = histogram.bucket(i);
+            buckets[i] += value;
+            count += value;
+        }
+        sum += histogram.sum();
+    }
+
+    uint64_t quantile(double q) const {
+        if (count == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * static_cast<double>(count) + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < buckets.size(); i++) {
+            seen += buckets[i];
+            if (seen >= rank) {
+                return Histogram::lowestOf(i);
+            }
+        }
+        return Histogram::lowestOf(buckets.size() - 1);
+    }
+};
+
+// Process-wide counters and histograms. Every thread that records gets its
+// own shard on first use, so the hot path never shares a cache line or takes
+// a lock. Shards are linked into a list that only grows; a scrape walks it
+// and adds them up while the threads keep recording.
+class Metrics {
+public:
+    static Metrics& global() {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    void add(Counter counter, uint64_t amount = 1) {
+        std::atomic<uint64_t>& cell = local().counters[static_cast<size_t>(counter)];
+        cell.store(cell.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+
+    void record(Metric metric, uint64_t value) {
+        local().histograms[static_cast<size_t>(metric)].record(value);
+    }
+
+    uint64_t total(Counter counter) const {
+        uint64_t sum = 0;
+        for (const Shard* shard = shards.load(std::memory_order_acquire); shard != nullptr; shard = shard->next) {
+            sum += shard->counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+        }
+        return sum;
+    }
+
+    // Merged over all threads
+    HistogramSnapshot snapshot(Metric metric) const {
+        HistogramSnapshot merged;
+        for (const Shard* shard = shards.load(std::memory_order_acquire); shard != nullptr; shard = shard->next) {
+            merged.merge(shard->histograms[static_cast<size_t>(metric)]);
+        }
+        return merged;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::array<std::atomic<uint64_t>, static_cast<size_t>(Counter::Count)> counters{};
+        std::array<Histogram, static_cast<size_t>(Metric::Count)> histograms;
+        Shard* next = nullptr;
+    };
+
+    std::atomic<Shard*> shards{nullptr};
+
+    Metrics() = default;
+
+    // Shards outlive their threads so a scrape never reads freed memory
+    Shard& local() {
+        thread_local Shard* shard = nullptr;
+        if (shard == nullptr) {
+            shard = new Shard();
+            Shard* head = shards.load(std::memory_order_relaxed);
+            do {
+                shard->next = head;
+            } while (!shards.compare_exchange_weak(head, shard, std::memory_order_release, std::memory_order_relaxed));
+        }
+        return *shard;
+    }
+};
+
+inline void countMetric(Counter counter, uint64_t amount = 1) {
+    Metrics::global().add(counter, amount);
+}
+
+inline void recordMetric(Metric metric, uint64_t value) {
+    Metrics::global().record(metric, value);
+}
+
+// Serves the metrics as plain text (Prometheus exposition format) to any
+// HTTP GET on a loopback port. Runs on its own thread with blocking
+// sockets; scrapes are rare and never touch the event loops.
+class MetricsEndpoint {
+public:
+    using Extra = std::function<void(std::string&)>; // appends server-specific gauges
+
+    // `inherited` is the listening socket of a process being taken over, used instead of binding the port
+    MetricsEndpoint(int port, Extra extra, SOCKET inherited = INVALID_SOCKET) : extra(std::move(extra)) {
+        if (inherited != INVALID_SOCKET) {
+            listener = inherited;
+            std::thread([this]() {
+                serve();
+            }).detach();
+            return;
+        }
+        listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        if (listener == INVALID_SOCKET || bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == SOCKET_ERROR ||
+            listen(listener, 16) == SOCKET_ERROR) {
+            if (listener != INVALID_SOCKET) {
+                closesocket(listener);
+            }
+            listener = INVALID_SOCKET;
+            return;
+        }
+        std::thread([this]() {
+            serve();
+        }).detach();
+    }
+
+    bool listening() const {
+        return listener != INVALID_SOCKET;
+    }
+
+    SOCKET getListener() const {
+        return listener;
+    }
+
+    std::string render() const {
+        static const char* counterNames[] = {
+            "chat_connections_opened_total", "chat_connections_closed_total", "chat_frames_in_total", "chat_bytes_in_total",
+            "chat_bytes_out_total", "chat_messages_total", "chat_deliveries_total", "chat_file_bytes_in_total",
+            "chat_file_bytes_out_total", "chat_uploads_completed_total", "chat_downloads_completed_total",
+            "chat_dedup_hits_total", "chat_dedup_bytes_saved_total", "chat_compression_bytes_saved_total",
+            "chat_compression_skipped_total", "chat_rejected_client_rate_total", "chat_rejected_room_rate_total",
+            "chat_shed_total", "chat_delayed_total", "chat_fanout_chunks_total", "chat_presence_batches_total",
+            "chat_presence_events_batched_total",
+        };
+        static const char* metricNames[] = {
+            "chat_dispatch_wait_ns", "chat_send_latency_ns", "chat_fanout_size", "chat_upload_bytes_per_second",
+            "chat_download_bytes_per_second",
+        };
+        static_assert(std::size(counterNames) == static_cast<size_t>(Counter::Count));
+        static_assert(std::size(metricNames) == static_cast<size_t>(Metric::Count));
+
+        const Metrics& metrics = Metrics::global();
+        std::string out;
+        for (size_t i = 0; i < std::size(counterNames); i++) {
+            appendSample(out, counterNames[i], "counter", "", metrics.total(static_cast<Counter>(i)));
+        }
+        for (size_t i = 0; i < std::size(metricNames); i++) {
+            HistogramSnapshot snapshot = metrics.snapshot(static_cast<Metric>(i));
+            std::string name = metricNames[i];
+            out += "# TYPE " + name + " summary\n";
+            for (auto [label, quantile] : {std::pair{"0.5", 0.5}, {"0.9", 0.9}, {"0.99", 0.99}, {"0.999", 0.999}}) {
+                appendSample(out, name, nullptr, std::string("{quantile=\"") + label + "\"}", snapshot.quantile(quantile));
+            }
+            appendSample(out, name + "_sum", nullptr, "", snapshot.sum);
+            appendSample(out, name + "_count", nullptr, "", snapshot.count);
+        }
+        if (extra) {
+            extra(out);
+        }
+        return out;
+    }
+
+    static void appendSample(std::string& out, const std::string& name, const char* type, const std::string& labels, uint64_t value) {
+        if (type != nullptr) {
+            out += "# TYPE " + name + " " + type + "\n";
+        }
+        out += name + labels + " " + std::to_string(value) + "\n";
+    }
+
+private:
+    SOCKET listener;
+    Extra extra;
+
+    void serve() {
+        while (true) {
+            SOCKET client = accept(listener, nullptr, nullptr);
+            if (client == INVALID_SOCKET) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                return;
+            }
+            timeval timeout{1, 0};
+            setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+            // Whatever the request says, the answer is the metrics page
+            std::string request;
+            char buffer[1024];
+            while (request.find("\r\n\r\n") == std::string::npos && request.size() < 8192) {
+                ssize_t got = recv(client, buffer, sizeof(buffer), 0);
+                if (got <= 0) {
+                    break;
+                }
+                request.append(buffer, static_cast<size_t>(got));
+            }
+
+            std::string body = render();
+            std::string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                                   std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+            for (size_t sent = 0; sent < response.size();) {
+                ssize_t written = send(client, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+                if (written <= 0) {
+                    break;
+                }
+                sent += static_cast<size_t>(written);
+            }
+            closesocket(client);
+        }
+    }
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#include <Ws2tcpip.h>
+
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <cerrno>
+
+using SOCKET = int;
+constexpr SOCKET INVALID_SOCKET = -1;
+constexpr int SOCKET_ERROR = -1;
+
+inline int closesocket(SOCKET socket) {
+    return ::close(socket);
+}
+
+inline int WSAGetLastError() {
+    return errno;
+}
+#endif
+
+// Winsock needs to be started before the first socket call; POSIX does not
+inline bool netStartup() {
+#ifdef _WIN32
+    WSADATA wsaData;
+    return WSAStartup(MAKEWORD(2, 2), &wsaData) == 0;
+#else
+    return true;
+#endif
+}
+
+inline void netCleanup() {
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+inline bool setNonBlocking(SOCKET socket) {
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(socket, FIONBIO, &mode) == 0;
+#else
+    int flags = fcntl(socket, F_GETFL, 0);
+    return flags != -1 && fcntl(socket, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+// A peer that has gone away makes send() fail instead of raising SIGPIPE
+#ifdef _WIN32
+constexpr int kSendFlags = 0;
+#else
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#endif
+
+inline int pollSockets(pollfd* sockets, size_t count, int timeoutMs) {
+#ifdef _WIN32
+    return WSAPoll(sockets, static_cast<ULONG>(count), timeoutMs);
+#else
+    return ::poll(sockets, static_cast<nfds_t>(count), timeoutMs);
+#endif
+}
+
+// True when the last socket call failed only because it would have blocked
+inline bool wouldBlock() {
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
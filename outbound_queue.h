@@ -0,0 +1,309 @@
+#pragma once
+
+#include "net.h"
+#include "buffer_pool.h"
+#include "file_relay.h"
+#include "metrics.h"
+#include <sys/uio.h>
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// What to do with a client that does not read fast enough to keep its
+// outbound queue under the high watermark
+enum class SlowConsumerPolicy {
+    DropOldestChat, // shed queued chat frames, keep control and file frames
+    Disconnect
+};
+
+struct OutboundLimits {
+    size_t highWatermark = 256 * 1024;
+    size_t lowWatermark = 64 * 1024;
+    size_t hardLimit = 4 * 1024 * 1024; // never buffer more than this, whatever the policy
+    SlowConsumerPolicy policy = SlowConsumerPolicy::DropOldestChat;
+};
+
+enum class PushResult {
+    Queued,
+    Overflow // the connection should be dropped
+};
+
+enum class FlushResult {
+    Drained,
+    Partial,
+    Error
+};
+
+// FIFO over a circular array that only ever grows. Unlike std::deque, which
+// allocates and frees a block every few dozen entries as the queue moves,
+// a connection's steady stream of frames keeps reusing the same slots.
+template <typename T>
+class SlotRing {
+public:
+    bool empty() const {
+        return count == 0;
+    }
+
+    size_t size() const {
+        return count;
+    }
+
+    T& operator[](size_t index) {
+        return slots[(head + index) & (slots.size() - 1)];
+    }
+
+    T& front() {
+        return slots[head];
+    }
+
+    void push_back(T&& value) {
+        if (count == slots.size()) {
+            grow();
+        }
+        (*this)[count++] = std::move(value);
+    }
+
+    void pop_front() {
+        slots[head] = T();
+        head = (head + 1) & (slots.size() - 1);
+        count--;
+    }
+
+    // Drops everything from `index` on
+    void truncate(size_t index) {
+        while (count > index) {
+            (*this)[--count] = T();
+        }
+    }
+
+private:
+    std::vector<T> slots;
+    size_t head = 0;
+    size_t count = 0;
+
+    void grow() {
+        std::vector<T> larger(slots.empty() ? 16 : slots.size() * 2);
+        for (size_t i = 0; i < count; i++) {
+            larger[i] = std::move((*this)[i]);
+        }
+        slots = std::move(larger);
+        head = 0;
+    }
+};
+
+// Frames waiting to be written to one socket. Not thread-safe; the owning
+// Connection serializes access. Entries are references to shared frames, so
+// a broadcast costs each recipient a pointer, not a copy. flush() hands as
+// many queued frames as fit to a single sendmsg() call. File data is queued
+// as (file, offset, length) segments and written with sendfile(), so it is
+// never copied into user space.
+class OutboundQueue {
+public:
+    static constexpr int kMaxBatch = 64;
+
+    explicit OutboundQueue(const OutboundLimits& limits) : limits(limits) {}
+
+    PushResult push(FrameRef frame, bool droppable) {
+        queuedBytes += frame->size();
+        entries.push_back({std::move(frame), nullptr, 0, 0, droppable});
+        return checkLimits();
+    }
+
+    // Queues a frame header followed by a file range. File segments are paced
+    // by their producer through the watermarks, so only the hard limit applies.
+    PushResult pushFile(FrameRef header, std::shared_ptr<FileHandle> file, uint64_t offset, size_t length) {
+        queuedBytes += header->size() + length;
+        entries.push_back({std::move(header), nullptr, 0, 0, false});
+        entries.push_back({FrameRef(), std::move(file), offset, length, false});
+        return queuedBytes > limits.hardLimit ? PushResult::Overflow : PushResult::Queued;
+    }
+
+    // File data already in memory (streamed or compressed chunks), paced the
+    // same way as pushFile(): only the hard limit applies, and queued chat
+    // is never shed to make room for it
+    PushResult pushData(FrameRef frame) {
+        queuedBytes += frame->size();
+        entries.push_back({std::move(frame), nullptr, 0, 0, false});
+        return queuedBytes > limits.hardLimit ? PushResult::Overflow : PushResult::Queued;
+    }
+
+    FlushResult flush(SOCKET socket) {
+        while (!entries.empty()) {
+            Entry& front = entries.front();
+            ssize_t written;
+            if (front.file) {
+                written = sendFileRange(socket, *front.file, front.fileOffset + headOffset, front.size() - headOffset);
+            } else {
+                written = writeFrames(socket);
+            }
+
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return wouldBlock() ? FlushResult::Partial : FlushResult::Error;
+            }
+            if (written == 0 && front.file) {
+                return FlushResult::Error; // file shrank underneath us
+            }
+            completed(static_cast<size_t>(written));
+        }
+        return FlushResult::Drained;
+    }
+
+    // For writers that issue the send themselves (io_uring): the leading run
+    // of in-memory frames as at most kMaxBatch iovecs, and then how much of
+    // it went out. Those frames are pinned until completed() or unpin():
+    // shedding skips them, so the iovecs stay valid while the kernel reads them.
+    int gather(iovec* batch) {
+        int count = 0;
+        for (; static_cast<size_t>(count) < entries.size() && count < kMaxBatch && !entries[count].file; count++) {
+            const FrameRef& frame = entries[count].frame;
+            size_t skip = count == 0 ? headOffset : 0;
+            batch[count].iov_base = const_cast<char*>(frame->bytes().data() + skip);
+            batch[count].iov_len = frame->size() - skip;
+        }
+        pinned = static_cast<size_t>(count);
+        return count;
+    }
+
+    void completed(size_t written) {
+        countMetric(Counter::BytesOut, static_cast<uint64_t>(written));
+        consume(written);
+        pinned = 0;
+    }
+
+    // The send over the gathered frames ended without writing anything
+    void unpin() {
+        pinned = 0;
+    }
+
+    bool frontIsFile() {
+        return !entries.empty() && entries.front().file != nullptr;
+    }
+
+    bool empty() const {
+        return entries.empty();
+    }
+
+    size_t bytes() const {
+        return queuedBytes;
+    }
+
+    bool aboveHighWatermark() const {
+        return queuedBytes > limits.highWatermark;
+    }
+
+    bool belowLowWatermark() const {
+        return queuedBytes <= limits.lowWatermark;
+    }
+
+    uint64_t droppedFrames() const {
+        return dropped;
+    }
+
+    // Appends every byte not yet written, file segments included, and
+    // empties the queue. False if a file segment could not be read.
+    bool unsent(std::string& out) {
+        bool complete = true;
+        for (size_t i = 0; i < entries.size(); i++) {
+            Entry& entry = entries[i];
+            size_t skip = i == 0 ? headOffset : 0;
+            if (entry.file) {
+                size_t start = out.size();
+                out.resize(start + entry.fileLength - skip);
+                complete = entry.file->read(entry.fileOffset + skip, &out[start], entry.fileLength - skip) && complete;
+            } else {
+                out.append(entry.frame->bytes(), skip, std::string::npos);
+            }
+        }
+        entries.truncate(0);
+        headOffset = 0;
+        queuedBytes = 0;
+        pinned = 0;
+        return complete;
+    }
+
+private:
+    struct Entry {
+        FrameRef frame;
+        std::shared_ptr<FileHandle> file; // set for sendfile() segments
+        uint64_t fileOffset;
+        size_t fileLength;
+        bool droppable;
+
+        size_t size() const {
+            return file ? fileLength : frame->size();
+        }
+    };
+
+    const OutboundLimits& limits;
+    SlotRing<Entry> entries;
+    size_t headOffset = 0; // bytes of the front entry already written
+    size_t pinned = 0;     // leading entries handed to a send still in flight, see gather()
+    size_t queuedBytes = 0;
+    uint64_t dropped = 0;
+
+    PushResult checkLimits() {
+        if (queuedBytes > limits.highWatermark) {
+            if (limits.policy == SlowConsumerPolicy::Disconnect) {
+                return PushResult::Overflow;
+            }
+            shed();
+        }
+        return queuedBytes > limits.hardLimit ? PushResult::Overflow : PushResult::Queued;
+    }
+
+    // Gathers the leading run of in-memory frames into one sendmsg()
+    ssize_t writeFrames(SOCKET socket) {
+        iovec batch[kMaxBatch];
+        msghdr message{};
+        message.msg_iov = batch;
+        message.msg_iovlen = gather(batch);
+        ssize_t written = sendmsg(socket, &message, MSG_NOSIGNAL);
+        pinned = 0; // the kernel is done with the iovecs either way
+        return written;
+    }
+
+    void consume(size_t written) {
+        queuedBytes -= written;
+        uint64_t now = 0;
+        while (written > 0) {
+            Entry& front = entries.front();
+            size_t remaining = front.size() - headOffset;
+            if (written < remaining) {
+                headOffset += written;
+                return;
+            }
+            written -= remaining;
+            headOffset = 0;
+            if (front.frame && front.frame->enqueuedAt() != 0) {
+                now = now != 0 ? now : monotonicNanos();
+                recordMetric(Metric::SendLatencyNs, now - front.frame->enqueuedAt());
+            }
+            entries.pop_front();
+        }
+    }
+
+    // Drops the oldest chat frames until the queue is back under the low
+    // watermark. A partially written front frame, and frames a send in
+    // flight is still reading, are never dropped.
+    void shed() {
+        size_t kept = std::max<size_t>(pinned, headOffset > 0 ? 1 : 0);
+        for (size_t i = kept; i < entries.size(); i++) {
+            Entry& entry = entries[i];
+            if (entry.droppable && queuedBytes > limits.lowWatermark) {
+                queuedBytes -= entry.size();
+                dropped++;
+                continue;
+            }
+            if (kept != i) {
+                entries[kept] = std::move(entry);
+            }
+            kept++;
+        }
+        entries.truncate(kept);
+    }
+};
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Joins and leaves in a large room, gathered over a short window and
+// announced in one notice instead of one each: during a reconnect wave every
+// member would otherwise be sent a notice for every other member. A member
+// who joins and leaves (or leaves and comes back) within one window is not
+// announced at all.
+struct PresenceNotice {
+    // Names listed per side; past this only the count is given
+    static constexpr size_t kNamedMembers = 3;
+
+    struct Member {
+        uint64_t sessionId;
+        std::string name;
+    };
+
+    std::string text;               // empty when everything in the batch cancelled out
+    std::vector<Member> joins;      // in arrival order
+    std::vector<Member> leaves;
+    std::vector<uint64_t> sessions; // sorted; the members the batch is about
+
+    bool about(uint64_t sessionId) const {
+        return std::binary_search(sessions.begin(), sessions.end(), sessionId);
+    }
+
+    // What a member the batch is about is sent: the notice without its own
+    // entry, so members who join in the same window still hear of each
+    // other. Empty when its own event was the only one.
+    std::string textFor(uint64_t sessionId) const {
+        return compose(sessionId);
+    }
+
+    // "alice has joined the room." for a single event, otherwise e.g.
+    // "+2 joined (alice, bob), -12 left". Session 0 is never skipped.
+    std::string compose(uint64_t skip) const {
+        std::vector<const std::string*> joinNames;
+        std::vector<const std::string*> leaveNames;
+        size_t joinCount = side(joins, skip, joinNames);
+        size_t leaveCount = side(leaves, skip, leaveNames);
+        if (joinCount + leaveCount == 1) {
+            return joinCount == 1 ? *joinNames[0] + " has joined the room." : *leaveNames[0] + " has left the room.";
+        }
+        std::string notice;
+        append(notice, "+", joinCount, joinNames, " joined");
+        append(notice, "-", leaveCount, leaveNames, " left");
+        return notice;
+    }
+
+private:
+    // Counts one side without `skip`, collecting only as many names as could be listed
+    static size_t side(const std::vector<Member>& members, uint64_t skip, std::vector<const std::string*>& names) {
+        size_t count = 0;
+        for (const Member& member : members) {
+            if (skip != 0 && member.sessionId == skip) {
+                continue;
+            }
+            if (count++ < kNamedMembers) {
+                names.push_back(&member.name);
+            }
+        }
+        return count;
+    }
+
+    static void append(std::string& notice, const char* sign, size_t count, const std::vector<const std::string*>& names, const char* what) {
+        if (count == 0) {
+            return;
+        }
+        if (!notice.empty()) {
+            notice += ", ";
+        }
+        notice += sign + std::to_string(count) + what;
+        if (count <= kNamedMembers) {
+            notice += " (";
+            for (size_t i = 0; i < names.size(); i++) {
+                notice += (i > 0 ? ", " : "") + *names[i];
+            }
+            notice += ")";
+        }
+    }
+};
+
+class PresenceBatch {
+public:
+    // Any thread. True when this starts a new batch, which the caller then
+    // schedules to be announced at the end of the window.
+    bool joined(uint64_t sessionId, std::string name) {
+        return add(sessionId, std::move(name), true);
+    }
+
+    bool left(uint64_t sessionId, std::string name) {
+        return add(sessionId, std::move(name), false);
+    }
+
+    // True while a batch is waiting; events then join it whatever the room's size
+    bool pending() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return scheduled;
+    }
+
+    // Ends the batch and returns its notice
+    PresenceNotice take() {
+        std::vector<Event> taken;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            taken.swap(events);
+            latest.clear();
+            scheduled = false;
+        }
+
+        PresenceNotice notice;
+        for (Event& event : taken) {
+            if (!event.cancelled) {
+                (event.joined ? notice.joins : notice.leaves).push_back({event.sessionId, std::move(event.name)});
+                if (event.sessionId != 0) {
+                    notice.sessions.push_back(event.sessionId);
+                }
+            }
+        }
+        std::sort(notice.sessions.begin(), notice.sessions.end());
+        notice.text = notice.compose(0);
+        return notice;
+    }
+
+private:
+    struct Event {
+        uint64_t sessionId;
+        std::string name;
+        bool joined;
+        bool cancelled;
+    };
+
+    std::mutex mutex;
+    std::vector<Event> events; // in arrival order, for the names
+    std::unordered_map<uint64_t, size_t> latest; // session -> its uncancelled event
+    bool scheduled = false;
+
+    // Session 0 is a member of another node, known by name only; its events never cancel
+    bool add(uint64_t sessionId, std::string name, bool joined) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = sessionId != 0 ? latest.find(sessionId) : latest.end();
+        if (it != latest.end() && events[it->second].joined != joined) {
+            events[it->second].cancelled = true;
+            latest.erase(it);
+        } else {
+            if (sessionId != 0) {
+                latest[sessionId] = events.size();
+            }
+            events.push_back({sessionId, std::move(name), joined, false});
+        }
+        bool first = !scheduled;
+        scheduled = true;
+        return first;
+    }
+};
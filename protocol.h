@@ -0,0 +1,288 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Wire format shared by the server and the client. Every message is a frame:
+//
+//   +--------+--------+-----------------+---------------------------+
+//   | type   | flags  | reserved (0)    | payload length            |
+//   | 1 byte | 1 byte | 2 bytes         | 4 bytes, big-endian       |
+//   +--------+--------+-----------------+---------------------------+
+//   | payload (length bytes)                                        |
+//   +---------------------------------------------------------------+
+//
+// so message boundaries no longer depend on how recv() happens to split the stream.
+enum class FrameType : uint8_t {
+    Hello = 1,       // client -> server: user name
+    Join = 2,        // client -> server: room ID
+    Chat = 3,        // client -> server: text; server -> client: "name: text"
+    Change = 4,      // client -> server: new room ID
+    Exit = 5,        // client -> server: leave and disconnect
+    FileOffer = 6,   // client -> server: u64 size, [32-byte SHA-256 if kOfferHashed], then file name
+    FileData = 7,    // client -> server: u64 offset, u32 CRC-32C, bytes; server -> client: bytes
+    Accept = 8,      // client -> server: accept offered files, optional u64 transfer ID and u64 resume offset
+    Decline = 9,     // client -> server: decline offered files, optional u64 transfer ID
+    Notice = 10,     // server -> client: joins, leaves, prompts
+    FileBegin = 11,  // server -> client: u64 size, u64 starting offset, u64 transfer ID, then file name
+    AllReceived = 12, // server -> client: every recipient has the upload
+    FileResume = 13, // client -> server: u64 transfer ID of an interrupted upload
+    FileAck = 14,    // server -> client: u64 transfer ID, u64 offset to (re)send the upload from
+    FileEnd = 15,    // server -> client: u64 transfer ID, u32 CRC-32C of the whole file
+    Dictionary = 16  // server -> client: u32 dictionary ID, then a room's chat dictionary
+};
+
+// FileOffer flag: the offer carries the file's SHA-256, and a FileAck at the
+// file's full size means the server already has it and nothing is uploaded
+constexpr uint8_t kOfferHashed = 0x01;
+constexpr size_t kSha256Size = 32;
+
+// Hello flag. From the client: it reads compressed frames. The server
+// answers with an empty Hello carrying the same flag if it will send them,
+// and only then may the client compress its uploads.
+constexpr uint8_t kHelloCompression = 0x01;
+
+// Chat and FileData flags. The payload (for an uploaded FileData, what
+// follows the offset and checksum) is a u32 decoded size and one LZ4 block.
+// With kDictionaryCompressed the block refers to a room dictionary, whose
+// u32 ID comes first; the dictionary arrives in a Dictionary frame before
+// any chat that uses it.
+constexpr uint8_t kCompressed = 0x02;
+constexpr uint8_t kDictionaryCompressed = 0x04;
+
+constexpr size_t kFrameHeaderSize = 8;
+constexpr uint32_t kMaxFramePayload = 16 * 1024 * 1024;
+constexpr uint32_t kMaxControlPayload = 64 * 1024; // names, room IDs, chat and commands; only file data may be larger
+constexpr size_t kFileChunkSize = 16 * 1024;
+constexpr size_t kFileDataHeaderSize = 12; // offset and checksum ahead of uploaded bytes
+
+inline bool isKnownFrameType(uint8_t type) {
+    return type >= static_cast<uint8_t>(FrameType::Hello) && type <= static_cast<uint8_t>(FrameType::Dictionary);
+}
+
+inline void putU16(std::string& out, uint16_t value) {
+    out.push_back(static_cast<char>(value >> 8));
+    out.push_back(static_cast<char>(value & 0xFF));
+}
+
+inline void putU32(std::string& out, uint32_t value) {
+    char bytes[4];
+    for (int i = 3; i >= 0; i--) {
+        bytes[i] = static_cast<char>(value & 0xFF);
+        value >>= 8;
+    }
+    out.append(bytes, sizeof(bytes));
+}
+
+// The same, into a buffer that already has room for it
+inline void storeU32(char* out, uint32_t value) {
+    for (int i = 3; i >= 0; i--) {
+        out[i] = static_cast<char>(value & 0xFF);
+        value >>= 8;
+    }
+}
+
+inline void putU64(std::string& out, uint64_t value) {
+    putU32(out, static_cast<uint32_t>(value >> 32));
+    putU32(out, static_cast<uint32_t>(value));
+}
+
+inline uint16_t getU16(const char* data) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+    return static_cast<uint16_t>((bytes[0] << 8) | bytes[1]);
+}
+
+inline uint32_t getU32(const char* data) {
+    const auto* bytes = reinterpret_cast<const unsigned char*>(data);
+    return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]);
+}
+
+inline uint64_t getU64(const char* data) {
+    return (uint64_t(getU32(data)) << 32) | getU32(data + 4);
+}
+
+// Appends one complete frame, so several can be batched into a single send()
+inline void appendFrame(std::string& out, FrameType type, std::string_view payload, uint8_t flags = 0) {
+    out.push_back(static_cast<char>(type));
+    out.push_back(static_cast<char>(flags));
+    out.push_back(0);
+    out.push_back(0);
+    putU32(out, static_cast<uint32_t>(payload.size()));
+    out.append(payload.data(), payload.size());
+}
+
+inline std::string encodeFrame(FrameType type, std::string_view payload = {}, uint8_t flags = 0) {
+    std::string out;
+    out.reserve(kFrameHeaderSize + payload.size());
+    appendFrame(out, type, payload, flags);
+    return out;
+}
+
+// Byte ring that receives straight from the socket. Positions only grow, so
+// read and write offsets are taken modulo the (power of two) capacity.
+class RingBuffer {
+public:
+    explicit RingBuffer(size_t capacity = 8 * 1024) {
+        allocate(roundUp(capacity));
+    }
+
+    // Largest contiguous free region, handed directly to recv()
+    char* writePointer() {
+        return data.get() + (writePos & mask);
+    }
+
+    size_t writableContiguous() const {
+        size_t offset = writePos & mask;
+        return std::min(capacity - size(), capacity - offset);
+    }
+
+    void commit(size_t count) {
+        writePos += count;
+    }
+
+    size_t size() const {
+        return static_cast<size_t>(writePos - readPos);
+    }
+
+    bool full() const {
+        return size() == capacity;
+    }
+
+    size_t getCapacity() const {
+        return capacity;
+    }
+
+    // Returns a pointer to count readable bytes at offset when they do not wrap
+    const char* contiguous(size_t offset, size_t count) const {
+        size_t start = (readPos + offset) & mask;
+        if (start + count > capacity) {
+            return nullptr;
+        }
+        return data.get() + start;
+    }
+
+    void copyOut(size_t offset, char* dest, size_t count) const {
+        size_t start = (readPos + offset) & mask;
+        size_t first = std::min(count, capacity - start);
+        memcpy(dest, data.get() + start, first);
+        memcpy(dest + first, data.get(), count - first);
+    }
+
+    void consume(size_t count) {
+        readPos += count;
+        if (readPos == writePos) {
+            // Rewind so the next recv() gets the whole buffer in one piece
+            readPos = writePos = 0;
+        }
+    }
+
+    // Grows to hold at least minCapacity bytes, unwrapping the pending data
+    void reserve(size_t minCapacity) {
+        if (minCapacity <= capacity) {
+            return;
+        }
+        size_t pending = size();
+        std::unique_ptr<char[]> old = std::move(data);
+        size_t oldCapacity = capacity;
+        size_t oldStart = readPos & mask;
+        allocate(roundUp(minCapacity));
+
+        size_t first = std::min(pending, oldCapacity - oldStart);
+        memcpy(data.get(), old.get() + oldStart, first);
+        memcpy(data.get() + first, old.get(), pending - first);
+        readPos = 0;
+        writePos = pending;
+    }
+
+private:
+    std::unique_ptr<char[]> data;
+    size_t capacity = 0;
+    size_t mask = 0;
+    uint64_t readPos = 0;
+    uint64_t writePos = 0;
+
+    static size_t roundUp(size_t value) {
+        size_t result = 1024;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    void allocate(size_t size) {
+        data.reset(new char[size]);
+        capacity = size;
+        mask = size - 1;
+    }
+};
+
+struct Frame {
+    FrameType type;
+    uint8_t flags;
+    std::string_view payload;
+};
+
+enum class ParseResult {
+    Ok,
+    BadFrame
+};
+
+// Pulls complete frames out of a RingBuffer. Payloads are views into the ring
+// itself; only a frame that straddles the wrap point is copied into scratch.
+// Views are valid until the callback returns.
+class FrameParser {
+public:
+    template <typename Callback>
+    ParseResult parse(RingBuffer& ring, Callback&& onFrame) {
+        return parse(ring, std::forward<Callback>(onFrame), [](FrameType) {
+            return kMaxFramePayload;
+        });
+    }
+
+    // maxPayload(type) is the longest payload accepted for the next frame,
+    // asked again for every frame so it can follow the connection's state.
+    // A longer one is a BadFrame before any room is reserved for it.
+    template <typename Callback, typename Limit>
+    ParseResult parse(RingBuffer& ring, Callback&& onFrame, Limit&& maxPayload) {
+        while (ring.size() >= kFrameHeaderSize) {
+            char header[kFrameHeaderSize];
+            ring.copyOut(0, header, kFrameHeaderSize);
+
+            uint8_t type = static_cast<uint8_t>(header[0]);
+            uint32_t length = getU32(header + 4);
+            if (!isKnownFrameType(type) || length > std::min<uint32_t>(maxPayload(static_cast<FrameType>(type)), kMaxFramePayload)) {
+                return ParseResult::BadFrame;
+            }
+
+            size_t total = kFrameHeaderSize + length;
+            if (ring.size() < total) {
+                // Make room for the rest of this frame before the next recv()
+                ring.reserve(total);
+                break;
+            }
+
+            const char* payload = ring.contiguous(kFrameHeaderSize, length);
+            if (payload == nullptr) {
+                scratch.resize(length);
+                ring.copyOut(kFrameHeaderSize, &scratch[0], length);
+                payload = scratch.data();
+            }
+
+            Frame frame{static_cast<FrameType>(type), static_cast<uint8_t>(header[1]), std::string_view(payload, length)};
+            bool keepGoing = onFrame(frame);
+            ring.consume(total);
+            if (!keepGoing) {
+                break;
+            }
+        }
+        return ParseResult::Ok;
+    }
+
+private:
+    std::string scratch;
+};
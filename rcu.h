@@ -0,0 +1,156 @@
+#pragma once
+
+#include "logger.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Epoch-based reclamation for read-mostly structures. Readers announce the
+// epoch they started in and never block; writers publish a new version with
+// an atomic pointer swap and retire the old one, which is freed once every
+// reader that could still see it has left its read section. There is one
+// domain per process so every thread needs only a single reader slot.
+class EpochDomain {
+public:
+    // Reader slots, one per thread that has ever read: at least this many,
+    // and kReadersPerCore for every hardware thread, which covers the event
+    // loops, dispatch workers and fan-out threads the server starts per core
+    static constexpr size_t kMinReaders = 256;
+    static constexpr size_t kReadersPerCore = 4;
+
+    static EpochDomain& global() {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    // RAII read-side section; nests freely on one thread
+    class ReadGuard {
+    public:
+        explicit ReadGuard(EpochDomain& domain) : domain(domain) {
+            domain.enter();
+        }
+
+        ~ReadGuard() {
+            domain.leave();
+        }
+
+        ReadGuard(const ReadGuard&) = delete;
+        ReadGuard& operator=(const ReadGuard&) = delete;
+
+    private:
+        EpochDomain& domain;
+    };
+
+    ReadGuard read() {
+        return ReadGuard(*this);
+    }
+
+    // Schedules deleter to run once no reader can still hold the old version
+    void retire(std::function<void()> deleter) {
+        uint64_t retiredAt = globalEpoch.fetch_add(1);
+        std::lock_guard<std::mutex> lock(retireMutex);
+        retiredList.emplace_back(retiredAt, std::move(deleter));
+        if (retiredList.size() >= 32) {
+            reclaim();
+        }
+    }
+
+private:
+    struct alignas(64) ReaderSlot {
+        std::atomic<bool> owned{false};
+        std::atomic<uint64_t> epoch{0}; // 0 while the owner is outside a read section
+    };
+
+    struct ThreadState {
+        EpochDomain* domain = nullptr;
+        size_t slot = 0;
+        int depth = 0;
+
+        ~ThreadState() {
+            if (domain != nullptr) {
+                domain->slots[slot].owned.store(false, std::memory_order_release);
+            }
+        }
+    };
+
+    EpochDomain()
+        : slotCount(std::max<size_t>(kMinReaders, kReadersPerCore * std::thread::hardware_concurrency())),
+          slots(new ReaderSlot[slotCount]) {}
+
+    ~EpochDomain() {
+        for (auto& retired : retiredList) {
+            retired.second();
+        }
+    }
+
+    std::atomic<uint64_t> globalEpoch{1};
+    const size_t slotCount;
+    std::unique_ptr<ReaderSlot[]> slots;
+    std::mutex retireMutex;
+    std::vector<std::pair<uint64_t, std::function<void()>>> retiredList;
+
+    ThreadState& threadState() {
+        thread_local ThreadState state;
+        if (state.domain == nullptr) {
+            state.slot = claimSlot();
+            state.domain = this;
+        }
+        return state;
+    }
+
+    // Slots are freed when their thread exits; running out means more
+    // threads are reading at once than the domain was sized for
+    size_t claimSlot() {
+        for (size_t i = 0; i < slotCount; i++) {
+            bool expected = false;
+            if (!slots[i].owned.load(std::memory_order_relaxed) &&
+                slots[i].owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) {
+                return i;
+            }
+        }
+        logError("All ", slotCount, " epoch reader slots are taken; too many threads for this machine's ",
+                 std::thread::hardware_concurrency(), " cores (fewer --loops, --dispatch-threads or --fanout-threads)");
+        Logger::global().flush();
+        std::exit(EXIT_FAILURE);
+    }
+
+    void enter() {
+        ThreadState& state = threadState();
+        if (state.depth++ == 0) {
+            slots[state.slot].epoch.store(globalEpoch.load());
+        }
+    }
+
+    void leave() {
+        ThreadState& state = threadState();
+        if (--state.depth == 0) {
+            slots[state.slot].epoch.store(0, std::memory_order_release);
+        }
+    }
+
+    // Called with retireMutex held
+    void reclaim() {
+        uint64_t oldestReader = UINT64_MAX;
+        for (size_t i = 0; i < slotCount; i++) {
+            uint64_t epoch = slots[i].epoch.load();
+            if (epoch != 0 && epoch < oldestReader) {
+                oldestReader = epoch;
+            }
+        }
+
+        auto firstKept = std::stable_partition(retiredList.begin(), retiredList.end(), [oldestReader](const auto& retired) {
+            return retired.first < oldestReader;
+        });
+        for (auto it = retiredList.begin(); it != firstKept; ++it) {
+            it->second();
+        }
+        retiredList.erase(retiredList.begin(), firstKept);
+    }
+};
@@ -0,0 +1,231 @@
+#pragma once
+
+#include "admission.h"
+#include "compression.h"
+#include "net.h"
+#include "presence.h"
+#include "rcu.h"
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Connection;
+
+using SessionId = uint64_t;
+
+struct ClientInfo {
+    SOCKET socket;
+    SessionId sessionId;
+    std::string name;
+    std::shared_ptr<Connection> connection;
+};
+
+using MemberList = std::vector<ClientInfo>;
+
+// All rooms, split into shards by a hash of the room ID. Each room publishes
+// an immutable member list; joins and leaves copy it, swap the pointer under
+// their shard's mutex and retire the old list. Readers (broadcasts, lookups)
+// take no locks at all and see a consistent snapshot for as long as they hold
+// the read section, so a slow fan-out in one room never blocks another room.
+class RoomRegistry {
+public:
+    struct Room {
+        const std::string id;
+        const size_t hash; // picks the dispatcher worker that owns this room's traffic
+        std::atomic<const MemberList*> members{new MemberList()};
+        ChatDictionaryTrainer dictionary; // fed by that worker, for members that read compressed chat
+        RateLimiter admission;            // the room's chat rate, charged by every sender in it
+        PresenceBatch presence;           // joins and leaves not yet announced, in rooms large enough to batch them
+
+        explicit Room(std::string id) : id(std::move(id)), hash(std::hash<std::string>{}(this->id)) {}
+
+        ~Room() {
+            delete members.load();
+        }
+    };
+
+    // Keeps a room's member list reachable without looking the room ID up again
+    using RoomHandle = std::shared_ptr<Room>;
+
+    explicit RoomRegistry(size_t shardCount = 64) : shards(roundUp(shardCount)) {
+        for (auto& shard : shards) {
+            shard.table.store(new RoomTable());
+        }
+    }
+
+    ~RoomRegistry() {
+        for (auto& shard : shards) {
+            delete shard.table.load();
+        }
+    }
+
+    RoomRegistry(const RoomRegistry&) = delete;
+    RoomRegistry& operator=(const RoomRegistry&) = delete;
+
+    // Adds a member and returns a handle to the room it joined
+    RoomHandle join(const std::string& roomID, ClientInfo client) {
+        Shard& shard = shardFor(roomID);
+        std::lock_guard<std::mutex> lock(shard.writeMutex);
+        RoomHandle room = findOrCreate(shard, roomID);
+
+        const MemberList* current = room->members.load();
+        auto* updated = new MemberList(*current);
+        updated->push_back(std::move(client));
+        publish(room.get(), current, updated);
+        return room;
+    }
+
+    // Removes the member with this session, returning it if it was in the room
+    std::optional<ClientInfo> leave(const std::string& roomID, SessionId sessionId) {
+        Shard& shard = shardFor(roomID);
+        std::lock_guard<std::mutex> lock(shard.writeMutex);
+        const RoomTable* table = shard.table.load();
+        auto it = table->find(roomID);
+        if (it == table->end()) {
+            return std::nullopt;
+        }
+        Room* room = it->second.get();
+
+        const MemberList* current = room->members.load();
+        auto member = std::find_if(current->begin(), current->end(), [sessionId](const ClientInfo& ci) {
+            return ci.sessionId == sessionId;
+        });
+        if (member == current->end()) {
+            return std::nullopt;
+        }
+
+        ClientInfo removed = *member;
+        auto* updated = new MemberList();
+        updated->reserve(current->size() - 1);
+        for (auto other = current->begin(); other != current->end(); ++other) {
+            if (other != member) {
+                updated->push_back(*other);
+            }
+        }
+        publish(room, current, updated);
+
+        if (updated->empty()) {
+            dropRoom(shard, roomID);
+        }
+        return removed;
+    }
+
+    // Runs fn(members) on a snapshot of the room without taking any lock
+    template <typename Callback>
+    void forEachMember(const std::string& roomID, Callback&& fn) {
+        auto guard = EpochDomain::global().read();
+        const Room* room = find(roomID);
+        if (room == nullptr) {
+            return;
+        }
+        for (const auto& client : *room->members.load()) {
+            fn(client);
+        }
+    }
+
+    // Same as above for a room already in hand, skipping the shard lookup
+    template <typename Callback>
+    void forEachMember(const RoomHandle& room, Callback&& fn) {
+        if (!room) {
+            return;
+        }
+        auto guard = EpochDomain::global().read();
+        for (const auto& client : *room->members.load()) {
+            fn(client);
+        }
+    }
+
+    // Runs fn(members) on the whole snapshot at once, for callers that split it up
+    template <typename Callback>
+    void withMembers(const RoomHandle& room, Callback&& fn) {
+        if (!room) {
+            return;
+        }
+        auto guard = EpochDomain::global().read();
+        fn(*room->members.load());
+    }
+
+    // Handle to the room while it has members, otherwise null
+    RoomHandle lookup(const std::string& roomID) {
+        auto guard = EpochDomain::global().read();
+        const RoomTable* table = shardFor(roomID).table.load();
+        auto it = table->find(roomID);
+        return it == table->end() ? nullptr : it->second;
+    }
+
+    size_t memberCount(const std::string& roomID) {
+        auto guard = EpochDomain::global().read();
+        const Room* room = find(roomID);
+        return room == nullptr ? 0 : room->members.load()->size();
+    }
+
+private:
+    using RoomTable = std::unordered_map<std::string, RoomHandle>;
+
+    struct alignas(64) Shard {
+        std::mutex writeMutex;
+        std::atomic<const RoomTable*> table{nullptr};
+    };
+
+    std::vector<Shard> shards;
+
+    static size_t roundUp(size_t value) {
+        size_t result = 1;
+        while (result < value) {
+            result <<= 1;
+        }
+        return result;
+    }
+
+    Shard& shardFor(const std::string& roomID) {
+        return shards[std::hash<std::string>{}(roomID) & (shards.size() - 1)];
+    }
+
+    // Must be called inside a read section or with the shard's mutex held
+    Room* find(const std::string& roomID) {
+        const RoomTable* table = shardFor(roomID).table.load();
+        auto it = table->find(roomID);
+        return it == table->end() ? nullptr : it->second.get();
+    }
+
+    RoomHandle findOrCreate(Shard& shard, const std::string& roomID) {
+        const RoomTable* table = shard.table.load();
+        auto it = table->find(roomID);
+        if (it != table->end()) {
+            return it->second;
+        }
+
+        auto room = std::make_shared<Room>(roomID);
+        auto* updated = new RoomTable(*table);
+        (*updated)[roomID] = room;
+        shard.table.store(updated);
+        EpochDomain::global().retire([table]() {
+            delete table;
+        });
+        return room;
+    }
+
+    void dropRoom(Shard& shard, const std::string& roomID) {
+        const RoomTable* table = shard.table.load();
+        auto* updated = new RoomTable(*table);
+        updated->erase(roomID);
+        shard.table.store(updated);
+        // Sessions may still hold the room; it is freed with its last handle
+        EpochDomain::global().retire([table]() {
+            delete table;
+        });
+    }
+
+    static void publish(Room* room, const MemberList* current, const MemberList* updated) {
+        room->members.store(updated);
+        EpochDomain::global().retire([current]() {
+            delete current;
+        });
+    }
+};
@@ -1,371 +1,1574 @@
-#include <iostream>
 #include <vector>
-#include <map>
-#include <WinSock2.h>
 #include <thread>
 #include <mutex>
 #include <algorithm>
 #include <string>
+#include <cstring>
+#include <csignal>
+#include <condition_variable>
 #include <fstream>
 #include <filesystem>
-#include <condition_variable>
-#include <queue>
-
-#pragma comment(lib, "ws2_32.lib")
+#include <sstream>
+#include "net.h"
+#include "admission.h"
+#include "event_loop.h"
+#include "connection.h"
+#include "room_registry.h"
+#include "session_table.h"
+#include "buffer_pool.h"
+#include "compression.h"
+#include "dispatcher.h"
+#include "fanout.h"
+#include "federation.h"
+#include "handoff.h"
+#include "file_relay.h"
+#include "transfer_manager.h"
+#include "crc32c.h"
+#include "history_log.h"
+#include "logger.h"
+#include "metrics.h"
 
-struct ClientInfo {
-    SOCKET socket;
-    std::string name;
+// A chat message already framed for its recipients; the frame is built once
+// on the sender's loop and only its reference travels from here on
+struct QueuedMessage {
+    RoomRegistry::RoomHandle room;
+    SessionId senderId;
+    FrameRef frame;
+    bool fromPeer = false; // sent on another node, which has already passed it on
+    bool presence = false; // no frame: announce the room's batched joins and leaves
 };
 
-struct QueuedMessage {
-    std::string roomID;
-    std::string clientName;
-    std::string message;
+struct ServerConfig {
+    int port = 12345;
+    int loopThreads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+    int dispatchThreads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency() / 2));
+    size_t dispatchQueueCapacity = 64 * 1024;
+    int fanoutThreads = static_cast<int>(std::max(1u, std::thread::hardware_concurrency() / 2));
+    size_t fanoutChunk = 1024; // members per piece of a broadcast; larger rooms are split across the fan-out pool
+    int presenceWindowMs = 250; // joins and leaves in a large room are announced together every this often, 0 to disable
+    size_t presenceRoomSize = 100; // members from which a room batches its join and leave notices
+    int statsInterval = 0; // seconds between dispatcher stats lines, 0 to disable
+    size_t fileChunkSize = kDefaultFileChunkSize; // FileData payload size for downloads, disk write size for uploads
+    int resumeWindow = 300; // seconds an interrupted transfer waits to be resumed
+    int blobRetention = 3600; // seconds an unreferenced stored file is kept for later offers of the same content
+    OutboundLimits outbound;
+    AdmissionLimits admission;
+    HistoryOptions history;
+    int metricsPort = 0; // loopback port serving /metrics, 0 to disable
+    std::string io = "auto"; // event loop backend: epoll, uring, or auto (io_uring when the kernel has it)
+    bool pinLoops = true;    // pin each loop's thread to its own core
+    bool compression = true; // compress chat and file chunks for clients that ask to in their Hello
+    std::string handoffPath; // Unix socket for hot upgrades: take over from the server there, then listen on it
+    FederationOptions federation;
 };
 
-class Server {
+class Server : public ConnectionHandler, public PeerHandler {
 public:
-    Server(int port) : serverSocket(0), port(port) {
-        // Initialize Winsock
-        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0) {
-            std::cerr << "WSAStartup failed" << std::endl;
-            exit(EXIT_FAILURE);
+    explicit Server(const ServerConfig& config)
+        : port(config.port), pinLoops(config.pinLoops), compression(config.compression), handoffPath(config.handoffPath),
+          fileChunkSize(config.fileChunkSize),
+          outboundLimits(config.outbound), admission(config.admission),
+          burstNanos(static_cast<uint64_t>(std::max(0.0, config.admission.burstSeconds) * 1e9)),
+          presenceWindowNanos(static_cast<uint64_t>(std::max(0, config.presenceWindowMs)) * 1000000),
+          presenceRoomSize(config.presenceRoomSize),
+          dispatcher(config.dispatchThreads, config.dispatchQueueCapacity, [this](QueuedMessage& msg) {
+              if (msg.presence) {
+                  sendPresence(msg);
+              } else {
+                  sendMessageToRoom(msg);
+              }
+          }),
+          fanout(static_cast<size_t>(std::max(0, config.fanoutThreads)), config.fanoutChunk),
+          transfers(storagePath, std::chrono::seconds(config.blobRetention), [this](const Transfer& transfer) {
+              onTransferSettled(transfer);
+          }),
+          history(config.history) {
+        IoBackend backend = IoBackend::Epoll;
+        if (config.io != "epoll") {
+            if (IoUring::supported()) {
+                backend = IoBackend::Uring;
+            } else if (config.io == "uring") {
+                logWarning("io_uring is not supported by this kernel, using epoll");
+            }
         }
 
-        // Create server socket
-        serverSocket = socket(AF_INET, SOCK_STREAM, 0);
-        if (serverSocket == INVALID_SOCKET) {
-            std::cerr << "Error creating socket: " << WSAGetLastError() << std::endl;
-            WSACleanup();
-            exit(EXIT_FAILURE);
+        // A server already running at the handoff path hands over its
+        // sockets and clients; a handoff that breaks off leaves it running
+        std::optional<HandoffState> inherited;
+        if (!handoffPath.empty()) {
+            bool broken;
+            inherited = takeOver(handoffPath, broken);
+            if (broken) {
+                logError("Taking over from the server at ", handoffPath, " failed");
+                Logger::global().flush();
+                exit(EXIT_FAILURE);
+            }
         }
 
-        // Configure server address
-        serverAddr.sin_family = AF_INET;
-        serverAddr.sin_addr.s_addr = INADDR_ANY;
-        serverAddr.sin_port = htons(port);
-
-        // Bind the socket
-        if (bind(serverSocket, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) == SOCKET_ERROR) {
-            std::cerr << "Bind failed with error: " << WSAGetLastError() << std::endl;
-            closesocket(serverSocket);
-            WSACleanup();
-            exit(EXIT_FAILURE);
+        // Each loop is a shard: its own listening socket on the shared port,
+        // its own thread and the connections the kernel hands to that socket.
+        // Inherited listeners keep the connections waiting in their queues.
+        for (int i = 0; i < std::max(1, config.loopThreads); i++) {
+            loops.push_back(std::make_unique<EventLoop>(i, backend));
+        }
+        if (inherited) {
+            listeners = inherited->listeners;
+        }
+        while (listeners.size() < loops.size()) {
+            listeners.push_back(openListener());
         }
 
-        // Listen for incoming connections
-        if (listen(serverSocket, SOMAXCONN) == SOCKET_ERROR) {
-            std::cerr << "Listen failed with error: " << WSAGetLastError() << std::endl;
-            closesocket(serverSocket);
-            WSACleanup();
-            exit(EXIT_FAILURE);
+        if (config.federation.peerPort > 0 || !config.federation.peers.empty()) {
+            FederationOptions options = config.federation;
+            if (inherited) {
+                options.listener = inherited->peerListener;
+            }
+            federation = std::make_unique<Federation>(options, *this);
+            logInfo("Federation: node ", federation->getNodeId(), ", peer port ", config.federation.peerPort, ", ",
+                    config.federation.peers.size(), " peers");
         }
 
-        std::thread([this]() {
-            this->processMessageQueue();
+        std::thread([this, window = std::chrono::seconds(config.resumeWindow)]() {
+            expireTransfers(window);
         }).detach();
 
+        if (config.statsInterval > 0) {
+            std::thread([this, interval = config.statsInterval]() {
+                reportStats(interval);
+            }).detach();
+        }
+
+        if (config.metricsPort > 0) {
+            metrics = std::make_unique<MetricsEndpoint>(config.metricsPort, [this](std::string& out) {
+                appendGauges(out);
+            }, inherited ? inherited->metricsListener : INVALID_SOCKET);
+            if (!metrics->listening()) {
+                logWarning("Metrics endpoint could not listen on port ", config.metricsPort);
+            }
+        }
+
+        if (inherited) {
+            adoptHandedClients(*inherited);
+        }
 
-        std::cout << "Server listening on port " << port << std::endl;
+        logInfo("Server listening on port ", port, " with ", loops.size(), loops[0]->getBackend() == IoBackend::Uring ? " io_uring" : " epoll",
+                " event loops, ", dispatcher.workerCount(), " dispatch workers and ", fanout.threadCount(), " fan-out threads");
     }
 
     void start() {
-        while (true) {
-            SOCKET clientSocket = accept(serverSocket, nullptr, nullptr);
-            if (clientSocket == INVALID_SOCKET) {
-                std::cerr << "Accept failed with error: " << WSAGetLastError() << std::endl;
-                closesocket(serverSocket);
-                WSACleanup();
-                continue;
+        // More listeners than loops only after taking over from a server that had more loops
+        for (size_t i = 0; i < listeners.size(); i++) {
+            EventLoop& loop = *loops[i % loops.size()];
+            auto acceptor = std::make_shared<Acceptor>(listeners[i], loop, [this, &loop](SOCKET clientSocket) {
+                adopt(loop, clientSocket);
+            });
+            loop.add(listeners[i], EPOLLIN, acceptor);
+            acceptors.push_back(std::move(acceptor));
+        }
+
+        std::vector<std::thread> loopThreads;
+        for (size_t i = 0; i < loops.size(); i++) {
+            EventLoop& loop = *loops[i];
+            loopThreads.emplace_back([&loop]() {
+                loop.run();
+            });
+            if (pinLoops) {
+                pinToCore(loopThreads.back(), i);
             }
+        }
 
-            std::cout << "New client connected" << std::endl;
-            std::thread([this, clientSocket]() {
-                handleClient(clientSocket);
+        if (!handoffPath.empty()) {
+            std::thread([this]() {
+                serveHandoff();
             }).detach();
         }
+
+        for (auto& thread : loopThreads) {
+            thread.join();
+        }
+    }
+
+    void onFrame(const std::shared_ptr<Connection>& connection, const Frame& frame) override {
+        countMetric(Counter::FramesIn);
+        if (connection->session) {
+            connection->session->stats.framesIn++;
+            connection->session->stats.bytesIn += kFrameHeaderSize + frame.payload.size();
+        }
+
+        switch (connection->state) {
+            case ConnState::AwaitName:
+                if (frame.type == FrameType::Hello) {
+                    onName(connection, frame);
+                }
+                break;
+            case ConnState::AwaitRoom:
+                if (frame.type == FrameType::Join) {
+                    onRoom(connection, std::string(frame.payload));
+                }
+                break;
+            case ConnState::Chat:
+                onCommand(connection, frame);
+                break;
+            case ConnState::ReceivingFile:
+                // Chat and answers to offers may come between the chunks of an upload; another upload may not
+                if (frame.type == FrameType::FileData) {
+                    onFileData(connection, frame);
+                } else if (frame.type == FrameType::FileOffer || frame.type == FrameType::FileResume) {
+                    logWarning("Unexpected frame during upload from ", connection->session->getName());
+                    connection->close();
+                } else {
+                    onCommand(connection, frame);
+                }
+                break;
+            case ConnState::Closed:
+                break;
+        }
+    }
+
+    void onClose(const std::shared_ptr<Connection>& connection) override {
+        countMetric(Counter::ConnectionsClosed);
+        if (!connection->session) {
+            logWarning("Failed to get client name or client disconnected");
+            return;
+        }
+
+        logInfo("Client disconnected");
+        if (connection->session->getRoom()) {
+            removeClientFromRoom(connection);
+        }
+        if (connection->upload.transfer) {
+            suspendUpload(connection);
+        }
+        std::vector<TransferHandle> downloading;
+        for (const PendingDownload& pending : connection->download.pending) {
+            downloading.push_back(pending.transfer);
+        }
+        if (connection->download.transfer) {
+            downloading.push_back(connection->download.transfer);
+        }
+        transfers.dropRecipient(connection->id, downloading);
+        sessions.remove(connection->id);
     }
 
 private:
     int port;
-    SOCKET serverSocket;
-    sockaddr_in serverAddr{};
-    WSADATA wsaData;
-    std::map<std::string, std::vector<ClientInfo>> rooms;
-    std::map<std::string, int> roomCounters; // Counter for the number of people in each room
-    std::mutex roomMutex;
-    std::queue<QueuedMessage> messageQueue;
-    std::mutex queueMutex;
-    std::condition_variable queueCondition;
-   SOCKET senderSocket;
-
-    void handleClient(SOCKET clientSocket) {
-        std::string path = "C:\\KSE IT\\Client Server Concepts\\csc_third\\serverStorage";
-        char buffer[1024];
-        // Receive client name
-        memset(buffer, 0, sizeof(buffer));
-        int bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (bytesRead <= 0) {
-            std::cerr << "Failed to get client name or client disconnected" << std::endl;
-            closesocket(clientSocket);
-            return;
+    bool pinLoops;
+    bool compression;
+    std::string handoffPath;
+    std::vector<SOCKET> listeners; // one per loop, all bound to the port with SO_REUSEPORT
+    std::vector<std::shared_ptr<Acceptor>> acceptors;
+    std::filesystem::path storagePath = "serverStorage";
+    size_t fileChunkSize;
+    OutboundLimits outboundLimits;
+    AdmissionLimits admission;
+    uint64_t burstNanos;
+    std::atomic<size_t> queuedChatBytes{0}; // chat frames submitted to the dispatcher and not yet fanned out
+    uint64_t presenceWindowNanos;
+    size_t presenceRoomSize;
+    std::vector<std::unique_ptr<EventLoop>> loops;
+    RoomRegistry rooms;
+    SessionTable sessions;
+    std::atomic<SessionId> nextSessionId{1};
+    Dispatcher<QueuedMessage> dispatcher;
+    FanoutPool fanout;
+    TransferManager transfers;
+    HistoryLog history;
+    std::unique_ptr<MetricsEndpoint> metrics;
+    std::unique_ptr<Federation> federation;
+
+    // SO_REUSEPORT lets every shard bind the same port; the kernel spreads
+    // incoming connections over the sockets by a hash of the client address
+    SOCKET openListener() {
+        SOCKET listener = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listener == INVALID_SOCKET) {
+            logError("Error creating socket: ", WSAGetLastError());
+            Logger::global().flush();
+            exit(EXIT_FAILURE);
         }
-        std::string clientName(buffer, bytesRead);
 
-        // Receive room ID
-        memset(buffer, 0, sizeof(buffer));
-        bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (bytesRead <= 0) {
-            std::cerr << "Failed to get room ID or client disconnected" << std::endl;
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == SOCKET_ERROR) {
+            logError("SO_REUSEPORT failed with error: ", WSAGetLastError());
+            closesocket(listener);
+            Logger::global().flush();
+            exit(EXIT_FAILURE);
+        }
+
+        sockaddr_in serverAddr{};
+        serverAddr.sin_family = AF_INET;
+        serverAddr.sin_addr.s_addr = INADDR_ANY;
+        serverAddr.sin_port = htons(port);
+        if (bind(listener, reinterpret_cast<sockaddr*>(&serverAddr), sizeof(serverAddr)) == SOCKET_ERROR) {
+            logError("Bind failed with error: ", WSAGetLastError());
+            closesocket(listener);
+            Logger::global().flush();
+            exit(EXIT_FAILURE);
+        }
+
+        if (listen(listener, SOMAXCONN) == SOCKET_ERROR) {
+            logError("Listen failed with error: ", WSAGetLastError());
+            closesocket(listener);
+            Logger::global().flush();
+            exit(EXIT_FAILURE);
+        }
+        return listener;
+    }
+
+    // Shard i stays on core i (wrapping around), next to its listener's queue and its connections
+    static void pinToCore(std::thread& thread, size_t index) {
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(index % cores, &cpus);
+        int error = pthread_setaffinity_np(thread.native_handle(), sizeof(cpus), &cpus);
+        if (error != 0) {
+            logWarning("Could not pin event loop ", index, " to core ", index % cores, ": ", error);
+        }
+    }
+
+    // Called on the loop whose listener accepted the client; the connection stays there
+    void adopt(EventLoop& loop, SOCKET clientSocket) {
+        logInfo("New client connected");
+        countMetric(Counter::ConnectionsOpened);
+        auto connection = std::make_shared<Connection>(nextSessionId++, clientSocket, loop, *this, outboundLimits);
+        if (!loop.add(clientSocket, EPOLLIN | EPOLLRDHUP, connection)) {
             closesocket(clientSocket);
-            return;
         }
-        std::string roomID(buffer, bytesRead);
-        addClientToRoom(clientSocket, roomID, clientName);
+    }
 
-        while (true) {
-            memset(buffer, 0, sizeof(buffer));
-            bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-            if (bytesRead <= 0) {
-                std::cerr << "Client disconnected" << std::endl;
-                removeClientFromRoom(clientSocket, roomID);
-                closesocket(clientSocket);
-                break;
+    // Clients handed over by the previous process carry on where they were:
+    // back in their rooms without a join notice or the room's history, with
+    // the input it had not parsed and the output it had not written
+    void adoptHandedClients(HandoffState& state) {
+        SessionId highest = 0;
+        size_t adopted = 0;
+        for (HandedClient& handed : state.clients) {
+            highest = std::max(highest, handed.id);
+            if (handed.state > static_cast<uint8_t>(ConnState::Chat)) {
+                closesocket(handed.socket);
+                continue;
+            }
+            EventLoop& loop = *loops[adopted % loops.size()];
+            auto connection = std::make_shared<Connection>(handed.id, handed.socket, loop, *this, outboundLimits);
+            if (!loop.add(handed.socket, EPOLLIN | EPOLLRDHUP, connection)) {
+                closesocket(handed.socket);
+                continue;
+            }
+            adopted++;
+            connection->state = static_cast<ConnState>(handed.state);
+            connection->compression = handed.compression;
+            if (!handed.name.empty()) {
+                connection->session = sessions.create(connection->id, handed.socket, handed.name, connection);
+            }
+            if (connection->session && !handed.roomID.empty()) {
+                RoomRegistry::RoomHandle room = rooms.join(handed.roomID, {handed.socket, connection->id, handed.name, connection});
+                connection->session->moveTo(handed.roomID, room);
+                if (federation) {
+                    federation->publishJoin(handed.roomID, connection->id, handed.name);
+                }
+            }
+            connection->restoreInput(handed.input);
+            if (!handed.output.empty()) {
+                connection->send(BufferPool::global().adopt(std::move(handed.output)));
             }
+            loop.post([connection]() {
+                connection->processInput();
+            });
+        }
+        nextSessionId = highest + 1;
+        transfers.continueIdsFrom(state.nextTransferId);
+        logInfo("Took over ", adopted, " clients from the previous server process");
+    }
 
-            std::string message(buffer, bytesRead);
+    // Runs fn on every loop thread and waits until all of them have
+    void runOnLoops(const std::function<void(EventLoop&)>& fn) {
+        std::mutex mutex;
+        std::condition_variable finished;
+        size_t remaining = loops.size();
+        for (auto& loop : loops) {
+            EventLoop* target = loop.get();
+            target->post([&, target]() {
+                fn(*target);
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--remaining == 0) {
+                    finished.notify_one();
+                }
+            });
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&]() {
+            return remaining == 0;
+        });
+    }
 
-            if (message.find("CHANGE ") == 0) {
-                std::string newRoomID = message.substr(7);
-                removeClientFromRoom(clientSocket, roomID);
-                roomID = newRoomID;
-                addClientToRoom(clientSocket, roomID, clientName);
+    // Waits at the handoff path for the next version of the server to ask for our sockets
+    void serveHandoff() {
+        int listener = HandoffChannel::listen(handoffPath);
+        if (listener == -1) {
+            logWarning("Cannot listen for a handoff at ", handoffPath, ": ", errno);
+            return;
+        }
+        while (true) {
+            int socket = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (socket == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+                logWarning("Handoff socket failed: ", errno);
+                ::close(listener);
+                return;
+            }
+            timeval timeout{5, 0};
+            setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-                std::string successMessage = "You have successfully switched to room " + newRoomID;
-                send(clientSocket, successMessage.c_str(), successMessage.length(), 0);
-            } else if (message.find("EXIT") == 0) {
-                removeClientFromRoom(clientSocket, roomID);
-                closesocket(clientSocket);
+            HandoffChannel channel(socket);
+            HandoffRecord type;
+            std::string payload;
+            int descriptor = -1;
+            if (!channel.receive(type, payload, descriptor) || type != HandoffRecord::Hello || payload.size() < 4 ||
+                getU32(payload.data()) != kHandoffVersion) {
+                if (descriptor != -1) {
+                    ::close(descriptor);
+                }
+                logWarning("Refused a handoff from a process that is not a server of this version");
+                continue;
             }
-            else if (message.find("SEND") == 0){
-                getFile(clientSocket);
+            ::close(listener);
+            handOver(channel);
+        }
+    }
+
+    // Gives every client to the process at the other end of the channel,
+    // then exits. New clients wait in the listen queues meanwhile. Chat
+    // already accepted is fanned out and logged first. A client in the
+    // middle of a file transfer is disconnected instead, and resumes the
+    // transfer with the new process.
+    [[noreturn]] void handOver(HandoffChannel& channel) {
+        logInfo("Handing clients over to a new server process");
+        runOnLoops([this](EventLoop& loop) {
+            for (auto& acceptor : acceptors) {
+                if (&acceptor->getLoop() == &loop) {
+                    acceptor->stop();
+                }
             }
-            else if (message.find("NO") == 0) {
-                if (isDirectoryEmpty(path)) {
-                    addMessageToQueue(roomID, clientName, message);
+            loop.forEachHandler([](const std::shared_ptr<EventHandler>& handler) {
+                auto connection = std::dynamic_pointer_cast<Connection>(handler);
+                if (!connection) {
+                    return;
+                }
+                if (connection->upload.transfer || connection->download.transfer || !connection->download.pending.empty() ||
+                    connection->state == ConnState::ReceivingFile) {
+                    connection->close();
                 } else {
-                    roomCounters[roomID]--;
+                    connection->freeze();
                 }
-            }
-            else if (message.find("ACCEPT") == 0){
-                std::string type = "FILE";
-                send(clientSocket, type.c_str(), type.length(),0);
-                for (const auto& entry : std::filesystem::directory_iterator(path)) {
-                    if (entry.is_regular_file()) {
-                        std::string fileName = entry.path().filename().string();
-                        std::uintmax_t fileSize = std::filesystem::file_size(entry.path());
-                        sendFile(clientSocket, fileName, fileSize);
+            });
+        });
+
+        // Nothing new is read, so the dispatch queues only drain; one more
+        // pass of every loop then takes in what the workers delivered last
+        auto deadline = std::chrono::steady_clock::now() + kHandoffDrainTime;
+        while (queuedChatBytes.load() > 0 && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        runOnLoops([](EventLoop&) {});
+        history.close();
+
+        // On io_uring a socket can be detached only once its cancelled operations have completed
+        std::vector<HandedClient> clients;
+        std::mutex clientsMutex;
+        while (true) {
+            std::atomic<size_t> waiting{0};
+            runOnLoops([&](EventLoop& loop) {
+                loop.forEachHandler([&](const std::shared_ptr<EventHandler>& handler) {
+                    auto connection = std::dynamic_pointer_cast<Connection>(handler);
+                    if (!connection || connection->state == ConnState::Closed) {
+                        return;
                     }
-                }
+                    connection->freeze(); // accepted after the acceptors stopped
+                    HandedClient handed;
+                    handed.socket = connection->getSocket();
+                    handed.id = connection->id;
+                    handed.state = static_cast<uint8_t>(connection->state);
+                    handed.compression = connection->compression;
+                    if (connection->session) {
+                        handed.name = connection->session->getName();
+                        handed.roomID = connection->session->getRoomID();
+                    }
+                    if (!connection->detach(handed.input, handed.output)) {
+                        waiting++;
+                        return;
+                    }
+                    std::lock_guard<std::mutex> lock(clientsMutex);
+                    clients.push_back(std::move(handed));
+                });
+            });
+            if (waiting == 0) {
+                break;
             }
-            else {
-                addMessageToQueue(roomID, clientName, message);
+            if (std::chrono::steady_clock::now() >= deadline) {
+                logWarning("Disconnecting ", waiting.load(), " clients that could not be handed over in time");
+                runOnLoops([](EventLoop& loop) {
+                    loop.forEachHandler([](const std::shared_ptr<EventHandler>& handler) {
+                        if (auto connection = std::dynamic_pointer_cast<Connection>(handler)) {
+                            connection->close();
+                        }
+                    });
+                });
+                break;
             }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+
+        bool sent = true;
+        for (SOCKET listener : listeners) {
+            sent = sent && channel.send(HandoffRecord::Listener, {}, listener);
+        }
+        if (federation && federation->getListener() != INVALID_SOCKET) {
+            sent = sent && channel.send(HandoffRecord::PeerListener, {}, federation->getListener());
+        }
+        if (metrics && metrics->listening()) {
+            sent = sent && channel.send(HandoffRecord::MetricsListener, {}, metrics->getListener());
+        }
+        std::string nextTransfer;
+        putU64(nextTransfer, transfers.peekNextId());
+        sent = sent && channel.send(HandoffRecord::Transfers, nextTransfer);
+        for (const HandedClient& client : clients) {
+            sent = sent && channel.send(HandoffRecord::Client, encodeClient(client), client.socket);
+        }
+        sent = sent && channel.send(HandoffRecord::End);
+
+        HandoffRecord type;
+        std::string payload;
+        int descriptor = -1;
+        bool acknowledged = sent && channel.receive(type, payload, descriptor) && type == HandoffRecord::Ack;
+        if (acknowledged) {
+            logInfo("Handed ", clients.size(), " clients over; exiting");
+        } else {
+            logError("The handoff broke off; clients that were not handed over are disconnected");
+        }
+        Logger::global().flush();
+        std::_Exit(acknowledged ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+
+    // A client that can read compressed frames says so in its Hello and is
+    // answered with one of our own, unless compression is turned off
+    void onName(const std::shared_ptr<Connection>& connection, const Frame& frame) {
+        connection->session = sessions.create(connection->id, connection->getSocket(), std::string(frame.payload), connection);
+        connection->state = ConnState::AwaitRoom;
+        if (compression && (frame.flags & kHelloCompression)) {
+            connection->compression = true;
+            connection->send(BufferPool::global().frame(FrameType::Hello, {}, kHelloCompression));
+        }
+    }
+
+    void onRoom(const std::shared_ptr<Connection>& connection, const std::string& roomID) {
+        connection->state = ConnState::Chat;
+        addClientToRoom(connection, roomID);
+    }
+
+    void onCommand(const std::shared_ptr<Connection>& connection, const Frame& frame) {
+        switch (frame.type) {
+            case FrameType::Change:
+                onChange(connection, std::string(frame.payload));
+                break;
+            case FrameType::Exit:
+                onExit(connection);
+                break;
+            case FrameType::FileOffer:
+                onFileOffer(connection, frame);
+                break;
+            case FrameType::Decline:
+                onDecline(connection, frame.payload);
+                break;
+            case FrameType::Accept:
+                onAccept(connection, frame.payload);
+                break;
+            case FrameType::FileResume:
+                onFileResume(connection, frame.payload);
+                break;
+            case FrameType::Chat:
+                connection->session->stats.chatMessages++;
+                addMessageToQueue(connection, frame.payload);
+                break;
+            default:
+                logWarning("Ignoring unexpected frame from ", connection->session->getName());
+                break;
         }
     }
 
-    void addClientToRoom(SOCKET clientSocket, const std::string &roomID, const std::string &clientName) {
-        std::lock_guard<std::mutex> lock(roomMutex);
-        rooms[roomID].push_back({clientSocket, clientName});
-        roomCounters[roomID]++;
-        std::cout << "Client " << clientName << " added to room " << roomID << std::endl;
+    void onChange(const std::shared_ptr<Connection>& connection, const std::string& newRoomID) {
+        removeClientFromRoom(connection);
+        addClientToRoom(connection, newRoomID);
 
-        std::string message = clientName + " has joined the room.";
-        for (const auto& client : rooms[roomID]) {
-            if (client.socket != clientSocket) {
-                send(client.socket, message.c_str(), message.length(), 0);
+        std::string successMessage = "You have successfully switched to room " + newRoomID;
+        connection->sendFrame(FrameType::Notice, successMessage);
+    }
+
+    void onExit(const std::shared_ptr<Connection>& connection) {
+        removeClientFromRoom(connection);
+        connection->close();
+    }
+
+    // ACCEPT and NO carry an optional transfer ID; without one they answer
+    // every open offer. A NO with nothing to answer is passed on as chat.
+    // ACCEPT may also carry the offset the client already has, to resume.
+    static std::optional<TransferId> transferIdOf(std::string_view payload) {
+        if (payload.size() < 8) {
+            return std::nullopt;
+        }
+        return getU64(payload.data());
+    }
+
+    void onDecline(const std::shared_ptr<Connection>& connection, std::string_view payload) {
+        std::optional<TransferId> id = transferIdOf(payload);
+        if (transfers.decline(connection->id, id) == 0 && !id) {
+            addMessageToQueue(connection, "NO");
+        }
+    }
+
+    void onAccept(const std::shared_ptr<Connection>& connection, std::string_view payload) {
+        uint64_t offset = payload.size() >= 16 ? getU64(payload.data() + 8) : 0;
+        for (TransferHandle& transfer : transfers.accept(connection->id, connection->session->getName(), transferIdOf(payload))) {
+            connection->download.pending.push_back({std::move(transfer), offset});
+        }
+        if (!connection->download.transfer) {
+            startNextDownload(connection);
+        }
+    }
+
+    void addClientToRoom(const std::shared_ptr<Connection>& connection, const std::string &roomID) {
+        Session& session = *connection->session;
+        std::string clientName = session.getName();
+        RoomRegistry::RoomHandle room = rooms.join(roomID, {connection->getSocket(), session.id, clientName, connection});
+        session.moveTo(roomID, room);
+        logInfo("Client ", clientName, " added to room ", roomID);
+        // Read after joining: a dictionary published from here on is announced to this client too
+        if (connection->compression) {
+            if (std::shared_ptr<const ChatDictionary> dictionary = room->dictionary.current()) {
+                connection->send(dictionary->frame);
             }
         }
+        if (federation) {
+            federation->publishJoin(roomID, session.id, clientName);
+        }
+
+        announcePresence(room, session.id, clientName, true);
+
+        // Recent history, oldest first: sent from here when the room's log is
+        // open, otherwise by the history thread once it has opened it
+        history.recent(roomID, [connection, roomID](const HistoryLog::Backlog& backlog) {
+            if (connection->session->getRoomID() != roomID) {
+                return; // moved on before the log was opened
+            }
+            for (const std::string& payload : backlog) {
+                connection->send(BufferPool::global().frame(FrameType::Chat, {payload}), true);
+            }
+        });
     }
 
-    void removeClientFromRoom(SOCKET clientSocket, const std::string& roomID) {
-        std::lock_guard<std::mutex> lock(roomMutex);
-        std::string clientName;
-        auto& clients = rooms[roomID];
-        auto it = std::find_if(clients.begin(), clients.end(), [clientSocket, &clientName](const ClientInfo& ci) {
-            if (ci.socket == clientSocket) {
-                clientName = ci.name;
-                return true;
+    void removeClientFromRoom(const std::shared_ptr<Connection>& connection) {
+        Session& session = *connection->session;
+        std::string roomID = session.getRoomID();
+        RoomRegistry::RoomHandle room = session.getRoom();
+        session.moveTo("", nullptr);
+
+        std::optional<ClientInfo> removed = rooms.leave(roomID, session.id);
+        if (removed) {
+            logInfo("Client ", removed->name, " removed from room ", roomID);
+            if (federation) {
+                federation->publishLeave(roomID, session.id);
             }
-            return false;
+
+            announcePresence(room, session.id, removed->name, false);
+        }
+    }
+
+    // Small rooms hear of a join or leave at once. Rooms of --presence-room-size
+    // members or more, and any room with a batch already waiting, gather them
+    // for --presence-window ms; the room's dispatch worker then announces the
+    // whole batch in one notice.
+    void announcePresence(const RoomRegistry::RoomHandle& room, SessionId sessionId, const std::string& name, bool joined) {
+        size_t members = 0;
+        rooms.withMembers(room, [&](const MemberList& list) {
+            members = list.size();
         });
+        if (presenceWindowNanos == 0 || (members < presenceRoomSize && !room->presence.pending())) {
+            FrameRef message = BufferPool::global().frame(FrameType::Notice, {name, joined ? " has joined the room." : " has left the room."});
+            rooms.forEachMember(room, [&](const ClientInfo& client) {
+                if (client.sessionId != sessionId) {
+                    client.connection->deliver(message, false);
+                }
+            });
+            return;
+        }
+
+        countMetric(Counter::PresenceEventsBatched);
+        if (joined ? room->presence.joined(sessionId, name) : room->presence.left(sessionId, name)) {
+            // A timer on the loop the room hashes to, which may not be the caller's
+            EventLoop& loop = *loops[room->hash % loops.size()];
+            loop.runInLoop([this, &loop, room]() {
+                loop.runAfter(presenceWindowNanos, [this, room]() {
+                    size_t key = room->hash;
+                    dispatcher.submit(key, QueuedMessage{room, 0, FrameRef(), false, true});
+                });
+            });
+        }
+    }
 
-        if (it != clients.end()) {
-            clients.erase(it);
-            roomCounters[roomID]--;
-            std::cout << "Client " << clientName << " removed from room " << roomID << std::endl;
+    // The batch goes out on the room's dispatch worker, in order with its
+    // chat. Like a notice sent at once, it never tells a member of its own
+    // join: members the batch is about get it without their own entry.
+    void sendPresence(const QueuedMessage& msg) {
+        PresenceNotice notice = msg.room->presence.take();
+        if (notice.text.empty()) {
+            return;
+        }
+        countMetric(Counter::PresenceBatches);
+        FrameRef message = BufferPool::global().frame(FrameType::Notice, {notice.text});
+        broadcast(msg.room, [&](const ClientInfo& client) -> FrameRef {
+            if (!notice.about(client.sessionId)) {
+                return message;
+            }
+            std::string own = notice.textFor(client.sessionId);
+            return own.empty() ? FrameRef() : BufferPool::global().frame(FrameType::Notice, {own});
+        });
+    }
 
-            std::string message = clientName + " has left the room.";
-            for (const auto& client : clients) {
-                send(client.socket, message.c_str(), message.length(), 0);
+    // Sends each member the frame `pick` returns for it, if any, split across
+    // the fan-out pool in large rooms
+    template <typename Pick>
+    void broadcast(const RoomRegistry::RoomHandle& room, Pick&& pick) {
+        rooms.withMembers(room, [&](const MemberList& members) {
+            size_t chunks = fanout.forEachChunk(members, [&](FanoutPool::Members first, FanoutPool::Members last) {
+                for (; first != last; ++first) {
+                    if (FrameRef frame = pick(*first)) {
+                        first->connection->deliver(frame, false);
+                    }
+                }
+            });
+            if (chunks > 1) {
+                countMetric(Counter::FanoutChunks, chunks);
             }
+        });
+    }
+
+
+    // Messages for one room always go to the same dispatch worker, keeping them in order
+    void addMessageToQueue(const std::shared_ptr<Connection>& connection, std::string_view message) {
+        Session& session = *connection->session;
+        RoomRegistry::RoomHandle room = session.getRoom();
+        if (!room || !admitChat(connection, *room, message.size())) {
+            return;
         }
+        FrameRef frame = BufferPool::global().frame(FrameType::Chat, {session.getName(), ": ", message});
+        frame.setEnqueuedAt(monotonicNanos());
+        queuedChatBytes.fetch_add(frame->size(), std::memory_order_relaxed);
+        countMetric(Counter::ChatMessages);
+        size_t key = room->hash;
+        dispatcher.submit(key, QueuedMessage{std::move(room), session.id, std::move(frame)});
     }
 
+    // Checked on the sender's loop before a message is queued. Under Reject a
+    // message over the sender's rate, its room's rate or the server's queued
+    // byte limit is dropped, and the sender is told once until one gets
+    // through again. Under Delay every message is kept and the sender's
+    // socket is left unread until it is back within its limits.
+    bool admitChat(const std::shared_ptr<Connection>& connection, RoomRegistry::Room& room, size_t bytes) {
+        uint64_t now = monotonicNanos();
+        bool overloaded = queuedChatBytes.load(std::memory_order_relaxed) >= admission.queuedBytesLimit;
+        if (admission.policy == FloodPolicy::Delay) {
+            uint64_t wait = std::max(connection->admission.admit(admission.client, burstNanos, bytes, now),
+                                     room.admission.admit(admission.room, burstNanos, bytes, now));
+            if (overloaded) {
+                wait = std::max(wait, kOverloadPauseNs);
+            }
+            if (wait > 0) {
+                countMetric(Counter::ChatDelayed);
+                connection->pauseReading(wait);
+            }
+            return true;
+        }
 
-    void addMessageToQueue(const std::string& roomID, const std::string& clientName, const std::string& message) {
-        std::lock_guard<std::mutex> lock(queueMutex);
-        messageQueue.push({roomID, clientName, message});
-        queueCondition.notify_one();
+        Counter refused;
+        const char* reason;
+        if (overloaded) {
+            refused = Counter::ChatShed;
+            reason = "the server is busy";
+        } else if (connection->admission.tryAdmit(admission.client, burstNanos, bytes, now) > 0) {
+            refused = Counter::ChatRejectedClientRate;
+            reason = "you are sending too fast";
+        } else if (room.admission.tryAdmit(admission.room, burstNanos, bytes, now) > 0) {
+            connection->admission.refund(admission.client, bytes);
+            refused = Counter::ChatRejectedRoomRate;
+            reason = "the room is too busy";
+        } else {
+            connection->throttled = false;
+            return true;
+        }
+        countMetric(refused);
+        if (!connection->throttled) {
+            connection->throttled = true;
+            connection->send(BufferPool::global().frame(FrameType::Notice, {"Message not delivered: ", reason, "."}));
+        }
+        return false;
     }
 
-    void processMessageQueue() {
+    void reportStats(int interval) {
         while (true) {
-            std::unique_lock<std::mutex> lock(queueMutex);
-            queueCondition.wait(lock, [this]() { return !messageQueue.empty(); });
-            QueuedMessage msg = messageQueue.front();
-            messageQueue.pop();
-            lock.unlock();
-            sendMessageToRoom(msg.roomID, msg.clientName, msg.message.c_str(), msg.message.length());
+            std::this_thread::sleep_for(std::chrono::seconds(interval));
+            std::ostringstream line;
+            line << "Dispatch workers:";
+            for (const auto& worker : dispatcher.stats()) {
+                line << " [depth " << worker.queueDepth << ", " << worker.processed << " msgs in "
+                     << worker.batches << " batches, " << worker.fullWaits << " full waits]";
+            }
+            logInfo(line.str());
         }
     }
 
-    void sendMessageToRoom(const std::string &roomID, const std::string &clientName, const char *message, int messageSize) {
-        std::lock_guard<std::mutex> lock(roomMutex);
-        std::string fullMessage = clientName + ": " + std::string(message, messageSize);
-        for (const auto &client: rooms[roomID]) {
-            if (client.name != clientName) { // Don't send the message to the sender
-                send(client.socket, fullMessage.c_str(), fullMessage.length(), 0);
+    // Recipients that read compressed chat share one compressed frame, made
+    // against the room's dictionary when the first of them comes up. Only
+    // rooms with such recipients train a dictionary; a new one is announced
+    // to them before any chat that uses it. Rooms larger than one fan-out
+    // chunk are delivered to by several threads at once (see fanout.h).
+    void sendMessageToRoom(const QueuedMessage& msg) {
+        recordMetric(Metric::DispatchWaitNs, monotonicNanos() - msg.frame->enqueuedAt());
+        std::string_view payload = std::string_view(msg.frame->bytes()).substr(kFrameHeaderSize);
+        FrameRef packed;
+        std::once_flag packOnce;
+        bool packAttempted = false;
+        std::atomic<uint64_t> recipients{0};
+        std::atomic<uint64_t> packedRecipients{0};
+        rooms.withMembers(msg.room, [&](const MemberList& members) {
+            size_t chunks = fanout.forEachChunk(members, [&](FanoutPool::Members first, FanoutPool::Members last) {
+                uint64_t sent = 0;
+                uint64_t sentPacked = 0;
+                for (; first != last; ++first) {
+                    const ClientInfo& client = *first;
+                    if (client.sessionId == msg.senderId) { // Don't send the message to the sender
+                        continue;
+                    }
+                    sent++;
+                    if (client.connection->compression) {
+                        std::call_once(packOnce, [&]() {
+                            packed = compressFrame(FrameType::Chat, payload, msg.room->dictionary.current().get());
+                            packAttempted = true;
+                        });
+                        if (packed) {
+                            client.connection->deliver(packed, true);
+                            sentPacked++;
+                            continue;
+                        }
+                    }
+                    client.connection->deliver(msg.frame, true);
+                }
+                recipients.fetch_add(sent, std::memory_order_relaxed);
+                packedRecipients.fetch_add(sentPacked, std::memory_order_relaxed);
+            });
+            if (chunks > 1) {
+                countMetric(Counter::FanoutChunks, chunks);
+            }
+        });
+        recordMetric(Metric::FanoutSize, recipients);
+        countMetric(Counter::Deliveries, recipients);
+        if (packed) {
+            countMetric(Counter::CompressionBytesSaved, (msg.frame->size() - packed->size()) * packedRecipients.load());
+        } else if (packAttempted) {
+            countMetric(Counter::CompressionSkipped);
+        }
+        if (packAttempted) {
+            if (std::shared_ptr<const ChatDictionary> trained = msg.room->dictionary.add(payload)) {
+                broadcast(msg.room, [&trained](const ClientInfo& client) {
+                    return client.connection->compression ? trained->frame : FrameRef();
+                });
             }
         }
+        // Only staged here; the disk write happens on the history thread
+        history.append(msg.room, payload);
+        if (federation && !msg.fromPeer) {
+            federation->publishChat(msg.room->id, payload);
+        }
+        queuedChatBytes.fetch_sub(msg.frame->size(), std::memory_order_relaxed);
+    }
+
+    // Other nodes' members come and go like local ones, as far as this room can tell
+    void onPeerJoin(const std::string& roomID, const std::string& name) override {
+        if (RoomRegistry::RoomHandle room = rooms.lookup(roomID)) {
+            announcePresence(room, 0, name, true);
+        }
     }
 
-    void sendFile(SOCKET clientSocket, const std::string& fileName,  std::uintmax_t fileSize){
-        std::ifstream fileToSend("C:\\KSE IT\\Client Server Concepts\\csc_third\\serverStorage\\" + fileName, std::ios::binary);
-        if (!fileToSend.is_open()) {
-            std::cerr << "Failed to open file for reading: " << fileName << std::endl;
+    void onPeerLeave(const std::string& roomID, const std::string& name) override {
+        if (RoomRegistry::RoomHandle room = rooms.lookup(roomID)) {
+            announcePresence(room, 0, name, false);
+        }
+    }
+
+    // Chat from another node goes through the room's dispatch worker like
+    // local chat, so it is ordered with it and kept in this node's history
+    void onPeerChat(const std::string& roomID, std::string_view payload) override {
+        RoomRegistry::RoomHandle room = rooms.lookup(roomID);
+        if (!room) {
             return;
         }
+        FrameRef frame = BufferPool::global().frame(FrameType::Chat, {payload});
+        frame.setEnqueuedAt(monotonicNanos());
+        queuedChatBytes.fetch_add(frame->size(), std::memory_order_relaxed);
+        size_t key = room->hash;
+        dispatcher.submit(key, QueuedMessage{std::move(room), 0, std::move(frame), true});
+    }
+
+    void startNextDownload(const std::shared_ptr<Connection>& connection) {
+        DownloadState& download = connection->download;
+        while (!download.pending.empty()) {
+            PendingDownload next = std::move(download.pending.front());
+            download.pending.pop_front();
+            if (sendFile(connection, next.transfer, next.offset)) {
+                return;
+            }
+            transfers.abort(next.transfer, connection->id);
+        }
+    }
+
+    bool sendFile(const std::shared_ptr<Connection>& connection, const TransferHandle& transfer, uint64_t offset) {
+        DownloadState& download = connection->download;
+        download.file = FileHandle::open(transfer->path.string());
+        if (!download.file) {
+            logError("Failed to open file for reading: ", transfer->fileName);
+            return false;
+        }
 
-        const int chunkSize = 1024;
-        char fileBuffer[chunkSize];
+        download.transfer = transfer;
+        download.offset = offset <= transfer->size ? offset : 0;
+        download.startedAt = monotonicNanos();
+        download.startOffset = download.offset;
+        download.uncompressedChunks = 0;
 
-        send(clientSocket, fileName.c_str(), fileName.length(), 0);
-        send(clientSocket, reinterpret_cast<const char*>(&fileSize), sizeof(fileSize), 0);
+        std::string header;
+        putU64(header, transfer->size);
+        putU64(header, download.offset);
+        putU64(header, transfer->id);
+        header += transfer->fileName;
+        connection->sendFrame(FrameType::FileBegin, header);
+        pumpFile(connection);
+        return true;
+    }
 
-        // Check if there's only one client in the room
-        std::string roomID = getClientRoomID(clientSocket);
-        int remainingClients = roomCounters[roomID] - 1; // Subtract 1 for the sender
-        while (!fileToSend.eof() && remainingClients > 0) {
-            fileToSend.read(fileBuffer, chunkSize);
-            int bytesRead = static_cast<int>(fileToSend.gcount());
-            send(clientSocket, fileBuffer, bytesRead, 0);
-            remainingClients--;
+    // Queues file chunks until the client's outbound queue is full, then
+    // resumes from the drain callback instead of buffering the whole file.
+    // Each chunk is a FileData header plus a file range that the kernel
+    // copies to the socket with sendfile(). A client that reaches the end of
+    // a file still being uploaded hands itself to the upload (see
+    // streamChunk) and is resumed from here if it falls behind again.
+    void pumpFile(const std::shared_ptr<Connection>& connection) {
+        DownloadState& download = connection->download;
+        if (!download.transfer) {
+            return;
         }
+        Transfer& transfer = *download.transfer;
+        while (download.offset < transfer.size) {
+            uint64_t readable;
+            {
+                std::lock_guard<std::mutex> lock(transfer.streamMutex);
+                if (transfer.aborted) {
+                    cancelDownload(connection);
+                    return;
+                }
+                readable = transfer.uploaded ? transfer.size : transfer.spooled;
+                if (download.offset >= readable) {
+                    StreamReader reader{connection, download.offset};
+                    if (download.offset == transfer.received) {
+                        transfer.live.push_back(std::move(reader));
+                    } else {
+                        // The rest is still gathered in the upload's write buffer
+                        if (transfer.waiting.empty()) {
+                            requestFlush(download.transfer);
+                        }
+                        transfer.waiting.push_back(std::move(reader));
+                    }
+                    return;
+                }
+            }
 
-        std::cout << "File sent to client"  << std::endl;
+            if (!connection->canWrite()) {
+                std::weak_ptr<Connection> weak = connection;
+                connection->onDrain([this, weak]() {
+                    if (auto connection = weak.lock()) {
+                        pumpFile(connection);
+                    }
+                });
+                return;
+            }
 
-        fileToSend.close();
+            size_t length = static_cast<size_t>(std::min<uint64_t>(fileChunkSize, readable - download.offset));
+            FrameRef packed = connection->compression ? compressChunk(download, length) : FrameRef();
+            bool queued;
+            if (packed) {
+                countMetric(Counter::CompressionBytesSaved, length + kFrameHeaderSize - packed->size());
+                queued = connection->sendFileData(std::move(packed));
+            } else {
+                FrameRef header = BufferPool::global().header(FrameType::FileData, static_cast<uint32_t>(length));
+                queued = connection->sendFileSegment(std::move(header), download.file, download.offset, length);
+            }
+            if (!queued) {
+                return; // closing; onClose releases the transfer
+            }
+            countMetric(Counter::FileBytesOut, length);
+            download.offset += length;
+        }
 
-        // Remove the file from storage if it has been sent to all clients
-        if (remainingClients == 0) {
-            std::filesystem::remove("C:\\KSE IT\\Client Server Concepts\\csc_third\\serverStorage\\" + fileName);
-            std::cout << "File removed from storage: " << fileName << std::endl;
-            std::string notificationMessage = "ALL_RECV";
-            send(senderSocket, notificationMessage.c_str(), notificationMessage.length(), 0);
+        // Every byte has been received by now, so the whole-file checksum is final
+        uint32_t crc;
+        {
+            std::lock_guard<std::mutex> lock(transfer.streamMutex);
+            crc = transfer.crc;
         }
+        std::string trailer;
+        putU64(trailer, transfer.id);
+        putU32(trailer, crc);
+        connection->sendFrame(FrameType::FileEnd, trailer);
+
+        logInfo("File sent to client");
+        countMetric(Counter::DownloadsCompleted);
+        recordMetric(Metric::DownloadBytesPerSecond, bytesPerSecond(transfer.size - download.startOffset, download.startedAt));
+        TransferHandle finished = std::move(download.transfer);
+        download.transfer.reset();
+        download.file.reset();
+        transfers.complete(finished, connection->id);
+        startNextDownload(connection);
     }
 
+    // A download chunk for a client that reads compressed frames: read into
+    // memory and compressed, or an empty ref to send it with sendfile() as
+    // usual. After a chunk that does not shrink, the next kUncompressedRun
+    // go out as they are before compression is tried again.
+    FrameRef compressChunk(DownloadState& download, size_t length) {
+        if (download.uncompressedChunks > 0) {
+            download.uncompressedChunks--;
+            return FrameRef();
+        }
+        thread_local std::string chunk;
+        chunk.resize(length);
+        FrameRef packed;
+        if (download.file->read(download.offset, &chunk[0], length)) {
+            packed = compressFrame(FrameType::FileData, chunk);
+        }
+        if (!packed) {
+            download.uncompressedChunks = kUncompressedRun;
+            countMetric(Counter::CompressionSkipped);
+        }
+        return packed;
+    }
 
-    void getFile(SOCKET clientSocket) {
-        char buffer[1024];
-        int bytesRead;
+    // Hands a reader back to its own loop to carry on from `offset`. Always
+    // posted: the caller holds the transfer's stream lock.
+    void resumeReader(const StreamReader& reader, const TransferHandle& transfer) {
+        auto connection = reader.connection.lock();
+        if (!connection) {
+            return;
+        }
+        std::weak_ptr<Connection> weak = connection;
+        connection->getLoop().post([this, weak, transfer, offset = reader.offset]() {
+            auto connection = weak.lock();
+            if (connection && connection->download.transfer == transfer) {
+                connection->download.offset = offset;
+                pumpFile(connection);
+            }
+        });
+    }
 
-        memset(buffer, 0, sizeof(buffer));
-        bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-        if (bytesRead <= 0) {
-            std::cerr << "Failed to get file name or client disconnected" << std::endl;
-            closesocket(clientSocket);
+    // Caller holds the transfer's stream lock
+    void resumeAllReaders(const TransferHandle& transfer) {
+        for (const StreamReader& reader : transfer->live) {
+            resumeReader(reader, transfer);
+        }
+        for (const StreamReader& reader : transfer->waiting) {
+            resumeReader(reader, transfer);
+        }
+        transfer->live.clear();
+        transfer->waiting.clear();
+    }
+
+    // Asks the uploading loop to write out what it has gathered, so a waiting
+    // reader is not held up by a sender that has paused
+    void requestFlush(const TransferHandle& transfer) {
+        std::shared_ptr<Session> sender = sessions.find(transfer->senderId);
+        auto connection = sender ? sender->connection.lock() : nullptr;
+        if (!connection) {
             return;
         }
-        std::string fileName(buffer, bytesRead);
+        std::weak_ptr<Connection> weak = connection;
+        connection->getLoop().post([this, weak, transfer]() {
+            auto connection = weak.lock();
+            if (connection && connection->upload.transfer == transfer) {
+                streamChunk(connection->upload, {});
+            }
+        });
+    }
 
-        int fileSize;
-        bytesRead = recv(clientSocket, reinterpret_cast<char*>(&fileSize), sizeof(fileSize), 0);
-        if (bytesRead != sizeof(fileSize)) {
-            std::cerr << "Failed to get file size or client disconnected" << std::endl;
-            closesocket(clientSocket);
+    void cancelDownload(const std::shared_ptr<Connection>& connection) {
+        DownloadState& download = connection->download;
+        TransferHandle cancelled = std::move(download.transfer);
+        download.transfer.reset();
+        download.file.reset();
+        connection->sendFrame(FrameType::Notice, "The sender cancelled the file '" + cancelled->fileName + "'");
+        transfers.abort(cancelled, connection->id);
+        startNextDownload(connection);
+    }
+
+    // Everyone offered the file has it or said no: the stored copy is gone, tell the sender
+    void onTransferSettled(const Transfer& transfer) {
+        logInfo("File removed from storage: ", transfer.fileName, " (transfer ", transfer.id, ")");
+        std::string id;
+        putU64(id, transfer.id);
+        sendToSession(transfer.senderId, BufferPool::global().frame(FrameType::AllReceived, {id}));
+    }
+
+    void sendFileAck(const std::shared_ptr<Connection>& connection, TransferId id, uint64_t offset) {
+        std::string ack;
+        putU64(ack, id);
+        putU64(ack, offset);
+        connection->sendFrame(FrameType::FileAck, ack);
+    }
+
+    // Also ends an upload that failed, so the sender can move on to its next one
+    void sendAllReceived(const std::shared_ptr<Connection>& connection, TransferId id) {
+        std::string payload;
+        putU64(payload, id);
+        connection->sendFrame(FrameType::AllReceived, payload);
+    }
+
+    // The offer goes out as soon as the upload starts, so recipients can
+    // accept and start receiving while the sender is still sending. The
+    // FileAck tells the sender its transfer ID, needed to resume later.
+    // An offer with a SHA-256 the blob store already has is answered with a
+    // FileAck at the full size: nothing is uploaded and recipients are sent
+    // the stored copy.
+    void onFileOffer(const std::shared_ptr<Connection>& connection, const Frame& frame) {
+        std::string_view payload = frame.payload;
+        bool hashed = (frame.flags & kOfferHashed) != 0;
+        if (payload.size() < (hashed ? 8 + kSha256Size : 8)) {
+            logWarning("Failed to get file size or client disconnected");
+            connection->close();
             return;
         }
 
-        std::ofstream outputFile("C:\\KSE IT\\Client Server Concepts\\csc_third\\serverStorage\\" + fileName, std::ios::binary);
-        if (!outputFile.is_open()) {
-            std::cerr << "Failed to open file for writing: " << fileName << std::endl;
+        UploadState& upload = connection->upload;
+        uint64_t fileSize = getU64(payload.data());
+        std::optional<Sha256Digest> digest;
+        if (hashed) {
+            digest.emplace();
+            std::memcpy(digest->data(), payload.data() + 8, kSha256Size);
+        }
+        std::string fileName = std::filesystem::path(std::string(payload.substr(hashed ? 8 + kSha256Size : 8))).filename().string();
+
+        if (digest && fileSize > 0) {
+            TransferHandle stored = transfers.createFromStore(connection->id, connection->session->getName(), fileName, *digest, fileSize);
+            if (stored) {
+                logInfo("File ", fileName, " is already stored (transfer ", stored->id, "), skipping the upload");
+                countMetric(Counter::DedupHits);
+                countMetric(Counter::DedupBytesSaved, fileSize);
+                connection->session->stats.filesUploaded++;
+                sendFileAck(connection, stored->id, fileSize);
+                offerToRoom(connection, stored);
+                return;
+            }
+        }
+
+        upload.transfer = transfers.create(connection->id, connection->session->getName(), fileName, fileSize, digest);
+        upload.received = 0;
+        upload.startedAt = monotonicNanos();
+        upload.startOffset = 0;
+        upload.file.setChunkSize(fileChunkSize);
+        if (!upload.file.open(upload.transfer->path.string())) {
+            logError("Failed to open file for writing: ", fileName);
+        }
+        connection->state = ConnState::ReceivingFile;
+        if (fileSize > 0) {
+            sendFileAck(connection, upload.transfer->id, 0);
+        }
+        offerToRoom(connection, upload.transfer);
+        if (fileSize == 0) {
+            finishUpload(connection); // its FileAck covers the whole, empty file
+        }
+    }
+
+    // Picks up an upload whose sender lost its connection, from the last byte that arrived intact
+    void onFileResume(const std::shared_ptr<Connection>& connection, std::string_view payload) {
+        TransferHandle transfer;
+        if (payload.size() >= 8) {
+            transfer = transfers.resumeUpload(getU64(payload.data()), connection->id, connection->session->getName());
+        }
+        if (!transfer) {
+            connection->sendFrame(FrameType::Notice, "There is no interrupted upload of yours with that transfer ID");
             return;
         }
 
-        int totalBytesReceived = 0;
-        while (totalBytesReceived < fileSize) {
-            bytesRead = recv(clientSocket, buffer, sizeof(buffer), 0);
-            outputFile.write(buffer, bytesRead);
-            totalBytesReceived += bytesRead;
+        UploadState& upload = connection->upload;
+        {
+            std::lock_guard<std::mutex> lock(transfer->streamMutex);
+            upload.received = transfer->received;
+        }
+        upload.transfer = transfer;
+        upload.startedAt = monotonicNanos();
+        upload.startOffset = upload.received;
+        upload.file.setChunkSize(fileChunkSize);
+        if (!upload.file.open(transfer->path.string(), upload.received)) {
+            logError("Failed to reopen file for writing: ", transfer->fileName);
         }
+        logInfo("Resuming upload of ", transfer->fileName, " (transfer ", transfer->id, ") at ", upload.received);
+        connection->state = ConnState::ReceivingFile;
+        sendFileAck(connection, transfer->id, upload.received);
+    }
 
-        outputFile.close();
-        std::cout << "File received: " << fileName << std::endl;
-        senderSocket = clientSocket;
+    // Each uploaded chunk names its offset and carries its CRC-32C. A chunk
+    // that fails the check is answered with a FileAck asking for everything
+    // from the last good byte again; chunks already in flight behind it are
+    // recognised by their offset and skipped. A compressed chunk is decoded
+    // first and checked like any other.
+    void onFileData(const std::shared_ptr<Connection>& connection, const Frame& frame) {
+        UploadState& upload = connection->upload;
+        std::string_view payload = frame.payload;
+        if (payload.size() < kFileDataHeaderSize || getU64(payload.data()) != upload.received) {
+            return;
+        }
+        uint32_t expected = getU32(payload.data() + 8);
+        std::string_view chunk = payload.substr(kFileDataHeaderSize);
+        uint64_t remaining = upload.transfer->size - upload.received;
+        bool decoded = true;
+        if (frame.flags & kCompressed) {
+            thread_local std::string plain;
+            decoded = decompressPayload(chunk, frame.flags, nullptr, plain, std::min<uint64_t>(remaining, kMaxFramePayload));
+            if (decoded && plain.size() > chunk.size()) {
+                countMetric(Counter::CompressionBytesSaved, plain.size() - chunk.size());
+            }
+            chunk = plain;
+        }
+        if (!decoded || chunk.size() > remaining || crc32c(0, chunk.data(), chunk.size()) != expected) {
+            logWarning("Bad chunk at offset ", upload.received, " of ", upload.transfer->fileName, ", asking for it again");
+            sendFileAck(connection, upload.transfer->id, upload.received);
+            return;
+        }
 
-        std::string notification = "User " + getClientName(clientSocket) + " wants to send you a file named '" + fileName + "' (" + std::to_string(fileSize) + " bytes). Do you want to accept? (ACCEPT/NO)";
-        sendRequest(getClientRoomID(clientSocket), clientSocket, notification);
+        if (upload.file.isOpen()) {
+            upload.file.write(chunk);
+        }
+        upload.received += chunk.size();
+        countMetric(Counter::FileBytesIn, chunk.size());
+        streamChunk(upload, chunk);
+        if (upload.received >= upload.transfer->size) {
+            finishUpload(connection);
+        }
     }
 
-    std::string getClientName(SOCKET clientSocket) {
-        std::string clientName;
-        for (const auto& [roomID, clients] : rooms) {
-            for (const auto& client : clients) {
-                if (client.socket == clientSocket) {
-                    clientName = client.name;
-                    break;
+    // Cut-through: the chunk just received goes straight to every live
+    // reader, framed once and shared (compressed once, too, for readers that
+    // take compressed frames). A reader whose queue is full drops back to
+    // reading the spooled file from its own loop. Called with an empty chunk
+    // it only flushes the spool and wakes waiting readers.
+    void streamChunk(UploadState& upload, std::string_view chunk) {
+        const TransferHandle& handle = upload.transfer;
+        Transfer& transfer = *handle;
+        std::lock_guard<std::mutex> lock(transfer.streamMutex);
+        if (!transfer.waiting.empty()) {
+            upload.file.flush();
+        }
+        transfer.crc = crc32c(transfer.crc, chunk.data(), chunk.size());
+        transfer.hash.update(chunk.data(), chunk.size());
+        transfer.received = upload.received;
+        transfer.spooled = upload.file.written();
+
+        if (!transfer.live.empty() && !chunk.empty()) {
+            FrameRef frame = BufferPool::global().frame(FrameType::FileData, {chunk});
+            FrameRef packed;
+            bool packAttempted = false;
+            for (auto it = transfer.live.begin(); it != transfer.live.end();) {
+                auto reader = it->connection.lock();
+                if (reader && reader->canWrite()) {
+                    if (reader->compression && !packAttempted) {
+                        packed = compressFrame(FrameType::FileData, chunk);
+                        packAttempted = true;
+                    }
+                    if (reader->compression && packed) {
+                        reader->sendFileData(packed);
+                        countMetric(Counter::CompressionBytesSaved, frame->size() - packed->size());
+                    } else {
+                        reader->sendFileData(frame);
+                    }
+                    countMetric(Counter::FileBytesOut, chunk.size());
+                    it->offset += chunk.size();
+                    if (it->offset < transfer.size) {
+                        ++it;
+                        continue;
+                    }
                 }
+                resumeReader(*it, handle);
+                it = transfer.live.erase(it);
             }
         }
-        return clientName;
+
+        for (const StreamReader& reader : transfer.waiting) {
+            resumeReader(reader, handle);
+        }
+        transfer.waiting.clear();
     }
 
-    std::string getClientRoomID(SOCKET clientSocket) {
-        std::string roomID;
-        for (const auto& [rID, clients] : rooms) {
-            for (const auto& client : clients) {
-                if (client.socket == clientSocket) {
-                    roomID = rID;
-                    break;
-                }
+    void offerToRoom(const std::shared_ptr<Connection>& connection, const TransferHandle& transfer) {
+        std::string id = std::to_string(transfer->id);
+        std::string notification = "User " + getClientName(connection->id) + " wants to send you a file named '" + transfer->fileName + "' (" + std::to_string(transfer->size) + " bytes). Do you want to accept? (ACCEPT/NO, or ACCEPT " + id + "/NO " + id + " for this file only)";
+        FrameRef message = BufferPool::global().frame(FrameType::Notice, {notification});
+        std::vector<std::pair<SessionId, std::string>> recipients;
+        rooms.forEachMember(connection->session->getRoom(), [&](const ClientInfo& client) {
+            if (client.sessionId != connection->id) {
+                recipients.emplace_back(client.sessionId, client.name);
+                client.connection->deliver(message, false);
             }
+        });
+        transfers.offer(transfer, recipients);
+    }
+
+    void finishUpload(const std::shared_ptr<Connection>& connection) {
+        UploadState& upload = connection->upload;
+        connection->state = ConnState::Chat;
+
+        bool opened = upload.file.isOpen();
+        TransferHandle transfer = std::move(upload.transfer);
+        upload.transfer.reset();
+        if (!opened || !upload.file.close()) {
+            logError("Failed to write file: ", transfer->fileName);
+            cancelUpload(transfer);
+            connection->sendFrame(FrameType::Notice, "File upload failed: " + transfer->fileName);
+            sendAllReceived(connection, transfer->id);
+            return;
+        }
+
+        Sha256Digest digest;
+        uint32_t crc;
+        {
+            std::lock_guard<std::mutex> lock(transfer->streamMutex);
+            digest = transfer->hash.finish();
+            crc = transfer->crc;
+        }
+        if (transfer->declared && *transfer->declared != digest) {
+            logWarning("Upload of ", transfer->fileName, " does not match the SHA-256 its sender announced");
+            cancelUpload(transfer);
+            connection->sendFrame(FrameType::Notice, "File upload failed: the content does not match its hash: " + transfer->fileName);
+            sendAllReceived(connection, transfer->id);
+            return;
+        }
+        transfers.addToStore(transfer, digest, crc);
+
+        logInfo("File received: ", transfer->fileName, " (transfer ", transfer->id, ")");
+        countMetric(Counter::UploadsCompleted);
+        recordMetric(Metric::UploadBytesPerSecond, bytesPerSecond(transfer->size - upload.startOffset, upload.startedAt));
+        connection->session->stats.filesUploaded++;
+        {
+            std::lock_guard<std::mutex> lock(transfer->streamMutex);
+            transfer->received = transfer->spooled = transfer->size;
+            transfer->uploaded = true;
+            resumeAllReaders(transfer);
         }
-        return roomID;
+        // Tells the sender the server has it all, ahead of any AllReceived the next line may cause
+        sendFileAck(connection, transfer->id, transfer->size);
+        transfers.markStored(transfer);
     }
 
-    void sendRequest(const std::string& roomID, SOCKET senderSocket, const std::string& message) {
-        for (const auto& client : rooms[roomID]) {
-            if (client.socket != senderSocket) {
-                send(client.socket, message.c_str(), message.length(), 0);
+    // The sender's connection dropped mid-upload. Everything received so far
+    // is written out for readers, and the transfer waits for FileResume.
+    void suspendUpload(const std::shared_ptr<Connection>& connection) {
+        UploadState& upload = connection->upload;
+        TransferHandle transfer = std::move(upload.transfer);
+        upload.transfer.reset();
+        if (!upload.file.close()) {
+            cancelUpload(transfer);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(transfer->streamMutex);
+            transfer->spooled = transfer->received;
+            for (const StreamReader& reader : transfer->waiting) {
+                resumeReader(reader, transfer);
             }
+            transfer->waiting.clear();
+        }
+        logInfo("Upload of ", transfer->fileName, " interrupted at ", transfer->spooled, " bytes (transfer ", transfer->id, ")");
+        transfers.suspendUpload(transfer);
+    }
+
+    // The upload will never finish: recipients part-way through it are
+    // told, and the partial file is dropped
+    void cancelUpload(const TransferHandle& transfer) {
+        {
+            std::lock_guard<std::mutex> lock(transfer->streamMutex);
+            transfer->aborted = true;
+            resumeAllReaders(transfer);
         }
+        transfers.abandon(transfer);
     }
 
-    bool isDirectoryEmpty(const std::string& path) {
-        return std::filesystem::begin(std::filesystem::directory_iterator(path)) == std::filesystem::end(std::filesystem::directory_iterator(path));
+    void expireTransfers(std::chrono::seconds window) {
+        while (true) {
+            std::this_thread::sleep_for(std::chrono::seconds(1));
+            for (const TransferHandle& transfer : transfers.expire(window)) {
+                logInfo("Giving up on interrupted upload of ", transfer->fileName, " (transfer ", transfer->id, ")");
+                cancelUpload(transfer);
+            }
+        }
     }
 
-    void WSACleanup() {
-        WSACleanup();
+    static uint64_t bytesPerSecond(uint64_t bytes, uint64_t startedAt) {
+        uint64_t elapsed = std::max<uint64_t>(1, monotonicNanos() - startedAt);
+        return static_cast<uint64_t>(static_cast<double>(bytes) * 1e9 / static_cast<double>(elapsed));
+    }
+
+    // Point-in-time values added to every metrics scrape
+    void appendGauges(std::string& out) {
+        MetricsEndpoint::appendSample(out, "chat_sessions", "gauge", "", sessions.size());
+        out += "# TYPE chat_dispatch_queue_depth gauge\n";
+        std::vector<DispatcherWorkerStats> workers = dispatcher.stats();
+        for (size_t i = 0; i < workers.size(); i++) {
+            MetricsEndpoint::appendSample(out, "chat_dispatch_queue_depth", nullptr, "{worker=\"" + std::to_string(i) + "\"}", workers[i].queueDepth);
+        }
+        out += "# TYPE chat_mailbox_depth gauge\n";
+        for (const auto& loop : loops) {
+            MetricsEndpoint::appendSample(out, "chat_mailbox_depth", nullptr, "{loop=\"" + std::to_string(loop->getIndex()) + "\"}", loop->mailboxDepth());
+        }
+        MetricsEndpoint::appendSample(out, "chat_queued_bytes", "gauge", "", queuedChatBytes.load(std::memory_order_relaxed));
+        MetricsEndpoint::appendSample(out, "chat_blobs", "gauge", "", transfers.store().count());
+        MetricsEndpoint::appendSample(out, "chat_blob_bytes", "gauge", "", transfers.store().bytes());
+        if (federation) {
+            MetricsEndpoint::appendSample(out, "chat_peer_links", "gauge", "", federation->linksUp());
+            MetricsEndpoint::appendSample(out, "chat_remote_members", "gauge", "", federation->remoteMembers());
+        }
+        MetricsEndpoint::appendSample(out, "chat_log_lines_dropped_total", "counter", "", Logger::global().droppedLines());
+    }
+
+    std::string getClientName(SessionId sessionId) {
+        std::shared_ptr<Session> session = sessions.find(sessionId);
+        return session ? session->getName() : std::string();
+    }
+
+    void sendToSession(SessionId sessionId, const FrameRef& message) {
+        std::shared_ptr<Session> session = sessions.find(sessionId);
+        if (!session) {
+            return;
+        }
+        if (auto connection = session->connection.lock()) {
+            connection->send(message);
+        }
     }
 };
 
-int main() {
-    const int port = 12345;
-    Server server(port);
+ServerConfig parseArgs(int argc, char* argv[]) {
+    ServerConfig config;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        std::string option = argv[i];
+        std::string value = argv[i + 1];
+        if (option == "--port") {
+            config.port = std::stoi(value);
+        } else if (option == "--loops") {
+            config.loopThreads = std::stoi(value);
+        } else if (option == "--dispatch-threads") {
+            config.dispatchThreads = std::stoi(value);
+        } else if (option == "--dispatch-queue") {
+            config.dispatchQueueCapacity = std::stoul(value);
+        } else if (option == "--fanout-threads") {
+            config.fanoutThreads = std::stoi(value);
+        } else if (option == "--fanout-chunk") {
+            config.fanoutChunk = std::max<size_t>(1, std::stoul(value));
+        } else if (option == "--presence-window") {
+            config.presenceWindowMs = std::stoi(value);
+        } else if (option == "--presence-room-size") {
+            config.presenceRoomSize = std::stoul(value);
+        } else if (option == "--stats-interval") {
+            config.statsInterval = std::stoi(value);
+        } else if (option == "--file-chunk") {
+            config.fileChunkSize = std::clamp<size_t>(std::stoul(value), 1, kMaxFramePayload);
+        } else if (option == "--resume-window") {
+            config.resumeWindow = std::stoi(value);
+        } else if (option == "--blob-retention") {
+            config.blobRetention = std::max(0, std::stoi(value));
+        } else if (option == "--history-dir") {
+            config.history.directory = value;
+        } else if (option == "--history-backlog") {
+            config.history.backlog = std::stoul(value);
+        } else if (option == "--history-segment") {
+            config.history.segmentBytes = std::max<size_t>(4096, std::stoul(value));
+        } else if (option == "--history-segments") {
+            config.history.maxSegments = std::max<size_t>(1, std::stoul(value));
+        } else if (option == "--history-idle") {
+            config.history.idleSeconds = std::max(1, std::stoi(value));
+        } else if (option == "--history-commit-ms") {
+            config.history.commitDelayMs = std::max(0, std::stoi(value));
+        } else if (option == "--node-id") {
+            config.federation.nodeId = static_cast<uint32_t>(std::stoul(value));
+        } else if (option == "--peer-port") {
+            config.federation.peerPort = std::stoi(value);
+        } else if (option == "--peers") {
+            std::stringstream list(value);
+            for (std::string peer; std::getline(list, peer, ',');) {
+                if (!peer.empty()) {
+                    config.federation.peers.push_back(peer);
+                }
+            }
+        } else if (option == "--handoff") {
+            config.handoffPath = value;
+        } else if (option == "--compression") {
+            config.compression = value != "0";
+        } else if (option == "--pin-loops") {
+            config.pinLoops = value != "0";
+        } else if (option == "--io") {
+            config.io = value;
+        } else if (option == "--metrics-port") {
+            config.metricsPort = std::stoi(value);
+        } else if (option == "--out-high") {
+            config.outbound.highWatermark = std::stoul(value);
+        } else if (option == "--out-low") {
+            config.outbound.lowWatermark = std::stoul(value);
+        } else if (option == "--out-limit") {
+            config.outbound.hardLimit = std::stoul(value);
+        } else if (option == "--client-msgs") {
+            config.admission.client.messagesPerSecond = std::stod(value);
+        } else if (option == "--client-bytes") {
+            config.admission.client.bytesPerSecond = std::stod(value);
+        } else if (option == "--room-msgs") {
+            config.admission.room.messagesPerSecond = std::stod(value);
+        } else if (option == "--room-bytes") {
+            config.admission.room.bytesPerSecond = std::stod(value);
+        } else if (option == "--rate-burst") {
+            config.admission.burstSeconds = std::stod(value);
+        } else if (option == "--queue-limit") {
+            config.admission.queuedBytesLimit = std::stoul(value);
+        } else if (option == "--flood-policy") {
+            config.admission.policy = value == "delay" ? FloodPolicy::Delay : FloodPolicy::Reject;
+        } else if (option == "--slow-policy") {
+            config.outbound.policy = value == "disconnect" ? SlowConsumerPolicy::Disconnect : SlowConsumerPolicy::DropOldestChat;
+        } else {
+            logWarning("Unknown option: ", option);
+        }
+    }
+
+    // File data is queued whenever a reader is under the high watermark, so
+    // one chunk must fit under it, and a full watermark plus one chunk must
+    // fit under the hard limit, or a reader keeping up gets disconnected
+    const OutboundLimits& limits = config.outbound;
+    size_t maxChunk = limits.hardLimit > limits.highWatermark + kFrameHeaderSize
+        ? std::min(limits.highWatermark, limits.hardLimit - limits.highWatermark - kFrameHeaderSize)
+        : 0;
+    if (config.fileChunkSize > maxChunk) {
+        logError("--file-chunk ", config.fileChunkSize, " does not fit the outbound limits (--out-high ",
+                 limits.highWatermark, ", --out-limit ", limits.hardLimit, "); the largest chunk they allow is ", maxChunk);
+        Logger::global().flush();
+        exit(EXIT_FAILURE);
+    }
+    return config;
+}
+
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    Server server(parseArgs(argc, argv));
     server.start();
     return 0;
-};
\ No newline at end of file
+};
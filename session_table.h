@@ -0,0 +1,106 @@
+#pragma once
+
+#include "room_registry.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct SessionStats {
+    std::atomic<uint64_t> framesIn{0};
+    std::atomic<uint64_t> bytesIn{0};
+    std::atomic<uint64_t> chatMessages{0};
+    std::atomic<uint64_t> filesUploaded{0};
+};
+
+// Everything the server knows about one connected user. The owning event loop
+// writes it on join, leave and CHANGE; other threads read it through the
+// accessors, which copy under the session's own lock. The name never changes
+// after Hello, so it is handed out by reference without the lock.
+class Session {
+public:
+    const SessionId id;
+    const SOCKET socket;
+    const std::weak_ptr<Connection> connection;
+    SessionStats stats;
+
+    Session(SessionId id, SOCKET socket, std::string name, std::weak_ptr<Connection> connection)
+        : id(id), socket(socket), connection(std::move(connection)), name(std::move(name)) {}
+
+    const std::string& getName() const {
+        return name;
+    }
+
+    std::string getRoomID() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return roomID;
+    }
+
+    RoomRegistry::RoomHandle getRoom() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return room;
+    }
+
+    void moveTo(const std::string& newRoomID, RoomRegistry::RoomHandle newRoom) {
+        std::lock_guard<std::mutex> lock(mutex);
+        roomID = newRoomID;
+        room = std::move(newRoom);
+    }
+
+private:
+    const std::string name;
+    mutable std::mutex mutex;
+    std::string roomID;
+    RoomRegistry::RoomHandle room;
+};
+
+// Connection ID -> Session, so per-user lookups cost the same however many
+// users are online. Striped by ID so unrelated lookups rarely share a lock.
+class SessionTable {
+public:
+    explicit SessionTable(size_t stripeCount = 16) : stripes(stripeCount) {}
+
+    std::shared_ptr<Session> create(SessionId id, SOCKET socket, std::string name, std::weak_ptr<Connection> connection) {
+        auto session = std::make_shared<Session>(id, socket, std::move(name), std::move(connection));
+        Stripe& stripe = stripeFor(id);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        stripe.sessions[id] = session;
+        return session;
+    }
+
+    std::shared_ptr<Session> find(SessionId id) {
+        Stripe& stripe = stripeFor(id);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        auto it = stripe.sessions.find(id);
+        return it == stripe.sessions.end() ? nullptr : it->second;
+    }
+
+    void remove(SessionId id) {
+        Stripe& stripe = stripeFor(id);
+        std::lock_guard<std::mutex> lock(stripe.mutex);
+        stripe.sessions.erase(id);
+    }
+
+    size_t size() {
+        size_t total = 0;
+        for (auto& stripe : stripes) {
+            std::lock_guard<std::mutex> lock(stripe.mutex);
+            total += stripe.sessions.size();
+        }
+        return total;
+    }
+
+private:
+    struct alignas(64) Stripe {
+        std::mutex mutex;
+        std::unordered_map<SessionId, std::shared_ptr<Session>> sessions;
+    };
+
+    std::vector<Stripe> stripes;
+
+    Stripe& stripeFor(SessionId id) {
+        return stripes[id % stripes.size()];
+    }
+};
@@ -0,0 +1,255 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define SHA256_X86 1
+#elif defined(_M_X64) && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#define SHA256_X86 1
+#endif
+
+// SHA-256, the content address of stored uploads. A collision-resistant hash
+// is needed here: a client that could forge a match would get its bytes sent
+// in place of someone else's file.
+//
+//   Sha256 hash;
+//   hash.update(first, n);
+//   hash.update(second, m);
+//   Sha256Digest digest = hash.finish();
+//
+// Uses the x86 SHA extensions when the CPU has them (1-2 GB/s per core)
+// and plain C++ otherwise.
+using Sha256Digest = std::array<uint8_t, 32>;
+
+namespace sha256_detail {
+
+alignas(16) constexpr uint32_t kRound[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+inline uint32_t rotate(uint32_t value, int bits) {
+    return (value >> bits) | (value << (32 - bits));
+}
+
+inline uint32_t loadBigEndian(const unsigned char* data) {
+    return (uint32_t(data[0]) << 24) | (uint32_t(data[1]) << 16) | (uint32_t(data[2]) << 8) | uint32_t(data[3]);
+}
+
+inline void software(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    for (; blocks > 0; blocks--, data += 64) {
+        uint32_t w[64];
+        for (int i = 0; i < 16; i++) {
+            w[i] = loadBigEndian(data + 4 * i);
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = rotate(w[i - 15], 7) ^ rotate(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotate(w[i - 2], 17) ^ rotate(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t t1 = h + (rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25)) + ((e & f) ^ (~e & g)) + kRound[i] + w[i];
+            uint32_t t2 = (rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+}
+
+#if defined(SHA256_X86)
+// The state lives in two registers as ABEF and CDGH, the layout sha256rnds2
+// works on; each round instruction does two rounds
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("sha,sse4.1")))
+#endif
+inline void hardware(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i dcba = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0])), 0xB1);
+    __m128i hgfe = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4])), 0x1B);
+    __m128i abef = _mm_alignr_epi8(dcba, hgfe, 8);
+    __m128i cdgh = _mm_blend_epi16(hgfe, dcba, 0xF0);
+
+    for (; blocks > 0; blocks--, data += 64) {
+        __m128i savedAbef = abef;
+        __m128i savedCdgh = cdgh;
+        __m128i w[16];
+#if defined(__GNUC__) || defined(__clang__)
+#pragma GCC unroll 16
+#endif
+        for (int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i)), byteSwap);
+            } else {
+                w[i] = _mm_sha256msg1_epu32(w[i - 4], w[i - 3]);
+                w[i] = _mm_add_epi32(w[i], _mm_alignr_epi8(w[i - 1], w[i - 2], 4));
+                w[i] = _mm_sha256msg2_epu32(w[i], w[i - 1]);
+            }
+            __m128i message = _mm_add_epi32(w[i], _mm_load_si128(reinterpret_cast<const __m128i*>(&kRound[4 * i])));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(message, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, savedAbef);
+        cdgh = _mm_add_epi32(cdgh, savedCdgh);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+inline bool hardwareAvailable() {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 29)) != 0;
+#else
+    return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+#else
+inline void hardware(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    software(state, data, blocks);
+}
+
+inline bool hardwareAvailable() {
+    return false;
+}
+#endif
+
+} // namespace sha256_detail
+
+inline bool sha256Hardware() {
+    static const bool available = sha256_detail::hardwareAvailable();
+    return available;
+}
+
+class Sha256 {
+public:
+    explicit Sha256(bool useHardware = sha256Hardware()) : useHardware(useHardware) {}
+
+    void update(const void* data, size_t length) {
+        const auto* bytes = static_cast<const unsigned char*>(data);
+        total += length;
+        if (buffered > 0) {
+            size_t take = std::min(length, sizeof(block) - buffered);
+            std::memcpy(block + buffered, bytes, take);
+            buffered += take;
+            bytes += take;
+            length -= take;
+            if (buffered < sizeof(block)) {
+                return;
+            }
+            compress(block, 1);
+            buffered = 0;
+        }
+        if (length >= sizeof(block)) {
+            compress(bytes, length / sizeof(block));
+            bytes += length & ~(sizeof(block) - 1);
+            length &= sizeof(block) - 1;
+        }
+        std::memcpy(block, bytes, length);
+        buffered = length;
+    }
+
+    Sha256Digest finish() {
+        uint64_t bits = total * 8;
+        unsigned char padding[72] = {0x80};
+        size_t padLength = (buffered < 56 ? 56 : 120) - buffered;
+        for (int i = 0; i < 8; i++) {
+            padding[padLength + i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        }
+        update(padding, padLength + 8);
+
+        Sha256Digest digest;
+        for (int i = 0; i < 8; i++) {
+            digest[4 * i] = static_cast<uint8_t>(state[i] >> 24);
+            digest[4 * i + 1] = static_cast<uint8_t>(state[i] >> 16);
+            digest[4 * i + 2] = static_cast<uint8_t>(state[i] >> 8);
+            digest[4 * i + 3] = static_cast<uint8_t>(state[i]);
+        }
+        return digest;
+    }
+
+private:
+    uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    unsigned char block[64];
+    size_t buffered = 0;
+    uint64_t total = 0;
+    bool useHardware;
+
+    void compress(const unsigned char* data, size_t blocks) {
+        if (useHardware) {
+            sha256_detail::hardware(state, data, blocks);
+        } else {
+            sha256_detail::software(state, data, blocks);
+        }
+    }
+};
+
+inline Sha256Digest sha256(const void* data, size_t length) {
+    Sha256 hash;
+    hash.update(data, length);
+    return hash.finish();
+}
+
+inline std::string toHex(const Sha256Digest& digest) {
+    static const char digits[] = "0123456789abcdef";
+    std::string out;
+    out.reserve(digest.size() * 2);
+    for (uint8_t byte : digest) {
+        out.push_back(digits[byte >> 4]);
+        out.push_back(digits[byte & 0xF]);
+    }
+    return out;
+}
+
+// Parses 64 hex digits; false for anything else
+inline bool fromHex(const std::string& text, Sha256Digest& digest) {
+    if (text.size() != digest.size() * 2) {
+        return false;
+    }
+    auto value = [](char c) {
+        return c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    };
+    for (size_t i = 0; i < digest.size(); i++) {
+        int high = value(text[2 * i]);
+        int low = value(text[2 * i + 1]);
+        if (high < 0 || low < 0) {
+            return false;
+        }
+        digest[i] = static_cast<uint8_t>(high << 4 | low);
+    }
+    return true;
+}
@@ -0,0 +1,389 @@
+#pragma once
+
+#include "blob_store.h"
+#include "room_registry.h"
+#include "sha256.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using TransferId = uint64_t;
+
+class Connection;
+
+enum class RecipientState {
+    Pending,     // offered, no answer yet
+    Accepted,    // downloading
+    Interrupted, // disconnected mid-download; may come back and resume
+    Declined,    // said NO, or never came back
+    Done
+};
+
+// A recipient downloading while the upload is still arriving, and how far it has got
+struct StreamReader {
+    std::weak_ptr<Connection> connection;
+    uint64_t offset;
+};
+
+// One upload and everyone it was offered to. The file is stored under its
+// own transfer ID, so concurrent uploads of the same name never collide,
+// unless the content was already in the blob store and nothing was uploaded.
+class Transfer {
+public:
+    const TransferId id;
+    const std::string senderName; // only the same user may resume the upload
+    const std::string fileName;   // as the sender named it, shown to recipients
+    const std::filesystem::path path;
+    const uint64_t size;
+    const std::optional<Sha256Digest> declared; // the SHA-256 the sender announced, checked at the end
+    const bool fromStore;                       // path is a stored blob rather than this transfer's own file
+    std::atomic<SessionId> senderId; // changes when the upload is resumed from a new connection
+
+    // Upload progress and the recipients following it, guarded by streamMutex.
+    // Readers in `live` are level with `received` and get each new chunk from
+    // the sender's loop as it arrives; readers in `waiting` have read all of
+    // the spooled file and are woken when it grows.
+    std::mutex streamMutex;
+    uint64_t received = 0; // bytes the sender has delivered, all checksum-verified
+    uint64_t spooled = 0;  // bytes readable from the file
+    uint32_t crc = 0;      // CRC-32C of the first `received` bytes
+    Sha256 hash;           // SHA-256 of the first `received` bytes
+    bool uploaded = false;
+    bool aborted = false;
+    std::vector<StreamReader> live;
+    std::vector<StreamReader> waiting;
+
+    Transfer(TransferId id, SessionId senderId, std::string senderName, std::string fileName, std::filesystem::path path, uint64_t size,
+             std::optional<Sha256Digest> declared = std::nullopt, bool fromStore = false)
+        : id(id), senderName(std::move(senderName)), fileName(std::move(fileName)), path(std::move(path)), size(size),
+          declared(declared), fromStore(fromStore), senderId(senderId) {}
+
+private:
+    friend class TransferManager;
+
+    struct Recipient {
+        std::string name;
+        RecipientState state;
+        std::chrono::steady_clock::time_point interruptedAt;
+    };
+
+    bool offered = false;
+    bool stored = false;    // the whole upload is on disk
+    std::optional<Sha256Digest> blob; // the stored blob this transfer holds a reference to
+    bool suspended = false; // the sender disconnected mid-upload
+    std::chrono::steady_clock::time_point suspendedAt;
+    size_t outstanding = 0; // recipients still Pending, Accepted or Interrupted
+    std::unordered_map<SessionId, Recipient> recipients;
+};
+
+using TransferHandle = std::shared_ptr<Transfer>;
+
+// Tracks every live transfer and each recipient's answer. A transfer settles
+// once nobody is left Pending, Accepted or Interrupted: its own file is
+// deleted, its blob reference dropped, and onSettled runs so the sender can
+// be told. Only file-transfer events take the lock; chat never touches it.
+//
+// Dropped connections do not lose progress. An interrupted upload waits for
+// its sender to resume it, and an interrupted download keeps the recipient's
+// place, until expire() gives up on them.
+class TransferManager {
+public:
+    using SettledCallback = std::function<void(const Transfer&)>;
+    using Clock = std::chrono::steady_clock;
+
+    TransferManager(std::filesystem::path storagePath, std::chrono::seconds blobRetention, SettledCallback onSettled)
+        : storagePath(std::move(storagePath)), blobs(this->storagePath / "blobs", blobRetention), onSettled(std::move(onSettled)) {
+        std::filesystem::create_directories(this->storagePath);
+    }
+
+    // The next ID to be handed out. A process taking over from this one
+    // continues from it, so IDs already announced to clients are not reused.
+    TransferId peekNextId() {
+        std::lock_guard<std::mutex> lock(mutex);
+        return nextId;
+    }
+
+    void continueIdsFrom(TransferId next) {
+        std::lock_guard<std::mutex> lock(mutex);
+        nextId = std::max(nextId, next);
+    }
+
+    TransferHandle create(SessionId senderId, const std::string& senderName, const std::string& fileName, uint64_t size,
+                          std::optional<Sha256Digest> declared = std::nullopt) {
+        std::lock_guard<std::mutex> lock(mutex);
+        TransferId id = nextId++;
+        std::filesystem::path path = storagePath / std::to_string(id);
+        // A file left by an earlier run may be a link to a blob; writing through it would change the blob
+        std::error_code error;
+        std::filesystem::remove(path, error);
+        auto transfer = std::make_shared<Transfer>(id, senderId, senderName, fileName, path, size, declared);
+        transfers[id] = transfer;
+        return transfer;
+    }
+
+    // A transfer of content the store already has, complete from the start;
+    // null if the store does not have it
+    TransferHandle createFromStore(SessionId senderId, const std::string& senderName, const std::string& fileName,
+                                   const Sha256Digest& digest, uint64_t size) {
+        std::optional<BlobInfo> blob = blobs.acquire(digest, size);
+        if (!blob) {
+            return nullptr;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        TransferId id = nextId++;
+        auto transfer = std::make_shared<Transfer>(id, senderId, senderName, fileName, blob->path, size, digest, true);
+        transfer->received = transfer->spooled = size;
+        transfer->crc = blob->crc;
+        transfer->uploaded = true;
+        transfer->stored = true;
+        transfer->blob = digest;
+        transfers[id] = transfer;
+        return transfer;
+    }
+
+    // Files a finished upload in the blob store, so later uploads of the same content can skip sending it
+    void addToStore(const TransferHandle& transfer, const Sha256Digest& digest, uint32_t crc) {
+        if (!blobs.add(transfer->path, digest, transfer->size, crc)) {
+            return;
+        }
+        std::lock_guard<std::mutex> lock(mutex);
+        transfer->blob = digest;
+    }
+
+    BlobStore& store() {
+        return blobs;
+    }
+
+    // Everyone listed (session, user name) now has a Pending offer; they may
+    // accept while the upload is still arriving
+    void offer(const TransferHandle& transfer, const std::vector<std::pair<SessionId, std::string>>& recipientList) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            transfer->offered = true;
+            for (const auto& [recipient, name] : recipientList) {
+                if (transfer->recipients.emplace(recipient, Transfer::Recipient{name, RecipientState::Pending, {}}).second) {
+                    transfer->outstanding++;
+                    offers[recipient].push_back(transfer->id);
+                }
+            }
+        }
+        settleIfDone(transfer);
+    }
+
+    // The upload finished; the transfer can settle once its recipients are done
+    void markStored(const TransferHandle& transfer) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            transfer->stored = true;
+        }
+        settleIfDone(transfer);
+    }
+
+    // Accepts one offer, or every open offer when no ID is given. Returns the
+    // transfers the recipient should now download, oldest first. Naming a
+    // transfer this user was interrupted in the middle of picks it back up.
+    std::vector<TransferHandle> accept(SessionId recipient, const std::string& name, std::optional<TransferId> id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<TransferHandle> accepted = takeOffers(recipient, id);
+        for (const TransferHandle& transfer : accepted) {
+            transfer->recipients[recipient].state = RecipientState::Accepted;
+        }
+        if (accepted.empty() && id) {
+            auto it = transfers.find(*id);
+            if (it != transfers.end() && reclaim(*it->second, recipient, name)) {
+                accepted.push_back(it->second);
+            }
+        }
+        return accepted;
+    }
+
+    // Declines one offer, or every open offer; returns how many were declined
+    size_t decline(SessionId recipient, std::optional<TransferId> id) {
+        std::vector<TransferHandle> declined;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            declined = takeOffers(recipient, id);
+        }
+        for (const TransferHandle& transfer : declined) {
+            finish(transfer, recipient, RecipientState::Declined);
+        }
+        return declined.size();
+    }
+
+    // The recipient has the whole file
+    void complete(const TransferHandle& transfer, SessionId recipient) {
+        finish(transfer, recipient, RecipientState::Done);
+    }
+
+    // The download could not be served; counts as declined
+    void abort(const TransferHandle& transfer, SessionId recipient) {
+        finish(transfer, recipient, RecipientState::Declined);
+    }
+
+    // A recipient went away: open offers count as declined, accepted
+    // downloads are kept for it to resume
+    void dropRecipient(SessionId recipient, const std::vector<TransferHandle>& downloading) {
+        std::vector<TransferHandle> declined;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            declined = takeOffers(recipient, std::nullopt);
+            for (const TransferHandle& transfer : downloading) {
+                auto it = transfer->recipients.find(recipient);
+                if (it != transfer->recipients.end() && it->second.state == RecipientState::Accepted) {
+                    it->second.state = RecipientState::Interrupted;
+                    it->second.interruptedAt = Clock::now();
+                }
+            }
+        }
+        for (const TransferHandle& transfer : declined) {
+            finish(transfer, recipient, RecipientState::Declined);
+        }
+    }
+
+    // The sender went away mid-upload; the transfer waits for FileResume
+    void suspendUpload(const TransferHandle& transfer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        transfer->suspended = true;
+        transfer->suspendedAt = Clock::now();
+    }
+
+    // Hands a suspended upload to the same user on a new connection
+    TransferHandle resumeUpload(TransferId id, SessionId senderId, const std::string& senderName) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = transfers.find(id);
+        if (it == transfers.end() || !it->second->suspended || it->second->senderName != senderName) {
+            return nullptr;
+        }
+        it->second->suspended = false;
+        it->second->senderId = senderId;
+        return it->second;
+    }
+
+    // Gives up on recipients interrupted longer than `window` and returns the
+    // uploads suspended that long, for the caller to cancel
+    std::vector<TransferHandle> expire(Clock::duration window) {
+        Clock::time_point cutoff = Clock::now() - window;
+        std::vector<std::pair<TransferHandle, SessionId>> lapsed;
+        std::vector<TransferHandle> stale;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (const auto& [id, transfer] : transfers) {
+                if (transfer->suspended && transfer->suspendedAt < cutoff) {
+                    stale.push_back(transfer);
+                }
+                for (const auto& [recipient, entry] : transfer->recipients) {
+                    if (entry.state == RecipientState::Interrupted && entry.interruptedAt < cutoff) {
+                        lapsed.emplace_back(transfer, recipient);
+                    }
+                }
+            }
+        }
+        for (const auto& [transfer, recipient] : lapsed) {
+            finish(transfer, recipient, RecipientState::Declined);
+        }
+        return stale;
+    }
+
+    // The upload will never complete; forget the transfer and its partial file
+    void abandon(const TransferHandle& transfer) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            transfers.erase(transfer->id);
+        }
+        discard(*transfer);
+    }
+
+private:
+    std::mutex mutex;
+    std::filesystem::path storagePath;
+    BlobStore blobs;
+    SettledCallback onSettled;
+    TransferId nextId = 1;
+    std::unordered_map<TransferId, TransferHandle> transfers;
+    std::unordered_map<SessionId, std::vector<TransferId>> offers; // open offers per recipient, oldest first
+
+    // Removes and returns the recipient's open offers (all, or just `id`). Caller holds the lock.
+    std::vector<TransferHandle> takeOffers(SessionId recipient, std::optional<TransferId> id) {
+        std::vector<TransferHandle> taken;
+        auto open = offers.find(recipient);
+        if (open == offers.end()) {
+            return taken;
+        }
+
+        std::vector<TransferId>& ids = open->second;
+        for (auto it = ids.begin(); it != ids.end();) {
+            if (id && *it != *id) {
+                ++it;
+                continue;
+            }
+            auto transfer = transfers.find(*it);
+            if (transfer != transfers.end()) {
+                taken.push_back(transfer->second);
+            }
+            it = ids.erase(it);
+        }
+        if (ids.empty()) {
+            offers.erase(open);
+        }
+        return taken;
+    }
+
+    // Moves an interrupted download by `name` over to its new session. Caller holds the lock.
+    bool reclaim(Transfer& transfer, SessionId recipient, const std::string& name) {
+        for (auto it = transfer.recipients.begin(); it != transfer.recipients.end(); ++it) {
+            if (it->second.state == RecipientState::Interrupted && it->second.name == name) {
+                Transfer::Recipient entry = it->second;
+                entry.state = RecipientState::Accepted;
+                transfer.recipients.erase(it);
+                transfer.recipients[recipient] = entry;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void finish(const TransferHandle& transfer, SessionId recipient, RecipientState outcome) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto it = transfer->recipients.find(recipient);
+            if (it == transfer->recipients.end() || it->second.state == RecipientState::Declined || it->second.state == RecipientState::Done) {
+                return;
+            }
+            it->second.state = outcome;
+            transfer->outstanding--;
+        }
+        settleIfDone(transfer);
+    }
+
+    void settleIfDone(const TransferHandle& transfer) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!transfer->offered || !transfer->stored || transfer->outstanding > 0 || transfers.erase(transfer->id) == 0) {
+                return;
+            }
+        }
+        discard(*transfer);
+        onSettled(*transfer);
+    }
+
+    // The transfer is gone from the table, so nothing else touches its blob field
+    void discard(Transfer& transfer) {
+        if (!transfer.fromStore) {
+            std::error_code error;
+            std::filesystem::remove(transfer.path, error);
+        }
+        if (transfer.blob) {
+            blobs.release(*transfer.blob);
+        }
+    }
+};
@@ -0,0 +1,300 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+// Minimal io_uring over the raw system calls: one submission and one
+// completion ring, plus a ring of provided buffers that multishot receives
+// pick from. Everything happens on the thread that owns the ring.
+//
+// Some kernels register a buffer ring and then never hand its buffers out
+// (every receive fails with ENOBUFS), so the ring is tried with one receive
+// at setup. If that fails, buffers are given back with PROVIDE_BUFFERS
+// requests instead, which ride along with the next submission.
+class IoUring {
+public:
+    static constexpr uint16_t kBufferGroup = 0;
+
+    // Whether this kernel has what the backend relies on: multishot accept
+    // and receive, provided buffer rings and cancel-by-descriptor. They all
+    // arrived by 6.0, the release that also added SEND_ZC, so probing for
+    // that opcode stands in for a version check.
+    static bool supported() {
+        static const bool result = []() {
+            io_uring_params params{};
+            int fd = static_cast<int>(syscall(__NR_io_uring_setup, 4, &params));
+            if (fd < 0) {
+                return false;
+            }
+            size_t size = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+            std::unique_ptr<char[]> storage(new char[size]());
+            auto* probe = reinterpret_cast<io_uring_probe*>(storage.get());
+            bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+                      probe->last_op >= IORING_OP_SEND_ZC && (params.features & IORING_FEAT_NODROP) != 0;
+            for (int op : {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+                           IORING_OP_PROVIDE_BUFFERS}) {
+                ok = ok && op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+            }
+            ::close(fd);
+            return ok;
+        }();
+        return result;
+    }
+
+    IoUring(unsigned entries, unsigned bufferCount, unsigned bufferSize) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+        params.cq_entries = entries * 4; // multishot operations post many completions per submission
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (fd < 0) {
+            return;
+        }
+
+        sqRingSize = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        sqRing = mapRing(std::max(sqRingSize, cqRingSize), IORING_OFF_SQ_RING);
+        cqRing = sqRing;
+        sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mapRing(sqesSize, IORING_OFF_SQES));
+        if (sqRing == nullptr || sqes == nullptr || (params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+            release();
+            return;
+        }
+
+        char* sq = static_cast<char*>(sqRing);
+        sqHead = reinterpret_cast<std::atomic<uint32_t>*>(sq + params.sq_off.head);
+        sqTail = reinterpret_cast<std::atomic<uint32_t>*>(sq + params.sq_off.tail);
+        sqMask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+        sqEntries = params.sq_entries;
+        uint32_t* array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+        for (uint32_t i = 0; i < sqEntries; i++) {
+            array[i] = i; // SQEs are used in ring order, so the indirection is the identity
+        }
+        char* cq = static_cast<char*>(cqRing);
+        cqHead = reinterpret_cast<std::atomic<uint32_t>*>(cq + params.cq_off.head);
+        cqTail = reinterpret_cast<std::atomic<uint32_t>*>(cq + params.cq_off.tail);
+        cqMask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        localTail = sqTail->load(std::memory_order_relaxed);
+        submittedTail = localTail;
+
+        if (!registerBuffers(bufferCount, bufferSize)) {
+            release();
+        }
+    }
+
+    ~IoUring() {
+        release();
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    bool valid() const {
+        return fd >= 0;
+    }
+
+    // A zeroed SQE to fill in; pushes queued ones to the kernel first when
+    // the submission ring is full
+    io_uring_sqe* sqe() {
+        if (localTail - sqHead->load(std::memory_order_acquire) == sqEntries) {
+            enter(0, 0);
+        }
+        io_uring_sqe* entry = &sqes[localTail & sqMask];
+        std::memset(entry, 0, sizeof(*entry));
+        localTail++;
+        return entry;
+    }
+
+    // Submits everything queued since the last call and, when waitFor > 0,
+    // blocks until that many completions are ready. One system call either way.
+    int enter(unsigned waitFor, unsigned flags = IORING_ENTER_GETEVENTS) {
+        sqTail->store(localTail, std::memory_order_release);
+        unsigned pending = localTail - submittedTail;
+        while (true) {
+            int result = static_cast<int>(syscall(__NR_io_uring_enter, fd, pending, waitFor,
+                                                  waitFor > 0 ? flags | IORING_ENTER_GETEVENTS : flags, nullptr, 0));
+            if (result >= 0) {
+                submittedTail += static_cast<unsigned>(result);
+                return result;
+            }
+            if (errno == EINTR && pending == 0) {
+                return 0;
+            }
+            if (errno != EINTR) {
+                return -errno;
+            }
+        }
+    }
+
+    unsigned queued() const {
+        return localTail - submittedTail;
+    }
+
+    // Runs fn(cqe) for every completion posted so far
+    template <typename Callback>
+    unsigned forEachCompletion(Callback&& fn) {
+        uint32_t head = cqHead->load(std::memory_order_relaxed);
+        uint32_t tail = cqTail->load(std::memory_order_acquire);
+        unsigned count = 0;
+        for (; head != tail; head++, count++) {
+            fn(cqes[head & cqMask]);
+        }
+        cqHead->store(head, std::memory_order_release);
+        return count;
+    }
+
+    // Where a multishot receive put its data, from the completion's flags
+    const char* buffer(uint32_t cqeFlags) const {
+        return buffers.get() + static_cast<size_t>(cqeFlags >> IORING_CQE_BUFFER_SHIFT) * bufferSize;
+    }
+
+    // Hands a consumed buffer back to the kernel
+    void recycle(uint32_t cqeFlags) {
+        uint16_t id = static_cast<uint16_t>(cqeFlags >> IORING_CQE_BUFFER_SHIFT);
+        if (bufferRing == nullptr) {
+            provide(id, 1);
+            return;
+        }
+        io_uring_buf& slot = bufferRing->bufs[bufferTail & (bufferCount - 1)];
+        slot.addr = reinterpret_cast<uint64_t>(buffers.get() + static_cast<size_t>(id) * bufferSize);
+        slot.len = static_cast<uint32_t>(bufferSize);
+        slot.bid = id;
+        bufferTail++;
+        reinterpret_cast<std::atomic<uint16_t>*>(&bufferRing->tail)->store(bufferTail, std::memory_order_release);
+    }
+
+private:
+    int fd = -1;
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqesSize = 0;
+    std::atomic<uint32_t>* sqHead = nullptr;
+    std::atomic<uint32_t>* sqTail = nullptr;
+    uint32_t sqMask = 0;
+    uint32_t sqEntries = 0;
+    uint32_t localTail = 0;     // SQEs handed out
+    uint32_t submittedTail = 0; // SQEs the kernel has taken
+    std::atomic<uint32_t>* cqHead = nullptr;
+    std::atomic<uint32_t>* cqTail = nullptr;
+    uint32_t cqMask = 0;
+    io_uring_cqe* cqes = nullptr;
+
+    io_uring_buf_ring* bufferRing = nullptr;
+    size_t bufferRingSize = 0;
+    std::unique_ptr<char[]> buffers;
+    unsigned bufferCount = 0;
+    size_t bufferSize = 0;
+    uint16_t bufferTail = 0;
+
+    void* mapRing(size_t size, off_t offset) {
+        void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+        return memory == MAP_FAILED ? nullptr : memory;
+    }
+
+    // bufferCount must be a power of two
+    bool registerBuffers(unsigned count, unsigned size) {
+        bufferCount = count;
+        bufferSize = size;
+        buffers.reset(new char[static_cast<size_t>(count) * size]);
+        bufferRingSize = count * sizeof(io_uring_buf);
+        void* memory = mmap(nullptr, bufferRingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED) {
+            bufferRing = static_cast<io_uring_buf_ring*>(memory);
+            io_uring_buf_reg registration{};
+            registration.ring_addr = reinterpret_cast<uint64_t>(bufferRing);
+            registration.ring_entries = count;
+            registration.bgid = kBufferGroup;
+            if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &registration, 1) == 0) {
+                for (unsigned id = 0; id < count; id++) {
+                    recycle(id << IORING_CQE_BUFFER_SHIFT);
+                }
+                if (receivesIntoBuffers()) {
+                    return true;
+                }
+                syscall(__NR_io_uring_register, fd, IORING_UNREGISTER_PBUF_RING, &registration, 1);
+            }
+            munmap(bufferRing, bufferRingSize);
+            bufferRing = nullptr;
+        }
+
+        provide(0, count);
+        return receivesIntoBuffers();
+    }
+
+    // One receive of a byte written to a socketpair, waited for here
+    bool receivesIntoBuffers() {
+        int pair[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) != 0) {
+            return false;
+        }
+        char byte = 0;
+        bool received = false;
+        if (::write(pair[1], &byte, 1) == 1) {
+            io_uring_sqe* entry = sqe();
+            entry->opcode = IORING_OP_RECV;
+            entry->fd = pair[0];
+            entry->flags = IOSQE_BUFFER_SELECT;
+            entry->buf_group = kBufferGroup;
+            entry->user_data = 1;
+            // Other completions are PROVIDE_BUFFERS ones, which nobody waits for
+            for (bool done = false; !done && enter(1) >= 0;) {
+                forEachCompletion([this, &received, &done](const io_uring_cqe& cqe) {
+                    if (cqe.user_data != 1) {
+                        return;
+                    }
+                    done = true;
+                    if (cqe.res == 1 && (cqe.flags & IORING_CQE_F_BUFFER) != 0) {
+                        received = true;
+                        recycle(cqe.flags);
+                    }
+                });
+            }
+        }
+        ::close(pair[0]);
+        ::close(pair[1]);
+        return received;
+    }
+
+    // The older interface: a request that hands count buffers from id on to the kernel
+    void provide(uint16_t id, unsigned count) {
+        io_uring_sqe* entry = sqe();
+        entry->opcode = IORING_OP_PROVIDE_BUFFERS;
+        entry->fd = static_cast<int>(count);
+        entry->addr = reinterpret_cast<uint64_t>(buffers.get() + static_cast<size_t>(id) * bufferSize);
+        entry->len = static_cast<uint32_t>(bufferSize);
+        entry->buf_group = kBufferGroup;
+        entry->off = id;
+    }
+
+    void release() {
+        if (bufferRing != nullptr) {
+            munmap(bufferRing, bufferRingSize);
+            bufferRing = nullptr;
+        }
+        if (sqes != nullptr) {
+            munmap(sqes, sqesSize);
+            sqes = nullptr;
+        }
+        if (sqRing != nullptr) {
+            munmap(sqRing, std::max(sqRingSize, cqRingSize));
+            sqRing = cqRing = nullptr;
+        }
+        if (fd >= 0) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+};